@@ -119,10 +119,12 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
-// A TLB shootdown request.
+// A TLB shootdown request, for up to TLBSHOOTDOWN_PAGES pages of as.
+#define TLBSHOOTDOWN_PAGES 8
 struct tlbshootdown {
     struct addrspace *as;
-	vaddr_t vaddr;
+	vaddr_t vaddrs[TLBSHOOTDOWN_PAGES];
+	unsigned npages;
     struct semaphore *sem;  // Communicates when CPUs finish shootdowns.
 };
 
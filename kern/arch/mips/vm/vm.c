@@ -45,6 +45,11 @@
 #include <vfs.h>
 #include <vm.h>
 #include <synch.h>
+#include <thread.h>
+#include <wchan.h>
+#include <objcache.h>
+#include <platform/maxcpus.h>
+#include <clock.h>
 #include "opt-vm_perf.h"
 
 // At boot coremap is disabled until it has been initialized.
@@ -54,9 +59,11 @@ static int coremap_enabled = 0;
 // interrupt handlers which can deadlock if they go to sleep.
 static struct spinlock coremap_lock;
 
-// evict_lock is the gatekeeper for performing an operation that modifies
-// a foreign process' page table.  To avoid a deadlock, we require this
-// locking order:
+// Several threads may evict pages at once.  A page being evicted,
+// cleaned or paged in is marked VM_CORE_BUSY in the coremap so no
+// other thread selects it, and threads needing that page sleep on its
+// wait channel (see wait_for_page).  To avoid a deadlock, we require
+// this locking order:
 //
 // 0. Release all VM locks (coremap_lock/pages_lock) before any operation
 // that may trigger an eviction:
@@ -65,20 +72,24 @@ static struct spinlock coremap_lock;
 //      an eviction to swap in).
 //    * NOTE: Touching kernel memory won't trigger evictions because it
 //      is never swapped out.
-// 1. Lock evict_lock (sleep lock)
+//    Faults also read executables through VOP_READ (see as_load_page),
+//    so user memory must never be touched while holding a filesystem
+//    lock either: file I/O syscalls copy through a kernel buffer
+//    between VOP calls (see file_io).
+// 1. Lock as_list_lock (sleep lock) to find the owners of a page.
 // 2. Lock as->pages_lock (sleep lock)
 // 3. Lock coremap (spinlock)
 // 4. Modify coremap and page table togther as one atomic edit.
 // 5. Release coremap
 // 6. Release as->pages_lock
-// 7. Release vm_lock
 //
-// This order avoids a deadlock where two processes are trying to evict
-// from the other's page table, for example.  The process which grabs
-// vm_lock first will block the other from locking any page tables.  It
-// also ensures the operation does not leave the coremap and page table
-// in an inconsistent state.
-static struct lock *evict_lock;
+// A thread may only block on the page table lock of its own address
+// space (or one it created, see as_copy).  Foreign page tables are
+// locked with lock_tryacquire, and an evicting thread which fails
+// picks another page instead.  So two threads evicting from each
+// other's page tables cannot deadlock, and an address space found on
+// as_list cannot be destroyed while we hold its pages_lock, since
+// as_destroy locks it after removing it from the list.
 
 // Acquire coremap_lock before accessing any of these shared variables.
 static paddr_t firstpaddr;  // First byte that can be allocated.
@@ -86,19 +97,170 @@ static paddr_t lastpaddr;   // Last byte that can be allocated.
 static struct core_page *coremap;
 static unsigned used_bytes;
 static unsigned page_max;  // Total number of allocatable pages.
-static unsigned next_fit;  // Coremap index to resume free page search.
+
+// Free pages are managed as a binary buddy system.  Every free block
+// is 2^order pages, starts at a coremap index that is a multiple of
+// its size, and is on free_lists[order].  Allocations take the
+// smallest block that fits and give back the unused tail, so a used
+// block is exactly as long as requested; freeing splits it into
+// aligned blocks again and merges each with its buddy while the
+// buddy is free.
+#define COREMAP_ORDERS 16  // Largest block is 2^15 pages.
+static unsigned free_lists[COREMAP_ORDERS];  // Head block index, or 0.
+static unsigned free_counts[COREMAP_ORDERS];  // Blocks on each list.
+
+// Per-cpu caches of free pages, so most single-page allocations and
+// frees stay off coremap_lock.  A cached page looks like an allocated
+// kernel page in the coremap and is counted in used_bytes, so
+// used_bytes and peak_used_bytes only change when PAGECACHE_BATCH
+// pages move between a cache and the buddy lists.  coremap_used_bytes()
+// drains the caches first so it stays exact.
+//
+// Each cache also keeps a pool of pages zeroed by the idle loop, which
+// alloc_pages() prefers so it can skip the bzero.  Zeroed pages look
+// like cached pages in the coremap but are still free as far as
+// used_bytes is concerned; zeroed_pages counts them instead, so idle
+// zeroing never changes what coremap_used_bytes() reports.
+#define PAGECACHE_SIZE 16
+#define PAGECACHE_BATCH 8
+#define ZEROPOOL_SIZE 32
+struct pagecache {
+	struct spinlock pc_lock;
+	unsigned pc_count;
+	unsigned pc_pages[PAGECACHE_SIZE];  // Coremap indexes.
+	unsigned pc_nzeroed;
+	unsigned pc_zeroed[ZEROPOOL_SIZE];  // Coremap indexes of zeroed pages.
+};
+static struct pagecache pagecaches[MAXCPUS];
+static unsigned zeroed_pages = 0;  // Pages in zeroed pools.
 
 // Swap system globals.
 #define SWAP_PATH "lhd0raw:"  
 static struct bitmap *swapmap;
+static uint16_t *swap_refs;  // Page table entries referencing each swap block.
+
+// Maximum pages written to or read from swap in one request.  Dirty
+// pages following an evicted page in the same address space are
+// written with it to consecutive swap blocks, and read back together.
+#define SWAP_CLUSTER 8
+#define SWAP_READAHEAD 4
+// Blocks searched for a run of free swap blocks.
+#define SWAP_RUN_SEARCH 256
+static unsigned swap_rotor = 0;  // Resume search for free swap blocks.
+
+// Swap disk is divided into regions of SWAP_REGION_PAGES blocks with
+// a free block count for each, so full regions are skipped without
+// scanning swapmap and free space is known in constant time.  New
+// address spaces are spread over regions so each swaps to its own
+// extent of the disk (see swap_extent_hint).
+#define SWAP_REGION_PAGES 256
+static unsigned swap_regions;
+static unsigned *swap_region_free;  // Free blocks in each region.
+static unsigned swap_free_blocks;  // Free blocks on swap disk.
+
+// Maximum address spaces sharing a page which can be evicted.
+#define EVICT_MAX_OWNERS 16
+
+// lock_page_owners failures.  Busy owners are a passing condition, a
+// page with too many owners stays unevictable while they all map it.
+#define OWNERS_BUSY (-1)
+#define OWNERS_TOO_MANY (-2)
+
+// Text page cache.  Read-only pages of executables are hashed by
+// (vnode, file offset) so every address space running the same
+// executable maps the same frames, shared like copy on write pages.
+// Entries come from text_cache rather than the coremap, so pages that
+// never hold text pay nothing for it, and are hashed by coremap index
+// as well to be found when their page is freed.  Cached pages are
+// flagged VM_CORE_TEXT.  Both tables are protected by coremap_lock;
+// entries are allocated and freed without it.  A page stays cached
+// while anything maps it.  It is shared by at most EVICT_MAX_OWNERS
+// address spaces so it can still be evicted, any more get private
+// copies.
+#define TEXT_HASH_SIZE 64
+
+struct text_page {
+	struct vnode *tp_vn;  // Executable the page was read from.
+	off_t tp_offset;  // File offset of the page.
+	unsigned tp_page;  // coremap index of the page.
+	struct text_page *tp_next;  // Next on its text_hash chain.
+	struct text_page *tp_page_next;  // Next on its text_pages chain.
+};
+
+static struct text_page *text_hash[TEXT_HASH_SIZE];
+static struct text_page *text_pages[TEXT_HASH_SIZE];
+static struct objcache *text_cache;
+
+static struct text_page *text_remove(unsigned p);
+static void text_page_free(struct text_page *tp);
+
+// Threads waiting for a busy page sleep on one of these, chosen by
+// coremap index.
+#define PAGE_WCHANS 32
+static struct wchan *page_wchans[PAGE_WCHANS];
+
+// flag_page_as_dirty return value for a page shared copy on write.
+#define VM_PAGE_SHARED 2
 static struct lock *swapmap_lock;
 static struct vnode *swapdisk_vn;
 static struct lock *swapdisk_lock;
 static size_t swapdisk_pages;
 static int swap_enabled = 0;  // Swap is only enabled if swap disk is found.
 
-// Tracks when TLB shootdowns complete.
+// A TLB refill for a resident page also maps up to TLB_PREFETCH
+// following pages that are resident, so sequential sweeps over big
+// arrays take one refill trap per run of pages instead of one per page.
+// sys161's TLB has no large pages, so this is how refills are amortised.
+#define TLB_PREFETCH 3
+
+// TLB entries are tagged with an address space ID so they survive
+// context switches.  Each cpu hands out its own ASIDs 1..NUM_TLBPID-1
+// (0 is left for kernel threads) and records them in as->asids[] as
+// generation << ASID_GEN_SHIFT | asid.  When a cpu runs out it starts a
+// new generation and flushes its TLB, which invalidates every ASID it
+// gave out before.  Only the owning cpu touches its tlbasid, at splhigh.
+// Generations wrap after ASID_GEN_MAX rollovers; an address space left
+// unscheduled on a cpu for that long could then match a reused ASID,
+// which we accept.
+#define ASID_GEN_SHIFT TLBHI_PIDSHIFT
+#define ASID_GEN_MAX (1U << (32 - ASID_GEN_SHIFT))
+struct tlbasid {
+	uint32_t ta_gen;  // Current generation.
+	uint32_t ta_next;  // Next ASID to hand out.
+	uint32_t ta_pid;  // Current ASID, shifted into TLBHI_PID.
+	uint32_t ta_sweep;  // Next slot vm_tlb_sweep samples.
+};
+static struct tlbasid tlbasids[MAXCPUS];
+
+static void touch_paddr(paddr_t paddr);
+
+// Tracks when TLB shootdowns complete.  Only one shootdown may be
+// outstanding at a time since all share the semaphore.
 static struct semaphore *tlbshootdown_sem;
+static struct lock *tlbshootdown_lock;
+
+// Pageout daemon writes dirty pages to swap ahead of eviction.  It is
+// woken when free pages drop below pageout_low and cleans until free
+// plus clean user pages reach pageout_high.
+static struct wchan *pageout_wchan = NULL;
+static unsigned pageout_low;
+static unsigned pageout_high;
+static unsigned clean_hand = 0;  // Pageout daemon index into coremap.
+static unsigned clock_hand = 0;  // WSClock hand, index into coremap.
+// User pages not dirty, kept current by core_set_as and core_set_dirty
+// so the daemon need not scan the coremap for them.  Protected by
+// coremap_lock.
+static unsigned clean_user_pages = 0;
+#define PAGEOUT_LOW_DIVISOR 16   // Low watermark is 1/16 of memory.
+#define PAGEOUT_HIGH_DIVISOR 8   // High watermark is 1/8 of memory.
+
+static void pageout_bootstrap(void);
+
+// Kernel caches register functions to give memory back when free
+// pages run out (see vm_register_reclaim).
+#define VM_MAX_RECLAIMERS 4
+static vm_reclaim_func reclaimers[VM_MAX_RECLAIMERS];
+static unsigned num_reclaimers = 0;
 
 #if OPT_VM_PERF
 static unsigned tlb_faults = 0;
@@ -106,6 +268,19 @@ static unsigned swap_ins = 0;
 static unsigned swap_outs = 0;
 static unsigned faults = 0;
 static unsigned evictions = 0;
+static unsigned cow_faults = 0;
+static unsigned clock_steps = 0;
+static unsigned tlb_sweeps = 0;
+static unsigned pages_cleaned = 0;
+static unsigned swap_requests = 0;
+static unsigned zero_hits = 0;
+static unsigned zero_misses = 0;
+static unsigned tlb_prefetches = 0;
+static unsigned asid_rollovers = 0;
+static unsigned shootdown_ipis = 0;
+static unsigned file_ins = 0;
+static unsigned file_drops = 0;
+static unsigned text_hits = 0;
 static unsigned peak_used_bytes = 0;
 
 static struct spinlock vm_perf_lock;
@@ -122,6 +297,19 @@ void reset_vm_perf() {
 	swap_outs = 0;
 	faults = 0;
 	evictions = 0;
+	cow_faults = 0;
+	clock_steps = 0;
+	tlb_sweeps = 0;
+	pages_cleaned = 0;
+	swap_requests = 0;
+	zero_hits = 0;
+	zero_misses = 0;
+	tlb_prefetches = 0;
+	asid_rollovers = 0;
+	shootdown_ipis = 0;
+	file_ins = 0;
+	file_drops = 0;
+	text_hits = 0;
 	peak_used_bytes = 0;
 	spinlock_release(&vm_perf_lock);
 }
@@ -156,13 +344,104 @@ void count_eviction() {
 	spinlock_release(&vm_perf_lock);
 }
 
+void count_cow_fault() {
+	spinlock_acquire(&vm_perf_lock);
+	cow_faults++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_clock_steps(unsigned steps) {
+	spinlock_acquire(&vm_perf_lock);
+	clock_steps += steps;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_tlb_sweep() {
+	spinlock_acquire(&vm_perf_lock);
+	tlb_sweeps++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_page_cleaned() {
+	spinlock_acquire(&vm_perf_lock);
+	pages_cleaned++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_swap_request() {
+	spinlock_acquire(&vm_perf_lock);
+	swap_requests++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_tlb_prefetch() {
+	spinlock_acquire(&vm_perf_lock);
+	tlb_prefetches++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_asid_rollover() {
+	spinlock_acquire(&vm_perf_lock);
+	asid_rollovers++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_shootdown_ipis(unsigned n) {
+	spinlock_acquire(&vm_perf_lock);
+	shootdown_ipis += n;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_file_in() {
+	spinlock_acquire(&vm_perf_lock);
+	file_ins++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_file_drop() {
+	spinlock_acquire(&vm_perf_lock);
+	file_drops++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_text_hit() {
+	spinlock_acquire(&vm_perf_lock);
+	text_hits++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_zero_hit() {
+	spinlock_acquire(&vm_perf_lock);
+	zero_hits++;
+	spinlock_release(&vm_perf_lock);
+}
+
+void count_zero_miss() {
+	spinlock_acquire(&vm_perf_lock);
+	zero_misses++;
+	spinlock_release(&vm_perf_lock);
+}
+
 void dump_vm_perf() {
 	spinlock_acquire(&vm_perf_lock);
 	kprintf("tlb_faults = %8d\n", tlb_faults);
+	kprintf("tlb_prefetches = %8d\n", tlb_prefetches);
+	kprintf("asid_rollovers = %8d\n", asid_rollovers);
+	kprintf("shootdown_ipis = %8d\n", shootdown_ipis);
 	kprintf("swap_ins   = %8d\n", swap_ins);
 	kprintf("swap_outs  = %8d\n", swap_outs);
+	kprintf("file_ins   = %8d\n", file_ins);
+	kprintf("file_drops = %8d\n", file_drops);
+	kprintf("text_hits  = %8d\n", text_hits);
 	kprintf("evictions  = %8d\n", evictions);
 	kprintf("faults     = %8d\n", faults);
+	kprintf("cow_faults = %8d\n", cow_faults);
+	kprintf("clock_steps = %8d\n", clock_steps);
+	kprintf("tlb_sweeps = %8d\n", tlb_sweeps);
+	kprintf("pages_cleaned = %8d\n", pages_cleaned);
+	kprintf("swap_requests = %8d\n", swap_requests);
+	kprintf("zero_hits  = %8d\n", zero_hits);
+	kprintf("zero_misses = %8d\n", zero_misses);
 	kprintf("peak_used_bytes = 0x%8x\n", peak_used_bytes);
 	spinlock_release(&vm_perf_lock);
 }
@@ -188,14 +467,6 @@ void spinlock_release_coremap() {
 	spinlock_release(&coremap_lock);
 }
 
-void lock_acquire_evict() {
-	lock_acquire(evict_lock);
-}
-
-void lock_release_evict() {
-	lock_release(evict_lock);
-}
-
 /*
  * Enable/disable swap.
  *
@@ -223,14 +494,171 @@ set_swap_enabled(int enabled)
 	return old_state;
 }
 
+/*
+ * Marks block_index used in swapmap.
+ *
+ * Caller is responsible for locking swapmap.
+ */
+static void
+swap_mark_block(unsigned block_index)
+{
+	KASSERT(lock_do_i_hold(swapmap_lock));
+	bitmap_mark(swapmap, block_index);
+	KASSERT(swap_region_free[block_index / SWAP_REGION_PAGES] > 0);
+	swap_region_free[block_index / SWAP_REGION_PAGES]--;
+	swap_free_blocks--;
+}
+
 /*
  * Marks block_index free in swapmap.
+ *
+ * Caller is responsible for locking swapmap.
+ */
+static void
+swap_unmark_block(unsigned block_index)
+{
+	KASSERT(lock_do_i_hold(swapmap_lock));
+	bitmap_unmark(swapmap, block_index);
+	swap_region_free[block_index / SWAP_REGION_PAGES]++;
+	swap_free_blocks++;
+}
+
+/*
+ * Drops a reference to block_index and marks it free in swapmap
+ * once no page table entries reference it.
  */
 void
 free_swapmap_block(int block_index)
 {
 	lock_acquire(swapmap_lock);
-	bitmap_unmark(swapmap, block_index);
+	KASSERT(swap_refs[block_index] > 0);
+	swap_refs[block_index]--;
+	if (swap_refs[block_index] == 0) {
+		swap_unmark_block(block_index);
+	}
+	lock_release(swapmap_lock);
+}
+
+/*
+ * Allocates up to npages consecutive free swap blocks.
+ *
+ * Searches regions in order starting from the one containing *hint,
+ * skipping regions with too few free blocks to beat the longest run
+ * found so far.  Stops at the first run of npages, or once
+ * SWAP_RUN_SEARCH blocks have been scanned and some run was found.
+ * Runs do not cross region boundaries.
+ *
+ * Caller is responsible for locking swapmap.
+ *
+ * Args:
+ *   npages: Number of blocks wanted.
+ *   hint: Block to search from, updated to follow the run allocated.
+ *     NULL to use the global rotor.
+ *   block_index: Returns first block of run.
+ *
+ * Returns:
+ *   Number of blocks allocated, 0 if swap is full.
+ */
+static unsigned
+swap_alloc_run(unsigned npages, unsigned *hint, unsigned *block_index)
+{
+	unsigned r, r0;
+	unsigned b, first, last;
+	unsigned run;
+	unsigned scanned = 0;
+	unsigned best = 0;
+	unsigned best_start = 0;
+
+	KASSERT(lock_do_i_hold(swapmap_lock));
+	KASSERT(npages > 0);
+
+	if (swap_free_blocks == 0) {
+		return 0;
+	}
+	if (hint == NULL) {
+		hint = &swap_rotor;
+	}
+	if (*hint >= swapdisk_pages) {
+		*hint = 0;
+	}
+	r0 = *hint / SWAP_REGION_PAGES;
+	// The first region is visited twice: from *hint to its end, and
+	// after all others from its start to *hint.
+	for (unsigned i = 0; i <= swap_regions; i++) {
+		r = (r0 + i) % swap_regions;
+		if (swap_region_free[r] <= best) {
+			continue;
+		}
+		first = r * SWAP_REGION_PAGES;
+		last = first + SWAP_REGION_PAGES;
+		if (last > swapdisk_pages) {
+			last = swapdisk_pages;
+		}
+		if (i == 0) {
+			first = *hint;
+		} else if (i == swap_regions) {
+			last = *hint;
+		}
+		run = 0;
+		for (b = first; b < last; b++) {
+			if (bitmap_isset(swapmap, b)) {
+				run = 0;
+				continue;
+			}
+			run++;
+			if (run > best) {
+				best = run;
+				best_start = b + 1 - run;
+				if (best == npages) {
+					break;
+				}
+			}
+		}
+		scanned += last - first;
+		if ((best == npages) || ((best > 0) && (scanned >= SWAP_RUN_SEARCH))) {
+			break;
+		}
+	}
+	KASSERT(best > 0);
+	for (b = best_start; b < best_start + best; b++) {
+		swap_mark_block(b);
+	}
+	*hint = (best_start + best) % swapdisk_pages;
+	*block_index = best_start;
+	return best;
+}
+
+/*
+ * Returns swap block a new address space should allocate from.
+ *
+ * Successive address spaces start in successive regions so pages of
+ * different processes are not interleaved on disk.
+ */
+unsigned
+swap_extent_hint()
+{
+	unsigned hint;
+
+	if (!swap_enabled) {
+		return 0;
+	}
+	lock_acquire(swapmap_lock);
+	hint = swap_rotor - (swap_rotor % SWAP_REGION_PAGES);
+	swap_rotor = (hint + SWAP_REGION_PAGES) % swapdisk_pages;
+	lock_release(swapmap_lock);
+	return hint;
+}
+
+/*
+ * Adds a reference to block_index for a page table entry sharing it.
+ */
+void
+share_swapmap_block(int block_index)
+{
+	lock_acquire(swapmap_lock);
+	KASSERT(bitmap_isset(swapmap, block_index));
+	KASSERT(swap_refs[block_index] < 0xffff);
+	swap_refs[block_index]++;
 	lock_release(swapmap_lock);
 }
 
@@ -240,18 +668,62 @@ free_swapmap_block(int block_index)
 size_t
 swap_used_pages()
 {
-	size_t p;
-	size_t used = 0;
+	size_t used;
 
 	KASSERT(swap_enabled);
 	lock_acquire(swapmap_lock);
-	for (p = 0; p < swapdisk_pages; p++) {
-        if (bitmap_isset(swapmap, p)) {
-			used++;
+	used = swapdisk_pages - swap_free_blocks;
+	lock_release(swapmap_lock);
+	return used;
+}
+
+/*
+ * Prints swap disk free space and fragmentation.
+ *
+ * A free run is a maximal range of consecutive free blocks.
+ * Fragmentation is the percentage of free blocks outside the
+ * longest free run.
+ */
+void
+dump_swap_frag()
+{
+	unsigned runs = 0;
+	unsigned run = 0;
+	unsigned longest = 0;
+	unsigned full_regions = 0;
+	unsigned free_blocks;
+
+	if (!swap_enabled) {
+		return;
+	}
+	lock_acquire(swapmap_lock);
+	for (unsigned b = 0; b < swapdisk_pages; b++) {
+		if (bitmap_isset(swapmap, b)) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			runs++;
+		}
+		run++;
+		if (run > longest) {
+			longest = run;
+		}
+	}
+	for (unsigned r = 0; r < swap_regions; r++) {
+		if (swap_region_free[r] == 0) {
+			full_regions++;
 		}
 	}
+	free_blocks = swap_free_blocks;
 	lock_release(swapmap_lock);
-	return used;
+
+	kprintf("swap_free_blocks = %8u of %u\n", free_blocks, swapdisk_pages);
+	kprintf("swap_free_runs = %8u\n", runs);
+	kprintf("swap_longest_run = %8u\n", longest);
+	kprintf("swap_full_regions = %8u of %u\n", full_regions, swap_regions);
+	kprintf("swap_frag = %8u%%\n",
+	        free_blocks ? 100 * (free_blocks - longest) / free_blocks : 0);
 }
 
 static unsigned get_core_npages(unsigned page_index)
@@ -259,665 +731,1927 @@ static unsigned get_core_npages(unsigned page_index)
     return (coremap[page_index].status) & VM_CORE_NPAGES;
 }
 
-static unsigned set_core_status(int used, int accessed, int dirty, unsigned npages)
+static unsigned set_core_status(int used, int dirty, unsigned npages)
 {
     return (used ? VM_CORE_USED : 0) | 
-           (accessed ? VM_CORE_ACCESSED : 0) | 
            (dirty ? VM_CORE_DIRTY : 0) |
            (npages & VM_CORE_NPAGES);
 }
 
 /*
- * Print contents of coremap for deubbing.
+ * Sets the address space owning page p, NULL for none, keeping
+ * clean_user_pages up to date.
+ *
  * Caller is responsible for locking coremap.
  */
-static void 
-dump_coremap()
+static void
+core_set_as(unsigned p, struct addrspace *as)
 {
-	unsigned p;
-	unsigned npages;
-	unsigned status;
-	
 	KASSERT(spinlock_do_i_hold(&coremap_lock));
-	for (p = 0; p < page_max; p += npages) {
-		npages = get_core_npages(p);
-		status = coremap[p].status;
-		kprintf("coremap[%3u]: status=0x%08x, paddr=0x%08x, as=0x%08x, vaddr=0x%08x, npages=%u\n", 
-		  p, status, core_idx_to_paddr(p), (vaddr_t)coremap[p].as, coremap[p].vaddr, npages);
+	if (!(coremap[p].status & VM_CORE_DIRTY)) {
+		if (coremap[p].as != NULL) {
+			KASSERT(clean_user_pages > 0);
+			clean_user_pages--;
+		}
+		if (as != NULL) {
+			clean_user_pages++;
+		}
 	}
+	coremap[p].as = as;
 }
 
-/* 
- * Returns 1 if pages are found in coremap belonging to addrspace as,
- * else 0.
+/*
+ * Sets or clears the dirty flag of page p, keeping clean_user_pages
+ * up to date.
  *
- * This is a debugging tool only.
+ * Caller is responsible for locking coremap.
  */
-int
-as_in_coremap(struct addrspace *as)
+static void
+core_set_dirty(unsigned p, bool dirty)
 {
-	unsigned p;
-	int found_as = 0;
-
-	spinlock_acquire(&coremap_lock);
-	for (p = 0; p < page_max;) {
-		if (coremap[p].as == as) {
-            found_as = 1;
-			break;
-		}
-		p += get_core_npages(p);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (dirty == ((coremap[p].status & VM_CORE_DIRTY) != 0)) {
+		return;
+	}
+	if (dirty) {
+		coremap[p].status |= VM_CORE_DIRTY;
+	} else {
+		coremap[p].status &= ~VM_CORE_DIRTY;
+	}
+	if (coremap[p].as == NULL) {
+		return;
+	}
+	if (dirty) {
+		KASSERT(clean_user_pages > 0);
+		clean_user_pages--;
+	} else {
+		clean_user_pages++;
 	}
-	spinlock_release(&coremap_lock);
-	return found_as;
-}
-
-void lock_and_dump_coremap()
-{
-    spinlock_acquire(&coremap_lock);
-	dump_coremap();
-	spinlock_release(&coremap_lock);
 }
 
 /*
- * Converts coremap index to physical address.
+ * Returns the head of the coremap block holding page p.  Only a
+ * block's head has a page count; pages inside it have status 0.
+ *
+ * Caller is responsible for locking coremap.
  */
-paddr_t
-core_idx_to_paddr(unsigned p)
+static unsigned
+core_block_head(unsigned p)
 {
-    return (paddr_t)(p * PAGE_SIZE);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	p %= page_max;
+	while (get_core_npages(p) == 0) {
+		// Page 0 always heads the block holding the coremap.
+		KASSERT(p > 0);
+		p--;
+	}
+	return p;
 }
 
-/* 
- * Converts physical address to coremap index.
+/*
+ * Moves the clock and pageout daemon hands to p if they are inside
+ * the npages block starting there, so a merge never leaves a hand on
+ * a page that lost its page count.  Hands left inside a block by a
+ * multi-page allocation are moved back by core_block_head instead.
+ *
+ * Caller is responsible for locking coremap.
  */
-unsigned
-paddr_to_core_idx(paddr_t paddr)
+static void
+core_hands_to_head(unsigned p, unsigned npages)
 {
-    return (unsigned)(paddr / PAGE_SIZE);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if ((clock_hand > p) && (clock_hand < p + npages)) {
+		clock_hand = p;
+	}
+	if ((clean_hand > p) && (clean_hand < p + npages)) {
+		clean_hand = p;
+	}
 }
 
 /*
- * Returns addrspace that paddr belongs to.
+ * Returns the smallest buddy order whose blocks hold npages.
  */
-struct addrspace 
-*vm_get_as(paddr_t paddr)
+static unsigned
+buddy_order(unsigned npages)
 {
-    unsigned p;
-	struct addrspace *as;
+	unsigned order = 0;
 
-	KASSERT(spinlock_do_i_hold(&coremap_lock));
-	p = paddr_to_core_idx(paddr);
-	as = coremap[p].as;
-	return as;
+	while ((1U << order) < npages) {
+		order++;
+	}
+	return order;
 }
 
 /*
- * Returns virtual address mapped to paddr.
+ * Makes the 2^order pages at p a free block and puts it on its list.
+ *
+ * Caller is responsible for locking coremap.
  */
-vaddr_t
-vm_get_vaddr(paddr_t paddr)
+static void
+buddy_insert(unsigned p, unsigned order)
 {
-    unsigned p;
-    vaddr_t vaddr;
+	unsigned head;
 
 	KASSERT(spinlock_do_i_hold(&coremap_lock));
-	p = paddr_to_core_idx(paddr);
-	vaddr = coremap[p].vaddr;
-	return vaddr;
+	KASSERT((p & ((1U << order) - 1)) == 0);
+	coremap[p].status = set_core_status(/*used=*/0, 0, 1U << order);
+	coremap[p].as = NULL;
+	coremap[p].vaddr = (vaddr_t)NULL;
+	coremap[p].refs = 0;
+	head = free_lists[order];
+	coremap[p].prev = 0;
+	coremap[p].next = head;
+	if (head != 0) {
+		coremap[head].prev = p;
+	}
+	free_lists[order] = p;
+	free_counts[order]++;
 }
 
 /*
- * Invalidates one entry in TLB.
+ * Takes the free block at p off its list.
  *
+ * Caller is responsible for locking coremap.
  */
-static void 
-vm_tlb_remove(vaddr_t vaddr)
+static void
+buddy_remove(unsigned p, unsigned order)
 {
-	uint32_t ehi;
-	int spl;
-	int idx;
-
-	spl = splhigh();
-	ehi = vaddr & PAGE_FRAME;
-	idx = tlb_probe(ehi, 0);
-	if (idx >= 0) {
-        tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (coremap[p].prev != 0) {
+		coremap[coremap[p].prev].next = coremap[p].next;
+	} else {
+		KASSERT(free_lists[order] == p);
+		free_lists[order] = coremap[p].next;
 	}
-	splx(spl);
+	if (coremap[p].next != 0) {
+		coremap[coremap[p].next].prev = coremap[p].prev;
+	}
+	coremap[p].next = 0;
+	coremap[p].prev = 0;
+	free_counts[order]--;
 }
 
 /*
- * Invalidates all entries in TLB.
+ * Frees the 2^order pages at p, merging with the buddy block for as
+ * long as the buddy is a whole free block of the same order.
  *
+ * Caller is responsible for locking coremap.
  */
-void 
-vm_tlb_erase()
+static void
+buddy_free_block(unsigned p, unsigned order)
 {
-	int spl;
+	unsigned buddy;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-	for (int i = 0; i < NUM_TLB; i++) {
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	while (order < COREMAP_ORDERS - 1) {
+		buddy = p ^ (1U << order);
+		if (buddy + (1U << order) > page_max) {
+			break;
+		}
+		// Pages inside a block have npages 0, so this only
+		// matches the head of a free block of this order.
+		if ((coremap[buddy].status & VM_CORE_USED) ||
+		    get_core_npages(buddy) != (1U << order)) {
+			break;
+		}
+		buddy_remove(buddy, order);
+		// The upper half is now inside the merged block.
+		coremap[p > buddy ? p : buddy].status = 0;
+		p = p < buddy ? p : buddy;
+		order++;
+		core_hands_to_head(p, 1U << order);
 	}
-	splx(spl);
+	buddy_insert(p, order);
 }
 
 /*
- * Sanity check to confirm coremap appears valid.
+ * Frees npages pages starting at p as the largest aligned blocks
+ * that fit.  The pages need not be a power of two or aligned.
  *
  * Caller is responsible for locking coremap.
- *
- * Returns:
- *   0 if coremap is valid, else panics.
  */
-int
-validate_coremap()
+static void
+buddy_free_range(unsigned p, unsigned npages)
 {
-	unsigned p;
-	unsigned used_pages = 0;
+	unsigned end = p + npages;
+	unsigned order;
+
+	while (p < end) {
+		order = 0;
+		while ((order < COREMAP_ORDERS - 1) &&
+		       ((p & ((2U << order) - 1)) == 0) &&
+		       (p + (2U << order) <= end)) {
+			order++;
+		}
+		buddy_free_block(p, order);
+		p += 1U << order;
+	}
+}
+
+/*
+ * Prints free block counts by order and fragmentation of free memory.
+ * Caller is responsible for locking coremap.
+ */
+static void
+dump_coremap_frag(void)
+{
+	unsigned order;
 	unsigned free_pages = 0;
-	unsigned npages;
-    unsigned status;
+	unsigned largest = 0;
 
 	KASSERT(spinlock_do_i_hold(&coremap_lock));
-    KASSERT(next_fit < page_max);
-	for (p = 0; p < page_max; p += npages) {
-		if (p > 0) {
-			KASSERT(coremap[p].prev == p - npages);
+	for (order = 0; order < COREMAP_ORDERS; order++) {
+		if (free_counts[order] == 0) {
+			continue;
 		}
+		kprintf("coremap_order[%2u] = %8u blocks\n", order,
+		        free_counts[order]);
+		free_pages += free_counts[order] << order;
+		largest = 1U << order;
+	}
+	kprintf("coremap_free_pages = %8u of %u\n", free_pages, page_max);
+	kprintf("coremap_largest_block = %8u\n", largest);
+	kprintf("coremap_frag = %8u%%\n",
+	        free_pages ? 100 * (free_pages - largest) / free_pages : 0);
+}
+
+/*
+ * Print contents of coremap for deubbing.
+ * Caller is responsible for locking coremap.
+ */
+static void 
+dump_coremap()
+{
+	unsigned p;
+	unsigned npages;
+	unsigned status;
+	
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (p = 0; p < page_max; p += npages) {
 		npages = get_core_npages(p);
 		status = coremap[p].status;
-        if (status & VM_CORE_USED) {
-			used_pages += npages;
-			if (coremap[p].as == NULL) {
-				// Kernel page.
-                KASSERT(coremap[p].vaddr >= MIPS_KSEG0);
-                KASSERT(coremap[p].vaddr < MIPS_KSEG1);
-            } else {
-				// User page.
-                KASSERT(coremap[p].vaddr < MIPS_KSEG0);
-				// We only support allocating user pages one at a time.
-				KASSERT(npages == 1);
-            }
-		} else {
-			free_pages += npages;
-		}
+		kprintf("coremap[%3u]: status=0x%08x, paddr=0x%08x, as=0x%08x, vaddr=0x%08x, npages=%u, refs=%u\n", 
+		  p, status, core_idx_to_paddr(p), (vaddr_t)coremap[p].as, coremap[p].vaddr, npages,
+		  coremap[p].refs);
 	}
-	if (used_pages * PAGE_SIZE != used_bytes) {
-		kprintf("used_pages = %u\n", used_pages);
-		kprintf("used_bytes = %u\n", used_bytes);
-		dump_coremap();
-		panic("(used_pages * PAGE_SIZE) (%u) != used_bytes (%u)",
-		  used_pages * PAGE_SIZE, used_bytes);
-	}
-	if (used_pages + free_pages != page_max) {
-		kprintf("used_pages = %u\n", used_pages);
-		kprintf("free_pages = %u\n", free_pages);
-		kprintf("page_max = %u\n", page_max);
-		dump_coremap();
-		panic("(used_pages + free_pages) (%u) != page_max (%u)",
-		  used_pages + free_pages, page_max);
-	}
-
-	return 0;
+	dump_coremap_frag();
 }
 
-/*
- * Initializes the physical to virtual memory map.
+/* 
+ * Returns 1 if pages are found in coremap belonging to addrspace as,
+ * else 0.
  *
- * Must be run after ram_bootstrap().
+ * This is a debugging tool only.
  */
-void
-vm_init_coremap()
+int
+as_in_coremap(struct addrspace *as)
 {
-	size_t total_bytes;  // total bytes in physical memory.
-	size_t coremap_bytes;
-	paddr_t kernel_top;  // Immediately above kernel code.
-	paddr_t coremap_paddr;
 	unsigned p;
+	int found_as = 0;
 
-	// Optional: dynamic data structures can be kmalloc'd here
-	// before the coremap is enabled.  Any pre-coremap allocated
-	// memory, however, will never be freed.
+	spinlock_acquire(&coremap_lock);
+	for (p = 0; p < page_max;) {
+		if (coremap[p].as == as) {
+            found_as = 1;
+			break;
+		}
+		p += get_core_npages(p);
+	}
+	spinlock_release(&coremap_lock);
+	return found_as;
+}
 
-	lastpaddr = ram_getsize();
-	// RAM initialization can only occur once and locks in any
-	// memory allocated with ram_stealmem().  We cannot make
-	// further calls to ram_stealmem().
-	kernel_top = ram_getfirstfree();
-	KASSERT((kernel_top & PAGE_FRAME) == kernel_top);
+void lock_and_dump_coremap()
+{
+    spinlock_acquire(&coremap_lock);
+	dump_coremap();
+	spinlock_release(&coremap_lock);
+}
 
-	// Total memory in bytes minus the kernel code.
-	total_bytes = lastpaddr;
-	page_max = paddr_to_core_idx(total_bytes);
-	coremap_bytes = page_max * sizeof(struct core_page);
-	coremap_paddr = kernel_top;
+/*
+ * Converts coremap index to physical address.
+ */
+paddr_t
+core_idx_to_paddr(unsigned p)
+{
+    return (paddr_t)(p * PAGE_SIZE);
+}
 
-	// First allocatable page is above coremap and page aligned up.
-	firstpaddr = coremap_paddr + coremap_bytes;
-	firstpaddr = (firstpaddr + PAGE_SIZE - 1) & PAGE_FRAME;
+/* 
+ * Converts physical address to coremap index.
+ */
+unsigned
+paddr_to_core_idx(paddr_t paddr)
+{
+    return (unsigned)(paddr / PAGE_SIZE);
+}
 
-	// From this point, we will be accessing coremap directly, so
-	// convert to a direct mapped virtual address and zero out.
-	coremap = (struct core_page *)PADDR_TO_KVADDR(coremap_paddr);
-	bzero((void *)coremap, coremap_bytes);	
-	// Mark kernel and coremap pages as allocated in coremap.
-	p = paddr_to_core_idx(firstpaddr);
-	coremap[0].status = set_core_status(1, 0, 0, p);
-	coremap[0].as = NULL;
-	coremap[0].vaddr = (vaddr_t)MIPS_KSEG0;
-	coremap[0].prev = 0;
-	// Mark remainder of pages as one big free block.
-	KASSERT(p < page_max);
-	coremap[p].status = set_core_status(0, 0, 0, page_max - p);
-	coremap[p].prev = 0;
-	next_fit = p;
-	// Includes kernel and coremap in used_bytes.
-	used_bytes = p * PAGE_SIZE;
+/*
+ * Returns addrspace that paddr belongs to.
+ */
+struct addrspace 
+*vm_get_as(paddr_t paddr)
+{
+    unsigned p;
+	struct addrspace *as;
 
-	// Switch from ram_stealmem allocater to coremap.
-	coremap_enabled = 1;
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	p = paddr_to_core_idx(paddr);
+	as = coremap[p].as;
+	return as;
+}
 
-	spinlock_acquire(&coremap_lock);
-	KASSERT(validate_coremap() == 0);
-	spinlock_release(&coremap_lock);
+/*
+ * Returns 1 if paddr has been shared copy on write, else 0.
+ */
+int
+vm_is_shared(paddr_t paddr)
+{
+	unsigned p;
 
-	kprintf("\nvm_init_coremap\n");
-	kprintf("lastpaddr  = 0x%08x\n", lastpaddr);
-	kprintf("firstpaddr = 0x%08x\n", firstpaddr);
-	kprintf("coremap    = 0x%08x\n", coremap_paddr);
-	kprintf("page_max   = %u\n", page_max);
-	kprintf("\n");
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	p = paddr_to_core_idx(paddr);
+	return (coremap[p].status & VM_CORE_SHARED) ? 1 : 0;
 }
 
 /*
- * Initializes virtual memory swap system at boot.
+ * Reclaim hook for kmalloc: empty its per-cpu caches so partly used
+ * heap pages can drain back to the coremap.
+ */
+static unsigned
+kheap_reclaim(unsigned npages)
+{
+	(void)npages;
+	return kheap_drain();
+}
+
+/*
+ * Marks the kernel page at kvaddr as a kmalloc subpage page holding
+ * blocks of size index tag. The tag is cleared when the page is
+ * freed.
  */
 void
-vm_bootstrap(void)
+coremap_set_ktag(vaddr_t kvaddr, unsigned tag)
 {
-    char vfs_path[PATH_MAX];
-    const mode_t unused_mode = 0x777;
-	struct stat statbuf;
-    int result;
+	unsigned p;
 
-    // Lock for modifying both coremap and a page table.
-    evict_lock = lock_create("evict");
-	if (evict_lock == NULL) {
-		panic("vm_bootstrap: Cannot create evict_lock.");
-	}
-	// vfs_open destructively uses filepath, so pass in a copy.
-	strcpy(vfs_path, SWAP_PATH);
-	result = vfs_open(vfs_path, O_RDWR, unused_mode, &swapdisk_vn);
-	if (result) {
-		kprintf("Swap DISABLED.\n");
-        swap_enabled = 0;
-        return;
+	KASSERT(tag <= (VM_CORE_KTAG >> VM_CORE_KTAG_SHIFT));
+	if (!coremap_enabled) {
+		return;
 	}
-	kprintf("Swap ENABLED.\n");
-	swap_enabled = 1;
-	result = VOP_STAT(swapdisk_vn, &statbuf);
-	swapdisk_pages = (int)(statbuf.st_size / PAGE_SIZE);
-	swapmap = bitmap_create(swapdisk_pages);
-	if (swapmap == NULL) {
-		vfs_close(swapdisk_vn);		
-		panic("vm_bootstrap: Cannot create swapmap.");
+	p = paddr_to_core_idx(KVADDR_TO_PADDR(kvaddr));
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[p].status & VM_CORE_USED);
+	KASSERT(coremap[p].as == NULL);
+	coremap[p].status &= ~VM_CORE_KTAG;
+	coremap[p].status |= VM_CORE_KHEAP | (tag << VM_CORE_KTAG_SHIFT);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Returns the kmalloc tag of the kernel page containing kvaddr, or -1
+ * if the page is not a tagged subpage page (including pages allocated
+ * before the coremap came up).
+ *
+ * Reads without the coremap lock: the caller owns a block on the
+ * page, so the page can't be freed or retagged under us.
+ */
+int
+coremap_get_ktag(vaddr_t kvaddr)
+{
+	paddr_t paddr;
+	uint32_t status;
+
+	if (!coremap_enabled || kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1) {
+		return -1;
 	}
-	swapmap_lock = lock_create("swapmap");
-	if (swapmap_lock == NULL) {
-		bitmap_destroy(swapmap);
-		vfs_close(swapdisk_vn);
-		panic("vm_bootstrap: Cannot create swapmap lock.");
+	paddr = KVADDR_TO_PADDR(kvaddr);
+	if (paddr < firstpaddr || paddr >= lastpaddr) {
+		return -1;
 	}
-	swapdisk_lock = lock_create("swapdisk");
-	if (swapdisk_lock == NULL) {
-		lock_destroy(swapmap_lock);
-		bitmap_destroy(swapmap);
-		vfs_close(swapdisk_vn);
-		panic("vm_bootstrap: Cannot create swapdisklock.");
+	status = coremap[paddr_to_core_idx(paddr)].status;
+	if (!(status & VM_CORE_KHEAP)) {
+		return -1;
 	}
-	kprintf("Total swapdisk pages %u\n", swapdisk_pages);
+	return (status & VM_CORE_KTAG) >> VM_CORE_KTAG_SHIFT;
+}
 
-	tlbshootdown_sem = sem_create("tlbshootdown", 0);
-	if (tlbshootdown_sem == NULL) {
-        panic("vm_bootstrap: Could not create tlbshootdown_sem");
-    }
-#if OPT_VM_PERF
-    init_vm_perf();
-#endif
+/*
+ * Returns virtual address mapped to paddr.
+ */
+vaddr_t
+vm_get_vaddr(paddr_t paddr)
+{
+    unsigned p;
+    vaddr_t vaddr;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	p = paddr_to_core_idx(paddr);
+	vaddr = coremap[p].vaddr;
+	return vaddr;
+}
+
+/*
+ * Returns this cpu's current ASID shifted into TLBHI_PID.
+ *
+ * Caller must be at splhigh so we can't migrate.
+ */
+static uint32_t
+tlb_curpid(void)
+{
+	KASSERT(curthread->t_curspl > 0);
+	return tlbasids[curcpu->c_number].ta_pid;
+}
+
+/*
+ * Invalidates the entry for vaddr in the current address space.
+ *
+ */
+static void 
+vm_tlb_remove(vaddr_t vaddr)
+{
+	uint32_t ehi;
+	int spl;
+	int idx;
+
+	spl = splhigh();
+	ehi = (vaddr & PAGE_FRAME) | tlb_curpid();
+	idx = tlb_probe(ehi, 0);
+	if (idx >= 0) {
+        tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+		tlb_setpid(tlb_curpid());
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidates the entry for vaddr in as, which need not be the
+ * current address space.  If as has no ASID on this cpu in the
+ * current generation it has no entries here either.
+ */
+static void
+vm_tlb_remove_as(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbasid *ta;
+	uint32_t asid, ehi;
+	int spl;
+	int idx;
+
+	spl = splhigh();
+	ta = &tlbasids[curcpu->c_number];
+	asid = as->asids[curcpu->c_number];
+	if ((asid >> ASID_GEN_SHIFT) == ta->ta_gen) {
+		ehi = (vaddr & PAGE_FRAME) |
+			((asid << TLBHI_PIDSHIFT) & TLBHI_PID);
+		idx = tlb_probe(ehi, 0);
+		if (idx >= 0) {
+			tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+		}
+		tlb_setpid(ta->ta_pid);
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidates all entries in TLB.
+ *
+ */
+void 
+vm_tlb_erase()
+{
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	for (int i = 0; i < NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(tlb_curpid());
+	splx(spl);
+}
+
+/*
+ * Makes as the current address space in this cpu's TLB, giving it a
+ * new ASID if it has none from the current generation.  Running out
+ * of ASIDs starts a new generation, the only time switching address
+ * spaces flushes the TLB.
+ */
+void
+vm_tlb_activate(struct addrspace *as)
+{
+	struct tlbasid *ta;
+	uint32_t asid;
+	int spl;
+
+	spl = splhigh();
+	ta = &tlbasids[curcpu->c_number];
+	asid = as->asids[curcpu->c_number];
+	if ((asid >> ASID_GEN_SHIFT) != ta->ta_gen) {
+		if (ta->ta_next == NUM_TLBPID) {
+			ta->ta_gen++;
+			if (ta->ta_gen == ASID_GEN_MAX) {
+				ta->ta_gen = 1;
+			}
+			ta->ta_next = 1;
+			vm_tlb_erase();
+#if OPT_VM_PERF
+			count_asid_rollover();
+#endif
+		}
+		asid = (ta->ta_gen << ASID_GEN_SHIFT) | ta->ta_next++;
+		as->asids[curcpu->c_number] = asid;
+	}
+	ta->ta_pid = (asid << TLBHI_PIDSHIFT) & TLBHI_PID;
+	tlb_setpid(ta->ta_pid);
+	splx(spl);
+}
+
+/*
+ * Drops as's ASIDs so entries other cpus (and, unless
+ * keep_current_cpu, this one) still hold for it are never matched
+ * again; it gets fresh ASIDs the next time it runs there.  Used when
+ * mappings of a running address space change, since its entries now
+ * outlive context switches.  User processes are single threaded, so
+ * as is not running on any other cpu.
+ *
+ * If as is current here and keep_current_cpu is 0, the caller must
+ * reactivate it.
+ */
+void
+vm_tlb_retire(struct addrspace *as, int keep_current_cpu)
+{
+	unsigned self;
+	int spl;
+
+	spl = splhigh();
+	self = curcpu->c_number;
+	for (unsigned c = 0; c < MAXCPUS; c++) {
+		if (c != self || !keep_current_cpu) {
+			as->asids[c] = 0;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Harvests reference information for page replacement.
+ *
+ * Pages the running address space has in this CPU's TLB are marked
+ * accessed (see find_victim_page).  Of those, entries in the next
+ * TLB_SWEEP_SAMPLE slots are invalidated, so each is dropped every
+ * NUM_TLB / TLB_SWEEP_SAMPLE sweeps and only stays if its page is
+ * still in use.  Entries of other address spaces are left alone:
+ * they are not running, so their pages were not referenced, and their
+ * entries are still good when they run again.
+ * Called periodically from hardclock on each CPU.
+ */
+#define TLB_SWEEP_SAMPLE 8
+
+void
+vm_tlb_sweep(void)
+{
+	struct tlbasid *ta;
+	uint32_t ehi, elo;
+	paddr_t paddr;
+	int spl;
+
+	spl = splhigh();
+	ta = &tlbasids[curcpu->c_number];
+	if (ta->ta_pid == 0) {
+		// Kernel thread; no user entries are in use.
+		splx(spl);
+		return;
+	}
+	for (unsigned i = 0; i < NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (!(elo & TLBLO_VALID) || ((ehi & TLBHI_PID) != ta->ta_pid)) {
+			continue;
+		}
+		paddr = elo & TLBLO_PPAGE;
+		if ((paddr >= firstpaddr) && (paddr < lastpaddr)) {
+			touch_paddr(paddr);
+		}
+		if ((i + NUM_TLB - ta->ta_sweep) % NUM_TLB < TLB_SWEEP_SAMPLE) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	ta->ta_sweep = (ta->ta_sweep + TLB_SWEEP_SAMPLE) % NUM_TLB;
+	// tlb_read loads the entry's ASID into the cpu.
+	tlb_setpid(ta->ta_pid);
+	splx(spl);
+#if OPT_VM_PERF
+    count_tlb_sweep();
+#endif
+}
+
+/*
+ * Sanity check to confirm coremap appears valid.
+ *
+ * Caller is responsible for locking coremap.
+ *
+ * Returns:
+ *   0 if coremap is valid, else panics.
+ */
+int
+validate_coremap()
+{
+	unsigned p;
+	unsigned used_pages = 0;
+	unsigned free_pages = 0;
+	unsigned listed_pages = 0;
+	unsigned clean_pages = 0;
+	unsigned npages;
+    unsigned status;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (p = 0; p < page_max; p += npages) {
+		npages = get_core_npages(p);
+		status = coremap[p].status;
+		KASSERT(npages > 0);
+		for (unsigned i = 1; i < npages; i++) {
+			KASSERT(coremap[p + i].status == 0);
+		}
+        if (status & VM_CORE_USED) {
+			used_pages += npages;
+			if (coremap[p].as == NULL) {
+				// Kernel page.
+                KASSERT(coremap[p].vaddr >= MIPS_KSEG0);
+                KASSERT(coremap[p].vaddr < MIPS_KSEG1);
+            } else {
+				// User page.
+                KASSERT(coremap[p].vaddr < MIPS_KSEG0);
+				// We only support allocating user pages one at a time.
+				KASSERT(npages == 1);
+				KASSERT(coremap[p].refs > 0);
+				if (!(status & VM_CORE_DIRTY)) {
+					clean_pages++;
+				}
+            }
+		} else {
+			// Free blocks are aligned powers of two.
+			KASSERT((npages & (npages - 1)) == 0);
+			KASSERT((p & (npages - 1)) == 0);
+			free_pages += npages;
+		}
+	}
+	for (order = 0; order < COREMAP_ORDERS; order++) {
+		listed_pages += free_counts[order] << order;
+	}
+	if (listed_pages != free_pages) {
+		dump_coremap();
+		panic("free list pages (%u) != free pages (%u)",
+		  listed_pages, free_pages);
+	}
+	// Zeroed pool pages are marked used but counted as free.
+	if ((used_pages - zeroed_pages) * PAGE_SIZE != used_bytes) {
+		kprintf("used_pages = %u\n", used_pages);
+		kprintf("zeroed_pages = %u\n", zeroed_pages);
+		kprintf("used_bytes = %u\n", used_bytes);
+		dump_coremap();
+		panic("(used_pages * PAGE_SIZE) (%u) != used_bytes (%u)",
+		  (used_pages - zeroed_pages) * PAGE_SIZE, used_bytes);
+	}
+	if (clean_pages != clean_user_pages) {
+		dump_coremap();
+		panic("clean user pages (%u) != clean_user_pages (%u)",
+		  clean_pages, clean_user_pages);
+	}
+	if (used_pages + free_pages != page_max) {
+		kprintf("used_pages = %u\n", used_pages);
+		kprintf("free_pages = %u\n", free_pages);
+		kprintf("page_max = %u\n", page_max);
+		dump_coremap();
+		panic("(used_pages + free_pages) (%u) != page_max (%u)",
+		  used_pages + free_pages, page_max);
+	}
+
+	return 0;
+}
+
+/*
+ * Initializes the physical to virtual memory map.
+ *
+ * Must be run after ram_bootstrap().
+ */
+void
+vm_init_coremap()
+{
+	size_t total_bytes;  // total bytes in physical memory.
+	size_t coremap_bytes;
+	paddr_t kernel_top;  // Immediately above kernel code.
+	paddr_t coremap_paddr;
+	unsigned p;
+
+	// Optional: dynamic data structures can be kmalloc'd here
+	// before the coremap is enabled.  Any pre-coremap allocated
+	// memory, however, will never be freed.
+
+	lastpaddr = ram_getsize();
+	// RAM initialization can only occur once and locks in any
+	// memory allocated with ram_stealmem().  We cannot make
+	// further calls to ram_stealmem().
+	kernel_top = ram_getfirstfree();
+	KASSERT((kernel_top & PAGE_FRAME) == kernel_top);
+
+	// Total memory in bytes minus the kernel code.
+	total_bytes = lastpaddr;
+	page_max = paddr_to_core_idx(total_bytes);
+	coremap_bytes = page_max * sizeof(struct core_page);
+	coremap_paddr = kernel_top;
+
+	// First allocatable page is above coremap and page aligned up.
+	firstpaddr = coremap_paddr + coremap_bytes;
+	firstpaddr = (firstpaddr + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	// From this point, we will be accessing coremap directly, so
+	// convert to a direct mapped virtual address and zero out.
+	coremap = (struct core_page *)PADDR_TO_KVADDR(coremap_paddr);
+	bzero((void *)coremap, coremap_bytes);	
+	// Mark kernel and coremap pages as allocated in coremap.
+	p = paddr_to_core_idx(firstpaddr);
+	coremap[0].status = set_core_status(1, 0, p);
+	coremap[0].as = NULL;
+	coremap[0].vaddr = (vaddr_t)MIPS_KSEG0;
+	KASSERT(p < page_max);
+	for (unsigned i = 0; i < MAXCPUS; i++) {
+		spinlock_init(&pagecaches[i].pc_lock);
+		pagecaches[i].pc_count = 0;
+		pagecaches[i].pc_nzeroed = 0;
+		tlbasids[i].ta_gen = 1;
+		tlbasids[i].ta_next = 1;
+		tlbasids[i].ta_pid = 0;
+	}
+	// Includes kernel and coremap in used_bytes.
+	used_bytes = p * PAGE_SIZE;
+
+	// Switch from ram_stealmem allocater to coremap.
+	coremap_enabled = 1;
+
+	spinlock_acquire(&coremap_lock);
+	// Give the remainder of pages to the buddy allocator.
+	buddy_free_range(p, page_max - p);
+	KASSERT(validate_coremap() == 0);
+	spinlock_release(&coremap_lock);
+
+	kprintf("\nvm_init_coremap\n");
+	kprintf("lastpaddr  = 0x%08x\n", lastpaddr);
+	kprintf("firstpaddr = 0x%08x\n", firstpaddr);
+	kprintf("coremap    = 0x%08x\n", coremap_paddr);
+	kprintf("page_max   = %u\n", page_max);
+	kprintf("\n");
+}
+
+/*
+ * Initializes virtual memory swap system at boot.
+ */
+void
+vm_bootstrap(void)
+{
+    char vfs_path[PATH_MAX];
+    const mode_t unused_mode = 0x777;
+	struct stat statbuf;
+    int result;
+
+	for (unsigned i = 0; i < PAGE_WCHANS; i++) {
+		page_wchans[i] = wchan_create("page");
+		if (page_wchans[i] == NULL) {
+			panic("vm_bootstrap: Cannot create page_wchans.");
+		}
+	}
+	text_cache = objcache_create("text_page", sizeof(struct text_page),
+				     NULL, NULL);
+	if (text_cache == NULL) {
+		panic("vm_bootstrap: Cannot create text_cache.");
+	}
+	as_bootstrap();
+	pageout_low = page_max / PAGEOUT_LOW_DIVISOR;
+	pageout_high = page_max / PAGEOUT_HIGH_DIVISOR;
+	vm_register_reclaim(objcache_reclaim);
+	vm_register_reclaim(kheap_reclaim);
+	// vfs_open destructively uses filepath, so pass in a copy.
+	strcpy(vfs_path, SWAP_PATH);
+	result = vfs_open(vfs_path, O_RDWR, unused_mode, &swapdisk_vn);
+	if (result) {
+		kprintf("Swap DISABLED.\n");
+        swap_enabled = 0;
+        return;
+	}
+	kprintf("Swap ENABLED.\n");
+	swap_enabled = 1;
+	result = VOP_STAT(swapdisk_vn, &statbuf);
+	swapdisk_pages = (int)(statbuf.st_size / PAGE_SIZE);
+	if (swapdisk_pages > PTE_MAX_BLOCKS) {
+		// A swapped out pte has room for only this many blocks.
+		swapdisk_pages = PTE_MAX_BLOCKS;
+	}
+	swapmap = bitmap_create(swapdisk_pages);
+	if (swapmap == NULL) {
+		vfs_close(swapdisk_vn);		
+		panic("vm_bootstrap: Cannot create swapmap.");
+	}
+	swap_refs = kmalloc(sizeof(uint16_t) * swapdisk_pages);
+	if (swap_refs == NULL) {
+		bitmap_destroy(swapmap);
+		vfs_close(swapdisk_vn);
+		panic("vm_bootstrap: Cannot create swap_refs.");
+	}
+	bzero(swap_refs, sizeof(uint16_t) * swapdisk_pages);
+	swap_regions = DIVROUNDUP(swapdisk_pages, SWAP_REGION_PAGES);
+	swap_region_free = kmalloc(sizeof(unsigned) * swap_regions);
+	if (swap_region_free == NULL) {
+		kfree(swap_refs);
+		bitmap_destroy(swapmap);
+		vfs_close(swapdisk_vn);
+		panic("vm_bootstrap: Cannot create swap_region_free.");
+	}
+	for (unsigned r = 0; r < swap_regions; r++) {
+		swap_region_free[r] = SWAP_REGION_PAGES;
+	}
+	if (swapdisk_pages % SWAP_REGION_PAGES) {
+		swap_region_free[swap_regions - 1] = swapdisk_pages % SWAP_REGION_PAGES;
+	}
+	swap_free_blocks = swapdisk_pages;
+	swapmap_lock = lock_create("swapmap");
+	if (swapmap_lock == NULL) {
+		kfree(swap_region_free);
+		kfree(swap_refs);
+		bitmap_destroy(swapmap);
+		vfs_close(swapdisk_vn);
+		panic("vm_bootstrap: Cannot create swapmap lock.");
+	}
+	swapdisk_lock = lock_create("swapdisk");
+	if (swapdisk_lock == NULL) {
+		lock_destroy(swapmap_lock);
+		kfree(swap_region_free);
+		kfree(swap_refs);
+		bitmap_destroy(swapmap);
+		vfs_close(swapdisk_vn);
+		panic("vm_bootstrap: Cannot create swapdisklock.");
+	}
+	kprintf("Total swapdisk pages %u\n", swapdisk_pages);
+
+	tlbshootdown_sem = sem_create("tlbshootdown", 0);
+	if (tlbshootdown_sem == NULL) {
+        panic("vm_bootstrap: Could not create tlbshootdown_sem");
+    }
+	tlbshootdown_lock = lock_create("tlbshootdown");
+	if (tlbshootdown_lock == NULL) {
+        panic("vm_bootstrap: Could not create tlbshootdown_lock");
+    }
+	pageout_bootstrap();
+#if OPT_VM_PERF
+    init_vm_perf();
+#endif
+}
+
+/*
+ * Reads or writes pages at consecutive swap blocks in one request.
+ *
+ * The pages need not be physically contiguous.
+ * 
+ * Args:
+ *   block_index: First page number offset on swap disk.
+ *   paddrs: Physical address of each page.
+ *   npages: Number of pages, at most SWAP_CLUSTER.
+ *   rw: UIO_READ or UIO_WRITE.
+ *
+ * Returns:
+ *   0 on success, else 1 on error.
+ */
+static int
+block_io(unsigned block_index, const paddr_t *paddrs, unsigned npages,
+         enum uio_rw rw)
+{
+    struct iovec iov[SWAP_CLUSTER];
+	struct uio my_uio;
+	int result;
+
+	KASSERT(swap_enabled);
+	KASSERT(swapdisk_pages > 0);
+	KASSERT((npages > 0) && (npages <= SWAP_CLUSTER));
+	KASSERT(block_index + npages <= swapdisk_pages);
+
+	for (unsigned i = 0; i < npages; i++) {
+        KASSERT((paddrs[i] >= firstpaddr) && (paddrs[i] <= lastpaddr));
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	my_uio.uio_iov = iov;
+	my_uio.uio_iovcnt = npages;
+	my_uio.uio_offset = (off_t)block_index * PAGE_SIZE;
+	my_uio.uio_resid = npages * PAGE_SIZE;
+	my_uio.uio_segflg = UIO_SYSSPACE;
+	my_uio.uio_rw = rw;
+	my_uio.uio_space = NULL;
+
+#if OPT_VM_PERF
+    count_swap_request();
+#endif
+	lock_acquire(swapdisk_lock);
+	if (rw == UIO_READ) {
+        result = VOP_READ(swapdisk_vn, &my_uio);
+	} else {
+        result = VOP_WRITE(swapdisk_vn, &my_uio);
+	}
+	lock_release(swapdisk_lock);
+
+	return (result || (my_uio.uio_resid != 0));
+}
+
+/*
+ * Read a page from swap disk into physical memory.
+ * 
+ * Args:
+ *   block_index: Page number offset tor read (same as swapmap).
+ *   paddr: Physical address to store data.
+ *
+ * Returns:
+ *   0 on success, else 1 on error.
+ */
+int 
+block_read(unsigned block_index, paddr_t paddr)
+{
+	KASSERT(swap_enabled);
+	KASSERT(block_index < swapdisk_pages);
+
+	lock_acquire(swapmap_lock);
+	KASSERT(bitmap_isset(swapmap, block_index));
+	lock_release(swapmap_lock);
+
+	return block_io(block_index, &paddr, 1, UIO_READ);
+}
+
+/*
+ * Write a page to swap disk from physical memory.
+ * 
+ * Args:
+ *   block_index: Page number offset tor write (same as swapmap).
+ *   paddr: Physical address to read data.
+ *
+ * Returns:
+ *   0 on success, else 1 on error.
+ */
+int 
+block_write(unsigned block_index, paddr_t paddr)
+{
+	KASSERT(swap_enabled);
+	KASSERT(block_index < swapdisk_pages);
+
+	lock_acquire(swapmap_lock);
+	KASSERT(bitmap_isset(swapmap, block_index));
+	lock_release(swapmap_lock);
+
+	return block_io(block_index, &paddr, 1, UIO_WRITE);
+}
+
+/*
+ * Selects a page for eviction from the coremap.
+ *
+ * Implements the eviction policy for the virtual memory
+ * system.  Will not evict any kernel-owned pages.
+ *
+ * WSClock page replacement.  A clock hand sweeps the coremap from
+ * where it last stopped.  Referenced pages get a second chance by
+ * clearing their accessed flag.  Unreferenced clean pages are taken
+ * first since they need not be written to swap.  Unreferenced dirty
+ * pages are passed over, but only EVICT_DIRTY_SKIP of them before
+ * the first one is taken, which bounds the work per eviction.
+ *
+ * MIPS has no hardware reference bits, so the accessed flag is only
+ * set by TLB faults and by vm_tlb_sweep(), which periodically marks
+ * the running address space's TLB entries and invalidates a sample
+ * of them, so pages still in use fault again and are marked.
+ * 
+ * Caller is responsible for locking coremap.
+ *
+ * Args:
+ *   busy: Returns a busy user page passed over, else 0, so a caller
+ *     finding no victim can tell whether to wait for one.
+ *
+ * Returns:
+ *   coremap index of page to evict, else 0 if no evictable pages.
+ */
+#define EVICT_DIRTY_SKIP 16
+
+static unsigned
+find_victim_page(unsigned *busy)
+{
+	unsigned p;
+	unsigned npages;
+	unsigned status;
+	unsigned scanned = 0;
+	unsigned victim = 0;
+	unsigned dirty_victim = 0;
+	unsigned dirty_skipped = 0;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	*busy = 0;
+	// At most two revolutions: the first clears every reference bit
+	// so the second must find an unreferenced page if any exist.
+	// Starting from a block head, each step lands on the next one.
+	p = core_block_head(clock_hand);
+	while (scanned < 2 * page_max) {
+		npages = get_core_npages(p);
+		KASSERT(npages > 0);
+		status = coremap[p].status;
+		if (!(status & VM_CORE_USED)) {
+			// Free pages are always the first choice.
+			victim = p;
+			break;
+		}
+		if ((coremap[p].as != NULL) && !(status & VM_CORE_BUSY)) {
+			if (coremap[p].accessed) {
+				// Second chance.
+				coremap[p].accessed = 0;
+			} else if (!(status & VM_CORE_DIRTY)) {
+				victim = p;
+				break;
+			} else {
+				if (dirty_victim == 0) {
+					dirty_victim = p;
+				}
+				dirty_skipped++;
+				if (dirty_skipped >= EVICT_DIRTY_SKIP) {
+					break;
+				}
+			}
+		} else if ((coremap[p].as != NULL) && (*busy == 0)) {
+			*busy = p;
+		} // Else skip kernel and busy pages.
+		scanned += npages;
+		p = (p + npages) % page_max;
+	}
+#if OPT_VM_PERF
+    count_clock_steps(scanned);
+#endif
+	if (victim == 0) {
+		victim = dirty_victim;
+	}
+	if (victim != 0) {
+		clock_hand = (victim + get_core_npages(victim)) % page_max;
+	}
+	return victim;
+}
+
+/*
+ * Save page to disk if needed.
+ *
+ * A swap block may be shared by page table entries of several
+ * address spaces (see as_copy).  If a modified page is backed by a
+ * block which is also referenced by page table entries not mapping
+ * this page, the page is written to a new block instead.
+ *
+ * Caller responsible for locking page table.
+ * 
+ * Args:
+ *   pte: Pointer to page table entry of page to maybe swap out.
+ *   dirty: non-zero if page has been modified, else 0.
+ *   refs: Number of page table entries mapping this page.
+ * 
+ * Returns:
+ *   0 on success else errno.
+ */
+int
+save_page(pte_t *pte, int dirty, unsigned refs) {
+	unsigned block_index;
+	unsigned old_block = 0;
+	paddr_t paddr;
+	int new_block = 0;
+	int result;
+
+	KASSERT(pte != NULL);
+	KASSERT(*pte & VM_PTE_VALID);
+	KASSERT(refs > 0);
+
+	paddr = PTE_PADDR(*pte);
+	if (*pte & VM_PTE_BACKED) {
+		old_block = pte_block(*pte);
+	}
+	lock_acquire(swapmap_lock);
+	if (!(*pte & VM_PTE_BACKED) ||
+	    (dirty && (swap_refs[old_block] > refs))) {
+		if (swap_alloc_run(1, NULL, &block_index) == 0) {
+			lock_release(swapmap_lock);
+			return ENOSPC;
+		}
+		swap_refs[block_index] = refs;
+		new_block = 1;
+	} else {
+		block_index = old_block;
+	}
+    lock_release(swapmap_lock);
+
+	if (dirty || new_block) {
+#if OPT_VM_PERF
+        count_swap_out();
+#endif
+        result = block_write(block_index, paddr);
+        if (result) {
+			if (new_block) {
+                lock_acquire(swapmap_lock);
+				swap_refs[block_index] = 0;
+				swap_unmark_block(block_index);
+                lock_release(swapmap_lock);
+			}
+            return ENOSPC;
+        }
+	}
+	if (new_block && (*pte & VM_PTE_BACKED)) {
+		// Old block remains in use by the other page table entries.
+        lock_acquire(swapmap_lock);
+		KASSERT(swap_refs[old_block] > refs);
+		swap_refs[old_block] -= refs;
+        lock_release(swapmap_lock);
+	}
+	// Every pte mapping the page shares its coremap entry.
+	coremap[paddr_to_core_idx(paddr)].block = block_index;
+	*pte |= VM_PTE_BACKED;
+	return 0;
+}
+
+/*
+ * Returns the swap block of a VM_PTE_BACKED page table entry, which
+ * for a resident page is kept in the page's coremap entry.
+ *
+ * Caller is responsible for locking the page table holding pte.
+ */
+unsigned
+pte_block(pte_t pte)
+{
+	KASSERT(pte & VM_PTE_BACKED);
+	if (pte & VM_PTE_VALID) {
+		return coremap[paddr_to_core_idx(PTE_PADDR(pte))].block;
+	}
+	return pte >> PAGE_OFFSET_BITS;
+}
+
+/*
+ * Returns wait channel for threads waiting on busy page p.
+ */
+static struct wchan *
+page_wchan(unsigned p)
+{
+	return page_wchans[p % PAGE_WCHANS];
+}
+
+/*
+ * Sleeps until page p is no longer busy.
+ *
+ * The page may have been freed or reassigned by the time we wake, so
+ * caller must check it again.
+ *
+ * Caller is responsible for locking coremap.
+ */
+static void
+wait_for_page(unsigned p)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	while (coremap[p].status & VM_CORE_BUSY) {
+		wchan_sleep(page_wchan(p), &coremap_lock);
+	}
+}
+
+/*
+ * Clears busy flag on page p and wakes any waiters.
+ *
+ * Caller is responsible for locking coremap.
+ */
+static void
+unbusy_page(unsigned p)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[p].status & VM_CORE_BUSY);
+	coremap[p].status &= ~VM_CORE_BUSY;
+	wchan_wakeall(page_wchan(p), &coremap_lock);
+}
+
+/*
+ * Clears busy flag on user page p, freeing it if its last
+ * reference was dropped while busy (see free_user_page).
+ */
+static void
+release_busy_page(unsigned p)
+{
+	int orphan;
+
+	spinlock_acquire(&coremap_lock);
+	unbusy_page(p);
+	orphan = (coremap[p].refs == 0);
+	if (orphan) {
+		// Ours now; keep the clock and pageout daemon off it.
+		core_set_as(p, NULL);
+	}
+	spinlock_release(&coremap_lock);
+	if (orphan) {
+		free_pages(core_idx_to_paddr(p));
+	}
+}
+
+/*
+ * Returns a mask of the cpus that may hold TLB entries for as: those
+ * where it has an ASID from the cpu's current generation.
+ *
+ * Read without locks.  Callers hold as->pages_lock, so no entries for
+ * the pages being shot down can be added meanwhile, and a cpu whose
+ * generation moves on has flushed its TLB, so missing it is safe.
+ */
+static uint32_t
+tlb_as_cpus(struct addrspace *as)
+{
+	uint32_t cpus = 0;
+	uint32_t asid;
+
+	for (unsigned c = 0; c < MAXCPUS; c++) {
+		asid = as->asids[c];
+		if ((asid != 0) &&
+		    ((asid >> ASID_GEN_SHIFT) == tlbasids[c].ta_gen)) {
+			cpus |= 1U << c;
+		}
+	}
+	return cpus;
+}
+
+/*
+ * Removes as's entries for npages pages at vaddrs from the TLB of
+ * every CPU that may hold them, sending one IPI per CPU for each
+ * TLBSHOOTDOWN_PAGES pages.
+ */
+static void
+vm_tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs, unsigned npages)
+{
+	struct tlbshootdown shootdown;
+	unsigned i, n, sent;
+	uint32_t cpus;
+	int spl;
+
+	if (npages == 0) {
+		return;
+	}
+	shootdown.as = as;
+	shootdown.sem = tlbshootdown_sem;
+	lock_acquire(tlbshootdown_lock);
+	while (npages > 0) {
+		n = npages < TLBSHOOTDOWN_PAGES ? npages : TLBSHOOTDOWN_PAGES;
+		for (i = 0; i < n; i++) {
+			shootdown.vaddrs[i] = vaddrs[i];
+		}
+		shootdown.npages = n;
+
+		// Stay on this cpu between removing our own entries and
+		// choosing the others.
+		spl = splhigh();
+		for (i = 0; i < n; i++) {
+			vm_tlb_remove_as(as, vaddrs[i]);
+		}
+		cpus = tlb_as_cpus(as);
+		sent = ipi_tlbshootdown_cpus(cpus, &shootdown);
+		splx(spl);
+#if OPT_VM_PERF
+		count_shootdown_ipis(sent);
+#endif
+		for (i = 0; i < sent; i++) {
+			P(tlbshootdown_sem);
+		}
+		vaddrs += n;
+		npages -= n;
+	}
+	lock_release(tlbshootdown_lock);
+}
+
+/*
+ * Save private page and following dirty pages to swap.
+ *
+ * Gathers up to SWAP_CLUSTER-1 pages following vaddr in as which
+ * also need to be written, and writes them all in one request to
+ * consecutive swap blocks so they can be read back together (see
+ * get_page_via_table).  Their old swap blocks, if any, are released.
+ * The following pages stay resident and become clean.
+ *
+ * Caller is responsible for locking as->pages_lock, marking the page
+ * at vaddr busy and removing it from the TLB.
+ *
+ * Args:
+ *   as: Address space owning the page.
+ *   vaddr: Virtual address of the page.
+ *   pte: Page table entry of the page, which must be its only mapping.
+ *   dirty: non-zero if page has been modified, else 0.
+ *
+ * Returns:
+ *   0 on success else errno.
+ */
+static int
+save_cluster(struct addrspace *as, vaddr_t vaddr, pte_t *pte, int dirty)
+{
+	paddr_t paddrs[SWAP_CLUSTER];
+	pte_t *ptes[SWAP_CLUSTER];
+	unsigned core_idx[SWAP_CLUSTER];
+	vaddr_t vaddrs[SWAP_CLUSTER - 1];
+	pte_t *next;
+	unsigned n, i, p;
+	unsigned status;
+	unsigned written = 0;
+	unsigned block_index;
+	int file;
+	int ok;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(as->pages_lock));
+	if (!dirty && (*pte & VM_PTE_BACKED)) {
+		// Copy in swap is current.
+		return 0;
+	}
+	ptes[0] = pte;
+	paddrs[0] = PTE_PADDR(*pte);
+	core_idx[0] = paddr_to_core_idx(paddrs[0]);
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		next = as_lookup_pte(as, vaddr + n * PAGE_SIZE);
+		if ((next == NULL) || !(*next & VM_PTE_VALID)) {
+			break;
+		}
+		// Clean pages of an executable can be read back from it.
+		file = as_file_backed(as, vaddr + n * PAGE_SIZE);
+		p = paddr_to_core_idx(PTE_PADDR(*next));
+		spinlock_acquire(&coremap_lock);
+		status = coremap[p].status;
+		ok = !(status & (VM_CORE_BUSY | VM_CORE_SHARED)) &&
+		  (coremap[p].refs == 1) &&
+		  ((status & VM_CORE_DIRTY) || (!(*next & VM_PTE_BACKED) && !file));
+		if (ok) {
+			coremap[p].status |= VM_CORE_BUSY;
+		}
+		spinlock_release(&coremap_lock);
+		if (!ok) {
+			break;
+		}
+		ptes[n] = next;
+		paddrs[n] = PTE_PADDR(*next);
+		core_idx[n] = p;
+	}
+	// Write protect following pages so writes during page out are seen.
+	for (i = 1; i < n; i++) {
+		vaddrs[i - 1] = vaddr + i * PAGE_SIZE;
+	}
+	vm_tlb_shootdown(as, vaddrs, n - 1);
+	spinlock_acquire(&coremap_lock);
+	for (i = 1; i < n; i++) {
+		core_set_dirty(core_idx[i], false);
+	}
+	spinlock_release(&coremap_lock);
+
+	lock_acquire(swapmap_lock);
+	written = swap_alloc_run(n, &as->swap_hint, &block_index);
+	for (i = 0; i < written; i++) {
+		swap_refs[block_index + i] = 1;
+	}
+	lock_release(swapmap_lock);
+	if (written == 0) {
+		result = ENOSPC;
+	} else if (block_io(block_index, paddrs, written, UIO_WRITE)) {
+		lock_acquire(swapmap_lock);
+		for (i = 0; i < written; i++) {
+			swap_refs[block_index + i] = 0;
+			swap_unmark_block(block_index + i);
+		}
+		lock_release(swapmap_lock);
+		written = 0;
+		result = ENOSPC;
+	} else {
+		for (i = 0; i < written; i++) {
+			if (*ptes[i] & VM_PTE_BACKED) {
+				free_swapmap_block(pte_block(*ptes[i]));
+			}
+			coremap[core_idx[i]].block = block_index + i;
+			*ptes[i] |= VM_PTE_BACKED;
+#if OPT_VM_PERF
+            count_swap_out();
+#endif
+		}
+	}
+	// Pages not written remain dirty.
+	spinlock_acquire(&coremap_lock);
+	for (i = 1; i < n; i++) {
+		if (i >= written) {
+			core_set_dirty(core_idx[i], true);
+		}
+		unbusy_page(core_idx[i]);
+	}
+	spinlock_release(&coremap_lock);
+	return result;
+}
+
+/*
+ * Locks page table of as if it maps paddr at vaddr.
+ *
+ * Does not block if another thread holds the page table.
+ *
+ * Returns:
+ *   1 if as maps paddr (page table left locked), 0 if not,
+ *   or OWNERS_BUSY if page table is locked by another thread.
+ */
+static int
+lock_page_owner(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	pte_t *pte;
+
+	if (!lock_tryacquire(as->pages_lock)) {
+		return OWNERS_BUSY;
+	}
+	pte = as_lookup_pte(as, vaddr);
+	if ((pte != NULL) && (*pte & VM_PTE_VALID) && (PTE_PADDR(*pte) == paddr)) {
+		return 1;
+	}
+	lock_release(as->pages_lock);
+	return 0;
+}
+
+/*
+ * Releases page tables locked by lock_page_owners.
+ */
+static void
+unlock_page_owners(struct addrspace **owners, int n)
+{
+	for (int i = 0; i < n; i++) {
+		lock_release(owners[i]->pages_lock);
+	}
 }
 
 /*
- * Read a page from swap disk into physical memory.
- * 
+ * Locks page tables of all address spaces mapping a user page.
+ *
+ * A private page is mapped only by core->as.  A page shared copy on
+ * write may be mapped by any address space and core->as may be stale.
+ * Either way we only trust an address space found on as_list.  Gives
+ * up rather than wait on a page table another thread holds.
+ *
  * Args:
- *   block_index: Page number offset tor read (same as swapmap).
- *   paddr: Physical address to store data.
+ *   core: Copy of coremap entry for page.
+ *   paddr: Physical address of page.
+ *   owners: Array of EVICT_MAX_OWNERS to return locked address spaces.
  *
  * Returns:
- *   0 on success, else 1 on error.
+ *   Number of address spaces locked, else OWNERS_BUSY if another
+ *   thread holds one of their page tables, or OWNERS_TOO_MANY if
+ *   more than EVICT_MAX_OWNERS map the page.  None are left locked
+ *   on failure.
  */
-int 
-block_read(unsigned block_index, paddr_t paddr)
+static int
+lock_page_owners(const struct core_page *core, paddr_t paddr, 
+                 struct addrspace **owners)
 {
-    struct iovec iov;
-	struct uio my_uio;
-	off_t offset;
-	void *buf;
+	struct addrspace *as;
+	int n = 0;
 	int result;
 
-	KASSERT(swap_enabled);
-	KASSERT((paddr >= firstpaddr) && (paddr <= lastpaddr));
-	KASSERT(swapdisk_pages > 0);
-	KASSERT(block_index < swapdisk_pages);
-
-	lock_acquire(swapmap_lock);
-	KASSERT(bitmap_isset(swapmap, block_index));
-	lock_release(swapmap_lock);
-
-	offset = block_index * PAGE_SIZE;
-	buf = (void *)PADDR_TO_KVADDR(paddr);
-	uio_kinit(&iov, &my_uio, buf, PAGE_SIZE, offset, UIO_READ);
-
-	lock_acquire(swapdisk_lock);
-	result = VOP_READ(swapdisk_vn, &my_uio);
-	lock_release(swapdisk_lock);
-
-	return (result || (my_uio.uio_resid != 0));
+	as_list_acquire();
+	for (as = as_list_first(); as != NULL; as = as->next) {
+		if (!(core->status & VM_CORE_SHARED) && (as != core->as)) {
+			continue;
+		}
+		result = lock_page_owner(as, core->vaddr, paddr);
+		if ((result > 0) && (n == EVICT_MAX_OWNERS)) {
+			lock_release(as->pages_lock);
+			result = OWNERS_TOO_MANY;
+		}
+		if (result < 0) {
+			unlock_page_owners(owners, n);
+			as_list_release();
+			return result;
+		}
+		if (result > 0) {
+			owners[n++] = as;
+		}
+	}
+	as_list_release();
+	return n;
 }
 
 /*
- * Write a page to swap disk from physical memory.
- * 
+ * Finds and evicts a userspace page.
+ *
+ * A page shared copy on write is evicted from every address space
+ * mapping it at once, so all of them reference the same swap block.
+ *
+ * Any number of threads may evict at once.  The victim is marked busy
+ * so no other thread picks it, and only its owners' page tables are
+ * locked while it is written out.
+ *
  * Args:
- *   block_index: Page number offset tor write (same as swapmap).
- *   paddr: Physical address to read data.
+ *   paddr: pointer to physical address of freed page.
  *
  * Returns:
- *   0 on success, else 1 on error.
+ *   0 on success, else errno value.
  */
-int 
-block_write(unsigned block_index, paddr_t paddr)
+int
+evict_page(paddr_t *paddr)
 {
-    struct iovec iov;
-	struct uio my_uio;
-	off_t offset;
-	void *buf;
+	// "old" refers to page to be evicted.
+	struct core_page old_core;
+	struct core_page core;
+	struct addrspace *owners[EVICT_MAX_OWNERS];
+	struct text_page *tp;
+	paddr_t old_paddr;
+	paddr_t kvaddr;
+	pte_t *old_pte;
+	pte_t *pte;
+	unsigned block;
+	unsigned busy;
+	unsigned unevictable;
+	int drop;
+	int n;
+	int p;
 	int result;
 
-	KASSERT(swap_enabled);
-	KASSERT((paddr >= firstpaddr) && (paddr <= lastpaddr));
-	KASSERT(swapdisk_pages > 0);
-	KASSERT(block_index < swapdisk_pages);
-
-	lock_acquire(swapmap_lock);
-	KASSERT(bitmap_isset(swapmap, block_index));
-	lock_release(swapmap_lock);
+	KASSERT(!spinlock_do_i_hold(&coremap_lock));
 
-	offset = block_index * PAGE_SIZE;
-	buf = (void *)PADDR_TO_KVADDR(paddr);
-	uio_kinit(&iov, &my_uio, buf, PAGE_SIZE, offset, UIO_WRITE);
+	// Contention with other threads only delays us.  We give up
+	// only when no page is a candidate, or after a full revolution
+	// of candidates that can never be evicted.
+	for (unevictable = 0; ; ) {
+		if (unevictable >= page_max) {
+			return ENOMEM;
+		}
+        spinlock_acquire(&coremap_lock);
+        // Identify a page to evict.
+        p = find_victim_page(&busy);
+        if (p == 0) {
+            if (busy == 0) {
+                spinlock_release(&coremap_lock);
+                return ENOMEM;
+            }
+            // Every candidate is being paged by another thread.
+            wait_for_page(busy);
+            spinlock_release(&coremap_lock);
+            continue;
+        }
+        old_core = coremap[p];
+        if (!(old_core.status & VM_CORE_USED)) {
+            // New already free page (not actually an eviction).
+            // Allocate to kernel before releasing coremap to prevent
+            // another process from taking it.
+            *paddr = coremap_assign_to_kernel(p, 1);
+            used_bytes += PAGE_SIZE;
+            spinlock_release(&coremap_lock);
+            break;
+        }
+        // We assume we are evicting exactly one page.
+        KASSERT((old_core.status & VM_CORE_NPAGES) == 1);
+        coremap[p].status |= VM_CORE_BUSY;
+        spinlock_release(&coremap_lock);
 
-	lock_acquire(swapdisk_lock);
-	result = VOP_WRITE(swapdisk_vn, &my_uio);
-	lock_release(swapdisk_lock);
+        old_paddr = core_idx_to_paddr(p);
+        n = lock_page_owners(&old_core, old_paddr, owners);
+        if (n == OWNERS_TOO_MANY) {
+            release_busy_page(p);
+            unevictable++;
+            continue;
+        }
+        if (n < 0) {
+            // An owner is busy with its page table, try another page.
+            release_busy_page(p);
+            thread_yield();
+            continue;
+        }
+        // A sharer may have made a private copy, or the last owner may
+        // have freed the page, before we locked its owners.
+        spinlock_acquire(&coremap_lock);
+        core = coremap[p];
+        if ((n == 0) && (core.refs == 0)) {
+            // Freed while busy, so it is ours to take.
+            unbusy_page(p);
+            *paddr = coremap_assign_to_kernel(p, 1);
+            spinlock_release(&coremap_lock);
+            break;
+        }
+        spinlock_release(&coremap_lock);
+        if ((n == 0) || (core.refs != (unsigned)n)) {
+            unlock_page_owners(owners, n);
+            release_busy_page(p);
+            continue;
+        }
+#if OPT_VM_PERF
+        count_eviction();
+#endif
+        // Deactivate page so it is not accessed during page out.
+        // Once removed from TLB, any page faults will block
+		// waiting for the owners' pages_lock until we are done.
+		// Entries are per address space, so remove every owner's.
+		for (int i = 0; i < n; i++) {
+			vm_tlb_shootdown(owners[i], &old_core.vaddr, 1);
+		}
+        old_pte = as_lookup_pte(owners[0], old_core.vaddr);
+		// Refresh page dirty status in case page was accessed since we 
+		// last checked.  Page can no longer be accessed since we 
+		// cleared the TLB and locked the page tables.
+		spinlock_acquire(&coremap_lock);
+		core = coremap[p];
+		spinlock_release(&coremap_lock);
+		// A page of an executable never written or swapped out still
+		// matches the file, so drop it and read it back on next use.
+		drop = !(core.status & VM_CORE_DIRTY) &&
+		  !(*old_pte & VM_PTE_BACKED) &&
+		  as_file_backed(owners[0], old_core.vaddr);
+        if (drop) {
+            result = 0;
+#if OPT_VM_PERF
+            count_file_drop();
+#endif
+        } else if (n == 1) {
+            result = save_cluster(owners[0], old_core.vaddr, old_pte, 
+              core.status & VM_CORE_DIRTY);
+        } else {
+            result = save_page(old_pte, core.status & VM_CORE_DIRTY, n);
+        }
+		if (result) {
+            unlock_page_owners(owners, n);
+            release_busy_page(p);
+			return result;
+		}
+		// Modify coremap and page tables together atomically.
+		spinlock_acquire(&coremap_lock);
+        unbusy_page(p);
+        block = coremap[p].block;
+        tp = text_remove(p);
+        *paddr = coremap_assign_to_kernel(p, 1);
+        for (int i = 0; i < n; i++) {
+            pte = as_lookup_pte(owners[i], old_core.vaddr);
+            KASSERT(pte != NULL);
+            *pte = drop ? 0 : PTE_SWAPPED(block);
+        }
+		spinlock_release(&coremap_lock);
+        unlock_page_owners(owners, n);
+        text_page_free(tp);
+        break;
+	}
+	kvaddr = PADDR_TO_KVADDR(*paddr);
+	bzero((void *)kvaddr, PAGE_SIZE);
 
-	return (result || (my_uio.uio_resid != 0));
+	return 0;
 }
 
 /*
- * Selects a page for eviction from the coremap.
+ * Returns number of free pages in coremap.
  *
- * Implements the eviction policy for the virtual memory
- * system.  This is a read-only operation.  Will not
- * evict any kernel-owned pages.
- * 
  * Caller is responsible for locking coremap.
+ */
+static unsigned
+free_page_count(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	return page_max - used_bytes / PAGE_SIZE;
+}
+
+/*
+ * Returns true if free pages are below the pageout low watermark.
  *
- * Returns:
- *   coremap index of page to evict, else 0 if no evictable pages.
+ * Kernel caches check this before growing.
  */
+bool
+vm_memory_low(void)
+{
+	bool low;
+
+	spinlock_acquire(&coremap_lock);
+	low = free_page_count() < pageout_low;
+	spinlock_release(&coremap_lock);
+	return low;
+}
 
-#define EVICT_CLOCK 0
-#if EVICT_CLOCK
-// CLOCK page replacement index into coremap.
-static unsigned next_evict = 0;
+/*
+ * Registers a function which frees cached kernel memory.
+ *
+ * func is called with the number of pages wanted when an allocation
+ * finds no free pages and when the pageout daemon wakes.  It must not
+ * block waiting for locks since the allocating thread may hold them,
+ * and returns the number of pages it gave back to the coremap.
+ */
+void
+vm_register_reclaim(vm_reclaim_func func)
+{
+	spinlock_acquire(&coremap_lock);
+	KASSERT(num_reclaimers < VM_MAX_RECLAIMERS);
+	reclaimers[num_reclaimers++] = func;
+	spinlock_release(&coremap_lock);
+}
 
-// CLOCK page replacement policy.
-// Sweeps through coremap and takes first page that has not been
-// accessed since last sweep.  Or takes next_evict index if all
-// have been accessed.  Note MIPS does not have hardware marking
-// of accessed pages, so kernel cannot see TLB hit statistics.
-// Thus, a page with one TLB miss will get "accessed" but a
-// page with many TLB hits does not register any accesses.
+/*
+ * Asks registered kernel caches to free memory.
+ *
+ * Returns:
+ *   Number of pages given back.
+ */
 static unsigned
-find_victim_page()
+vm_reclaim(unsigned npages)
 {
-    unsigned p;  // Page index into coremap.
-	unsigned block_pages;
+	unsigned freed = 0;
 
-    KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (unsigned i = 0; i < num_reclaimers; i++) {
+		freed += reclaimers[i](npages);
+	}
+	return freed;
+}
 
-    // CLOCK replacement policy.
-	p = next_evict; 
-	while ((coremap[p].as == NULL) || 
-	      ((coremap[p].status & VM_CORE_ACCESSED) &&
-	       (coremap[p].status & VM_CORE_USED))) {
-        coremap[p].status &= ~VM_CORE_ACCESSED;
-		block_pages = get_core_npages(p);
-		p = (p + block_pages) % page_max;
+/*
+ * Wakes pageout daemon if free pages are running low.
+ *
+ * Caller is responsible for locking coremap.
+ */
+static void
+pageout_poke(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if ((pageout_wchan != NULL) && (free_page_count() < pageout_low)) {
+		wchan_wakeone(pageout_wchan, &coremap_lock);
 	}
-	KASSERT(coremap[p].as != NULL);
-	block_pages = get_core_npages(p);
-	next_evict = (p + block_pages) % page_max;
-	return p;
 }
-#endif
 
-#define EVICT_RANDOM 1
-#if EVICT_RANDOM
+/*
+ * Returns number of pages which can be reclaimed without a disk
+ * write: free pages plus clean user pages.  Both are counted as they
+ * change, so this takes constant time.
+ *
+ * Caller is responsible for locking coremap.
+ */
+static unsigned
+reclaimable_page_count(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	return free_page_count() + clean_user_pages;
+}
+
+/*
+ * Selects a dirty page for the pageout daemon to clean.
+ *
+ * Takes private pages which have not been referenced since the
+ * last WSClock pass, since those are the next to be evicted.
+ * Pages shared copy on write are left for evict_page.
+ *
+ * Caller is responsible for locking coremap.
+ *
+ * Returns:
+ *   coremap index of page to clean, else 0 if none.
+ */
 static unsigned
-find_victim_page()
+find_dirty_page(void)
 {
 	unsigned p;
 	unsigned npages;
-	unsigned victim;
-	unsigned user_pages = 0;
-	
-	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	unsigned status;
+	unsigned scanned;
 
-	// TODO(aabo): Replace simple policy with higher performance policy
-	// such as CLOCK.
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-	// Inventory available user pages.
-	for (p = 0; p < page_max; p += npages) {
-		npages = get_core_npages(p);
-		// First choice are pages that became free since we last checked.
-		if (!(coremap[p].status & VM_CORE_USED)) {
-			return p;
-		}
-		if (coremap[p].as == NULL) {
-			// Skip kernel pages.
-			continue;
-		}
-		user_pages++;
-	}
-	if (user_pages == 0) {
-        return 0;
-	}
-	// Choose one of the occupied user pages at random.
-	victim = random() % user_pages;
-	for (p = 0; p < page_max; p += npages) {
+	// Starting from a block head, each step lands on the next one.
+	p = core_block_head(clean_hand);
+	for (scanned = 0; scanned < page_max; scanned += npages) {
 		npages = get_core_npages(p);
-		if (coremap[p].as == NULL) {
-			// Skip kernel pages.
-			continue;
-		}
-		if (victim == 0) {
+		KASSERT(npages > 0);
+		status = coremap[p].status;
+		if ((status & VM_CORE_USED) && (coremap[p].as != NULL) &&
+		    (status & VM_CORE_DIRTY) && !coremap[p].accessed &&
+		    !(status & (VM_CORE_SHARED | VM_CORE_BUSY))) {
+			clean_hand = (p + npages) % page_max;
 			return p;
 		}
-		victim--;
+		p = (p + npages) % page_max;
 	}
-	panic("find_victim_page: failed to find victim page.");
+	return 0;
 }
-#endif
-
 
 /*
- * Save page to disk if needed.
+ * Writes one dirty page to swap, leaving it resident and clean.
+ *
+ * The page is marked busy so evictions pass it over while it is
+ * being written.  Writes to the page while it is being cleaned fault
+ * on the owner's pages_lock, or if after, flag the page dirty again.
  *
- * Caller responsible for locking page table.
- * 
- * Args:
- *   pte: Pointer to page table entry of page to maybe swap out.
- *   dirty: non-zero if page has been modified, else 0.
- * 
  * Returns:
- *   0 on success else errno.
+ *   1 if a page was found to clean, else 0.
  */
-int
-save_page(struct pte *pte, int dirty) {
-	unsigned block_index;
+static int
+clean_page(void)
+{
+	struct core_page core;
+	struct addrspace *owner;
+	pte_t *pte;
+	paddr_t paddr;
+	unsigned p;
+	int n;
 	int result;
 
-	KASSERT(pte != NULL);
+	spinlock_acquire(&coremap_lock);
+	p = find_dirty_page();
+	if (p == 0) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	core = coremap[p];
+	coremap[p].status |= VM_CORE_BUSY;
+	spinlock_release(&coremap_lock);
+	paddr = core_idx_to_paddr(p);
 
-	if (!(pte->status & VM_PTE_BACKED)) {
-        lock_acquire(swapmap_lock);
-        result = bitmap_alloc(swapmap, &block_index);
-		if (result) {
-			return result;
-		}
-        lock_release(swapmap_lock);
-        pte->block_index = block_index;
+	n = lock_page_owners(&core, paddr, &owner);
+	if (n <= 0) {
+		// Page changed hands or its owner is busy, try another.
+		release_busy_page(p);
+		return 1;
+	}
+	spinlock_acquire(&coremap_lock);
+	if ((coremap[p].status & (VM_CORE_DIRTY | VM_CORE_SHARED)) != VM_CORE_DIRTY) {
+		unbusy_page(p);
+		spinlock_release(&coremap_lock);
+		unlock_page_owners(&owner, n);
+		return 1;
+	}
+	spinlock_release(&coremap_lock);
+	pte = as_lookup_pte(owner, core.vaddr);
+
+	// Remove write enabled TLB entries so the next write is
+	// detected by flag_page_as_dirty.
+	vm_tlb_shootdown(owner, &core.vaddr, 1);
+	spinlock_acquire(&coremap_lock);
+	core_set_dirty(p, false);
+	spinlock_release(&coremap_lock);
+
+	result = save_cluster(owner, core.vaddr, pte, /*dirty=*/1);
+	spinlock_acquire(&coremap_lock);
+	if (result) {
+		core_set_dirty(p, true);
 	}
-	if (dirty || !(pte->status & VM_PTE_BACKED)) {
+	unbusy_page(p);
+	spinlock_release(&coremap_lock);
 #if OPT_VM_PERF
-        count_swap_out();
-#endif
-        result = block_write(pte->block_index, pte->paddr);
-        if (result) {
-            return ENOSPC;
-        }
+	if (result == 0) {
+        count_page_cleaned();
 	}
-	pte->status |= VM_PTE_BACKED;
-	return 0;
+#endif
+	unlock_page_owners(&owner, n);
+	return 1;
 }
 
 /*
- * Finds and evicts a userspace page.
- *
- * Args:
- *   paddr: pointer to physical address of freed page.
+ * Pageout daemon thread.
  *
- * Returns:
- *   0 on success, else errno value.
+ * Sleeps until free pages drop below pageout_low, then cleans dirty
+ * pages until free plus clean pages reach pageout_high so evictions
+ * can usually reclaim a page without writing it first.
  */
-int
-evict_page(paddr_t *paddr)
+static void
+pageout_thread(void *data1, unsigned long data2)
 {
-	// "old" refers to page to be evicted.
-	struct core_page old_core;
-	paddr_t kvaddr;
-	struct pte *old_pte;
-	int p;
-	int old_as_already_locked;
-	struct tlbshootdown shootdown;
-	int result;
-
-	// DO NOT HOLD any VM locks while blocking on evict_lock, which
-	// will cause a deadlock if the evicting process (holding evict_lock)
-	// needs to access your as->pages_lock.
-	struct addrspace *as;
-	as = proc_getas();
-	if  (as != NULL) {
-		KASSERT(!lock_do_i_hold(as->pages_lock));
-	}
-	KASSERT(!spinlock_do_i_hold(&coremap_lock));
+	unsigned reclaimable;
+	unsigned cleaned;
 
-	// There can be at most one process at a time performing an eviction
-	// to avoid a deadlock.  evict_lock must be acquired anytime we touch
-	// another process' pages.  We don't use coremap_lock to gate eviction
-	// because it is a spinlock which means we can't sleep while waiting
-	// for other locks such as as->pages_lock.  (We can't make coremap
-	// a sleep lock because it needs to be accessed in interrupt handlers--kfree).	
-	lock_acquire(evict_lock);
+	(void)data1;
+	(void)data2;
 
-	spinlock_acquire(&coremap_lock);
-	// Identify a page to evict.
-	p = find_victim_page();
-	if (p == 0) {
+	for (;;) {
+		spinlock_acquire(&coremap_lock);
+		while (!swap_enabled || (free_page_count() >= pageout_low)) {
+			wchan_sleep(pageout_wchan, &coremap_lock);
+		}
+		reclaimable = reclaimable_page_count();
 		spinlock_release(&coremap_lock);
-		lock_release(evict_lock);
-		return ENOMEM;
-	}
-	old_core = coremap[p];
-	if (!(old_core.status & VM_CORE_USED)) {
-		// New already free page (not actually an eviction).
-		// Allocate to kernel before releasing coremap to prevent
-		// another process from taking it.
-        *paddr = coremap_assign_to_kernel(p, 1);
-		used_bytes += PAGE_SIZE;
-	} // Else if page is not free, then it cannot be evicted behind
-	// our back because we hold evict_lock.
-	spinlock_release(&coremap_lock);
 
-	if (old_core.status & VM_CORE_USED) {
-#if OPT_VM_PERF
-        count_eviction();
-#endif
-        // We assume we are evicting exactly one page.
-        KASSERT((old_core.status & VM_CORE_NPAGES) == 1);
-		// It's possible we are already holding the page table lock.
-		// For example, if evicting from our own process, or
-		// as_copy where we hold two page tables one which is not our own.
-		// If so, don't re-lock.
-		old_as_already_locked = lock_do_i_hold(old_core.as->pages_lock);
-		if (!old_as_already_locked) {
-            lock_acquire(old_core.as->pages_lock);
+		if (reclaimable < pageout_high) {
+			vm_reclaim(pageout_high - reclaimable);
 		}
-        // Deactivate page so it is not accessed during page out.
-        // Once removed from TLB, any page faults will block
-		// waiting for old_as->pages_lock until we are done.
-		shootdown.as = old_core.as;
-        shootdown.vaddr = old_core.vaddr;
-		shootdown.sem = tlbshootdown_sem;
-		vm_tlb_remove(old_core.vaddr);
-		ipi_broadcast_tlbshootdown(&shootdown);
-        old_pte = as_lookup_pte(old_core.as, old_core.vaddr);
-		// Refresh page dirty status in case page was accessed since we 
-		// last checked.  Page can no longer be accessed since we 
-		// cleared the TLB and locked the page table.
-		spinlock_acquire(&coremap_lock);
-		old_core = coremap[p];
-		spinlock_release(&coremap_lock);
-        result = save_page(old_pte, old_core.status & VM_CORE_DIRTY);
-		if (result) {
-            if (!old_as_already_locked) {
-                lock_release(old_core.as->pages_lock);
-            }
-			return result;
+
+		cleaned = 0;
+		while ((reclaimable + cleaned < pageout_high) && clean_page()) {
+			cleaned++;
 		}
-		// Modify coremap and page table together atomically.
-		spinlock_acquire(&coremap_lock);
-        *paddr = coremap_assign_to_kernel(p, 1);
-        old_pte->status &= ~VM_PTE_VALID;
-        old_pte->paddr = (paddr_t)NULL;
-		spinlock_release(&coremap_lock);
-		if (!old_as_already_locked) {
-            lock_release(old_core.as->pages_lock);
+		if (cleaned == 0) {
+			// Nothing worth cleaning, so don't spin while memory
+			// stays full.
+			clocksleep(1);
 		}
 	}
-	kvaddr = PADDR_TO_KVADDR(*paddr);
-	bzero((void *)kvaddr, PAGE_SIZE);
+}
 
-	lock_release(evict_lock);
-	return 0;
+/*
+ * Starts pageout daemon.
+ */
+static void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("vm_bootstrap: Cannot create pageout_wchan.");
+	}
+	result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("vm_bootstrap: Cannot start pageout daemon: %s\n", 
+		  strerror(result));
+	}
 }
 
 /*
- * Returns coremap index of contiguous block of npages.
+ * Returns coremap index of a free block of at least npages: the
+ * head of the first non-empty free list of sufficient order.
  *
  * Caller is responsible for locking coremap.
  * 
@@ -930,24 +2664,18 @@ evict_page(paddr_t *paddr)
 static unsigned 
 get_ppages(unsigned npages)
 {
-    unsigned p;  // Page index into coremap.
-	unsigned block_pages;
+	unsigned order;
 
     KASSERT(spinlock_do_i_hold(&coremap_lock));
 	KASSERT(npages > 0);
 
-	p = next_fit;
-	KASSERT(p < page_max);
-	block_pages = get_core_npages(p);
-	while ((coremap[p].status & VM_CORE_USED) || (block_pages < npages)) {
-		p = (p + block_pages) % page_max;
-		if (p == next_fit) {
-			// No free pages.
-			return 0;
+	for (order = buddy_order(npages); order < COREMAP_ORDERS; order++) {
+		if (free_lists[order] != 0) {
+			return free_lists[order];
 		}
-		block_pages = get_core_npages(p);
 	}
-	return p;
+	// No free block large enough.
+	return 0;
 }
 
 /*
@@ -969,11 +2697,184 @@ coremap_assign_vaddr(paddr_t paddr, struct addrspace *as, vaddr_t vaddr) {
 
     KASSERT(spinlock_do_i_hold(&coremap_lock));
 	p = paddr_to_core_idx(paddr);
-	coremap[p].as = as;
+	KASSERT(!(coremap[p].status & VM_CORE_TEXT));
+	core_set_as(p, as);
 	coremap[p].vaddr = vaddr;
+	coremap[p].refs = 1;
 	return p;
 }
 
+static unsigned
+text_hash_idx(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+	  % TEXT_HASH_SIZE;
+}
+
+/*
+ * Returns coremap index of the cached text page for (vn, offset)
+ * mapped at vaddr, else 0.
+ *
+ * Caller is responsible for locking coremap.
+ */
+static unsigned
+text_lookup(struct vnode *vn, off_t offset, vaddr_t vaddr)
+{
+	struct text_page *tp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (tp = text_hash[text_hash_idx(vn, offset)]; tp != NULL;
+	     tp = tp->tp_next) {
+		// Sharers must map it at the same vaddr to be found by
+		// lock_page_owners, which a relinked file might not.
+		if ((tp->tp_vn == vn) && (tp->tp_offset == offset)) {
+			return coremap[tp->tp_page].vaddr == vaddr ? tp->tp_page : 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Adds user page p, which holds (vn, offset), to the text page cache
+ * using entry tp, unless another copy got there first.
+ *
+ * Caller is responsible for locking coremap.
+ *
+ * Returns:
+ *   NULL if tp was used, else tp for the caller to free once it has
+ *   unlocked the coremap (see text_page_free).
+ */
+static struct text_page *
+text_insert(unsigned p, struct text_page *tp, struct vnode *vn, off_t offset)
+{
+	unsigned h;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(!(coremap[p].status & VM_CORE_TEXT));
+	h = text_hash_idx(vn, offset);
+	for (struct text_page *q = text_hash[h]; q != NULL; q = q->tp_next) {
+		if ((q->tp_vn == vn) && (q->tp_offset == offset)) {
+			// Ours stays private to this address space.
+			return tp;
+		}
+	}
+	tp->tp_vn = vn;
+	tp->tp_offset = offset;
+	tp->tp_page = p;
+	tp->tp_next = text_hash[h];
+	text_hash[h] = tp;
+	tp->tp_page_next = text_pages[p % TEXT_HASH_SIZE];
+	text_pages[p % TEXT_HASH_SIZE] = tp;
+	coremap[p].status |= VM_CORE_TEXT;
+	return NULL;
+}
+
+/*
+ * Removes page p from the text page cache if it is there.  Called
+ * once nothing maps the page, so the vnode may be gone after.
+ *
+ * Caller is responsible for locking coremap.
+ *
+ * Returns:
+ *   The page's cache entry, if it had one, for the caller to free once
+ *   it has unlocked the coremap (see text_page_free), else NULL.
+ */
+static struct text_page *
+text_remove(unsigned p)
+{
+	struct text_page **prev;
+	struct text_page *tp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (!(coremap[p].status & VM_CORE_TEXT)) {
+		return NULL;
+	}
+	prev = &text_pages[p % TEXT_HASH_SIZE];
+	while ((*prev)->tp_page != p) {
+		prev = &(*prev)->tp_page_next;
+		KASSERT(*prev != NULL);
+	}
+	tp = *prev;
+	*prev = tp->tp_page_next;
+	prev = &text_hash[text_hash_idx(tp->tp_vn, tp->tp_offset)];
+	while (*prev != tp) {
+		prev = &(*prev)->tp_next;
+		KASSERT(*prev != NULL);
+	}
+	*prev = tp->tp_next;
+	coremap[p].status &= ~VM_CORE_TEXT;
+	return tp;
+}
+
+/*
+ * Frees text page cache entry tp, if not NULL.  Freeing may give a
+ * page back to the VM system, so the caller must not hold the coremap
+ * lock.
+ */
+static void
+text_page_free(struct text_page *tp)
+{
+	if (tp != NULL) {
+		objcache_free(text_cache, tp);
+	}
+}
+
+/*
+ * Adds a reference to user page at paddr, which becomes shared
+ * copy on write.
+ *
+ * Caller is responsible for locking the page table mapping paddr,
+ * which keeps the page from being evicted.
+ */
+void
+share_user_page(paddr_t paddr)
+{
+	unsigned p;
+
+	p = paddr_to_core_idx(paddr);
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[p].status & VM_CORE_USED);
+	KASSERT(coremap[p].as != NULL);
+	KASSERT(coremap[p].refs > 0);
+	coremap[p].refs++;
+	// Once shared, coremap[p].as may no longer map the page.
+	coremap[p].status |= VM_CORE_SHARED;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Drops a reference to user page at paddr and frees it once
+ * no page tables map it.  If the page is busy, the thread holding
+ * it busy frees it instead (see release_busy_page).
+ */
+void
+free_user_page(paddr_t paddr)
+{
+	struct text_page *tp;
+	unsigned p;
+	int do_free;
+
+	p = paddr_to_core_idx(paddr);
+	tp = NULL;
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[p].status & VM_CORE_USED);
+	KASSERT(coremap[p].refs > 0);
+	coremap[p].refs--;
+	if (coremap[p].refs == 0) {
+		tp = text_remove(p);
+	}
+	do_free = (coremap[p].refs == 0) && !(coremap[p].status & VM_CORE_BUSY);
+	if (do_free) {
+		// Ours now; keep the clock and pageout daemon off it.
+		core_set_as(p, NULL);
+	}
+	spinlock_release(&coremap_lock);
+	text_page_free(tp);
+	if (do_free) {
+		free_pages(paddr);
+	}
+}
+
 /*
  * Assign pages at coremap index p to kernel.
  *
@@ -992,42 +2893,342 @@ coremap_assign_to_kernel(unsigned p, unsigned npages)
 	paddr_t paddr;
 	vaddr_t kvaddr;
 	unsigned block_pages;
-	unsigned prev;
-	unsigned next;
+	int was_free;
 
     KASSERT(spinlock_do_i_hold(&coremap_lock));
 
 	block_pages = get_core_npages(p);
 	KASSERT(block_pages >= npages);
+	was_free = !(coremap[p].status & VM_CORE_USED);
+	if (was_free) {
+		buddy_remove(p, buddy_order(block_pages));
+	} else {
+		// Reusing an evicted user page.
+		KASSERT(block_pages == 1);
+	}
 	paddr = core_idx_to_paddr(p);
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 	KASSERT((paddr >= firstpaddr) && (paddr <= lastpaddr));
 	kvaddr = PADDR_TO_KVADDR(paddr);
-	coremap[p].status =	set_core_status(/*used=*/1, 0, 0, npages);
-	coremap[p].as = NULL;
+	core_set_as(p, NULL);
+	coremap[p].status =	set_core_status(/*used=*/1, 0, npages);
 	coremap[p].vaddr = kvaddr;
+	coremap[p].refs = 0;
+	coremap[p].accessed = 0;
 
-	// Split out remaining free pages if any as a new block.
-	prev = p;
-	p += npages;
-	KASSERT(p <= page_max);
-	if (p == page_max) {
-		p = 0;
-	} else if (block_pages > npages) {
-		coremap[p].status = set_core_status(/*used=*/0, 0, 0, block_pages - npages);
-		coremap[p].as = NULL;
-		coremap[p].vaddr = (vaddr_t)NULL;
-		coremap[p].prev = prev;
-		next = prev + block_pages;
-		if (next < page_max) {
-            coremap[next].prev = p;
-		}
+	// Give back the unused tail of the buddy block.
+	if (was_free && block_pages > npages) {
+		buddy_free_range(p + npages, block_pages - npages);
 	}
-	next_fit = p;
 	
 	return paddr;
 }
 
+/*
+ * Returns this cpu's page cache, or NULL early in boot.  If we migrate
+ * after reading the cpu number we just use another cpu's cache,
+ * which is safe since they're locked.
+ */
+static struct pagecache *
+pagecache_get(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &pagecaches[curcpu->c_number];
+}
+
+/*
+ * Returns n cached pages to the buddy allocator.
+ */
+static void
+pagecache_spill(const unsigned *pages, unsigned n)
+{
+	unsigned p;
+
+	spinlock_acquire(&coremap_lock);
+	for (unsigned i = 0; i < n; i++) {
+		p = pages[i];
+		KASSERT(coremap[p].status == set_core_status(1, 0, 1));
+		KASSERT(coremap[p].as == NULL);
+		coremap[p].status = 0;
+		coremap[p].vaddr = (vaddr_t)NULL;
+		buddy_free_range(p, 1);
+	}
+	used_bytes -= n * PAGE_SIZE;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Takes a page from this cpu's cache, refilling the cache with a
+ * batch from the buddy allocator if it is empty.
+ *
+ * Returns:
+ *   Physical address of page, else 0 if no page is free.
+ */
+static paddr_t
+pagecache_alloc(void)
+{
+	struct pagecache *pc;
+	unsigned pages[PAGECACHE_BATCH];
+	unsigned n, p;
+
+	pc = pagecache_get();
+	if (pc == NULL) {
+		return 0;
+	}
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count > 0) {
+		p = pc->pc_pages[--pc->pc_count];
+		spinlock_release(&pc->pc_lock);
+		return core_idx_to_paddr(p);
+	}
+	spinlock_release(&pc->pc_lock);
+
+	// Empty; take a batch of single pages under one coremap_lock.
+	spinlock_acquire(&coremap_lock);
+	for (n = 0; n < PAGECACHE_BATCH; n++) {
+		p = get_ppages(1);
+		if (p == 0) {
+			break;
+		}
+		coremap_assign_to_kernel(p, 1);
+		pages[n] = p;
+	}
+	used_bytes += n * PAGE_SIZE;
+#if OPT_VM_PERF
+    if (used_bytes > peak_used_bytes) {
+		peak_used_bytes = used_bytes;
+	}
+#endif
+	pageout_poke();
+	spinlock_release(&coremap_lock);
+	if (n == 0) {
+		return 0;
+	}
+	p = pages[--n];
+
+	spinlock_acquire(&pc->pc_lock);
+	while (n > 0 && pc->pc_count < PAGECACHE_SIZE) {
+		pc->pc_pages[pc->pc_count++] = pages[--n];
+	}
+	spinlock_release(&pc->pc_lock);
+
+	// Someone else refilled it meanwhile; give back the excess.
+	if (n > 0) {
+		pagecache_spill(pages, n);
+	}
+	return core_idx_to_paddr(p);
+}
+
+/*
+ * Puts single kernel page p in this cpu's cache, spilling a batch to
+ * the buddy allocator if the cache is full.  The caller must own the
+ * page; it is not on as_list and nothing else writes its coremap entry.
+ *
+ * Returns:
+ *   0 if cached, else -1 if there is no cache yet.
+ */
+static int
+pagecache_free(unsigned p)
+{
+	struct pagecache *pc;
+	unsigned pages[PAGECACHE_BATCH];
+	unsigned n;
+
+	pc = pagecache_get();
+	if (pc == NULL) {
+		return -1;
+	}
+	coremap[p].status = set_core_status(/*used=*/1, 0, 1);
+	coremap[p].vaddr = PADDR_TO_KVADDR(core_idx_to_paddr(p));
+	coremap[p].refs = 0;
+
+	n = 0;
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == PAGECACHE_SIZE) {
+		// Full; take a batch out to return to the buddy lists.
+		while (n < PAGECACHE_BATCH) {
+			pages[n++] = pc->pc_pages[--pc->pc_count];
+		}
+	}
+	pc->pc_pages[pc->pc_count++] = p;
+	spinlock_release(&pc->pc_lock);
+
+	if (n > 0) {
+		pagecache_spill(pages, n);
+	}
+	return 0;
+}
+
+/*
+ * Returns n zeroed pool pages to the buddy allocator.  They were
+ * never counted in used_bytes.
+ */
+static void
+zeropool_spill(const unsigned *pages, unsigned n)
+{
+	unsigned p;
+
+	spinlock_acquire(&coremap_lock);
+	for (unsigned i = 0; i < n; i++) {
+		p = pages[i];
+		KASSERT(coremap[p].status == set_core_status(1, 0, 1));
+		KASSERT(coremap[p].as == NULL);
+		coremap[p].status = 0;
+		coremap[p].vaddr = (vaddr_t)NULL;
+		buddy_free_range(p, 1);
+	}
+	KASSERT(zeroed_pages >= n);
+	zeroed_pages -= n;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Takes a page zeroed by the idle loop, trying this cpu's pool before
+ * the others'.  Counts are read unlocked to skip empty pools.
+ *
+ * Returns:
+ *   Physical address of a zeroed page, else 0 if every pool is empty.
+ */
+static paddr_t
+pagecache_alloc_zeroed(void)
+{
+	struct pagecache *pc, *mine;
+	unsigned i, n, p;
+
+	mine = pagecache_get();
+	if (mine == NULL) {
+		return 0;
+	}
+	n = num_cpus > 0 ? num_cpus : 1;
+	for (i = 0; i <= n; i++) {
+		pc = (i == 0) ? mine : &pagecaches[i - 1];
+		if ((i > 0 && pc == mine) || pc->pc_nzeroed == 0) {
+			continue;
+		}
+		spinlock_acquire(&pc->pc_lock);
+		if (pc->pc_nzeroed > 0) {
+			p = pc->pc_zeroed[--pc->pc_nzeroed];
+			spinlock_release(&pc->pc_lock);
+
+			// Now it is really allocated.
+			spinlock_acquire(&coremap_lock);
+			zeroed_pages--;
+			used_bytes += PAGE_SIZE;
+#if OPT_VM_PERF
+			if (used_bytes > peak_used_bytes) {
+				peak_used_bytes = used_bytes;
+			}
+#endif
+			pageout_poke();
+			spinlock_release(&coremap_lock);
+			return core_idx_to_paddr(p);
+		}
+		spinlock_release(&pc->pc_lock);
+	}
+	return 0;
+}
+
+/*
+ * Zeroes one free page into this cpu's zeroed pool.  Called from the
+ * idle loop with interrupts off, one page at a time so the run queue
+ * is checked between pages.  Pages come from this cpu's page cache
+ * first, then from the buddy lists while free memory is above the
+ * pageout high watermark so zeroing never pushes us toward eviction.
+ *
+ * Returns:
+ *   true if a page was zeroed, else false if there was nothing to do.
+ */
+bool
+vm_idle_zero_page(void)
+{
+	struct pagecache *pc;
+	unsigned p;
+	bool cached;
+
+	if (!coremap_enabled) {
+		return false;
+	}
+	pc = pagecache_get();
+	if (pc == NULL || pc->pc_nzeroed >= ZEROPOOL_SIZE) {
+		return false;
+	}
+
+	p = 0;
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count > 0) {
+		p = pc->pc_pages[--pc->pc_count];
+	}
+	spinlock_release(&pc->pc_lock);
+	cached = (p != 0);
+
+	spinlock_acquire(&coremap_lock);
+	if (cached) {
+		// Cached pages are counted as used; pool pages are not.
+		used_bytes -= PAGE_SIZE;
+	} else if (free_page_count() > pageout_high) {
+		p = get_ppages(1);
+		if (p != 0) {
+			coremap_assign_to_kernel(p, 1);
+		}
+	}
+	if (p == 0) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	zeroed_pages++;
+	spinlock_release(&coremap_lock);
+
+	bzero((void *)PADDR_TO_KVADDR(core_idx_to_paddr(p)), PAGE_SIZE);
+
+	// Only this cpu's idle loop fills its pool, so there is room.
+	spinlock_acquire(&pc->pc_lock);
+	KASSERT(pc->pc_nzeroed < ZEROPOOL_SIZE);
+	pc->pc_zeroed[pc->pc_nzeroed++] = p;
+	spinlock_release(&pc->pc_lock);
+	return true;
+}
+
+/*
+ * Empties every cpu's page cache and zeroed pool into the buddy
+ * allocator.
+ *
+ * Returns:
+ *   Number of pages freed.
+ */
+static unsigned
+pagecache_drain(void)
+{
+	struct pagecache *pc;
+	unsigned pages[PAGECACHE_SIZE];
+	unsigned zeroed[ZEROPOOL_SIZE];
+	unsigned i, n, nz;
+	unsigned nfreed = 0;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		pc = &pagecaches[i];
+		spinlock_acquire(&pc->pc_lock);
+		n = pc->pc_count;
+		memcpy(pages, pc->pc_pages, n * sizeof(pages[0]));
+		pc->pc_count = 0;
+		nz = pc->pc_nzeroed;
+		memcpy(zeroed, pc->pc_zeroed, nz * sizeof(zeroed[0]));
+		pc->pc_nzeroed = 0;
+		spinlock_release(&pc->pc_lock);
+		if (n > 0) {
+			pagecache_spill(pages, n);
+			nfreed += n;
+		}
+		if (nz > 0) {
+			zeropool_spill(zeroed, nz);
+			nfreed += nz;
+		}
+	}
+	return nfreed;
+}
+
 /*
  * Allocates npages of contiguous pages in coremap and assign 
  * to kernel.  Does not modify page table.
@@ -1048,10 +3249,40 @@ alloc_pages(unsigned npages)
 	paddr_t paddr;
 	vaddr_t kvaddr;
 	int result;
+
+	if (npages == 1) {
+		paddr = pagecache_alloc_zeroed();
+		if (paddr != 0) {
+#if OPT_VM_PERF
+			count_zero_hit();
+#endif
+			return paddr;
+		}
+#if OPT_VM_PERF
+		count_zero_miss();
+#endif
+		paddr = pagecache_alloc();
+		if (paddr != 0) {
+			bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+			return paddr;
+		}
+	}
 	
 	spinlock_acquire(&coremap_lock);
 	p = get_ppages(npages);
 	if (p == 0) {
+		// Let page caches and other kernel caches give memory
+		// back before evicting.
+		spinlock_release(&coremap_lock);
+		pagecache_drain();
+		if (num_reclaimers > 0) {
+			vm_reclaim(npages);
+		}
+		spinlock_acquire(&coremap_lock);
+		p = get_ppages(npages);
+	}
+	if (p == 0) {
+		pageout_poke();
 		spinlock_release(&coremap_lock);
 		// No free pages in coremap.
 		if (!swap_enabled || (npages != 1)) {
@@ -1075,6 +3306,7 @@ alloc_pages(unsigned npages)
 	paddr = coremap_assign_to_kernel(p, npages);
 	kvaddr = PADDR_TO_KVADDR(paddr);
 	bzero((void *)kvaddr, npages * PAGE_SIZE);
+	pageout_poke();
 	spinlock_release(&coremap_lock);
 	return paddr;
 }
@@ -1177,13 +3409,20 @@ free_pages(paddr_t paddr)
 {
     unsigned p;
 	unsigned npages;
-	unsigned next;
-	unsigned prev;
 	vaddr_t vaddr;
 
 	KASSERT((paddr >= firstpaddr) && (paddr < lastpaddr));
 	p = paddr_to_core_idx(paddr);
 
+	// Single pages we own outright go to the page cache.
+	KASSERT(coremap[p].status & VM_CORE_USED);
+	if ((get_core_npages(p) == 1) && (coremap[p].as == NULL)) {
+		vm_tlb_remove(coremap[p].vaddr);
+		if (pagecache_free(p) == 0) {
+			return;
+		}
+	}
+
 	spinlock_acquire(&coremap_lock);
 
 	// Free this block.
@@ -1195,43 +3434,14 @@ free_pages(paddr_t paddr)
 		vaddr += PAGE_SIZE;
 	}
 
-	coremap[p].status &= VM_CORE_NPAGES;
+	core_set_as(p, NULL);
+	coremap[p].status = 0;
 	coremap[p].vaddr = (vaddr_t)NULL;
-	coremap[p].as = NULL;
+	coremap[p].refs = 0;
 	used_bytes -= npages * PAGE_SIZE;
 
-	// Attempt to coalesce next block.
-	next = p + npages;
-	if ((next < page_max) && !(coremap[next].status & VM_CORE_USED)) {
-		npages += get_core_npages(next);
-		KASSERT(npages <= VM_CORE_NPAGES);
-        coremap[p].status &= ~VM_CORE_NPAGES;
-		coremap[p].status |= npages & VM_CORE_NPAGES;
-		// If next_fit was on the coalesced block, move to new head of block.
-		if (next_fit == next) {
-			next_fit = p;
-		}
-		next = p + npages;
-		if (next < page_max) {
-            coremap[next].prev = p;
-		}
-	}
-
-	// Attempt to coalesce previous block.
-	prev = coremap[p].prev;
-	if (!(coremap[prev].status & VM_CORE_USED)) {
-        npages += get_core_npages(prev);
-		KASSERT(npages <= VM_CORE_NPAGES);
-        coremap[prev].status &= ~VM_CORE_NPAGES;
-		coremap[prev].status |= npages & VM_CORE_NPAGES;
-		// If next_fit was on the coalesced block, move to new head of block.
-		if (next_fit == p) {
-			next_fit = prev;
-		}
-		if (next < page_max) {
-            coremap[next].prev = prev;
-		}
-	}
+	// Split into aligned blocks and merge each with its buddies.
+	buddy_free_range(p, npages);
 
 	spinlock_release(&coremap_lock);
 }
@@ -1241,6 +3451,11 @@ coremap_used_bytes() {
 	unsigned result;
 
 	if (coremap_enabled) {
+		// Pages held only by object caches and kmalloc's and the
+		// coremap's per-cpu caches don't count.
+		objcache_reclaim(0);
+		kheap_drain();
+		pagecache_drain();
         spinlock_acquire(&coremap_lock);
         result = used_bytes;
         spinlock_release(&coremap_lock);
@@ -1255,9 +3470,9 @@ coremap_used_bytes() {
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    // TODO(aabo): check proc_getas() == ts->as but this seems
-	// to cause a deadlock.
-	vm_tlb_remove(ts->vaddr);
+	for (unsigned i = 0; i < ts->npages; i++) {
+		vm_tlb_remove_as(ts->as, ts->vaddrs[i]);
+	}
 	V(ts->sem);
 }
 
@@ -1265,7 +3480,8 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
  * Flags a page as dirty in coremap and TLB.
  * 
  * Returns:
- *   0 on success, else 1.
+ *   0 on success, 1 if page is not in TLB, or
+ *   VM_PAGE_SHARED if page must be copied before writing.
  */
 static int
 flag_page_as_dirty(vaddr_t vaddr)
@@ -1281,7 +3497,7 @@ flag_page_as_dirty(vaddr_t vaddr)
 
 	spinlock_acquire(&coremap_lock);
 	spl = splhigh();
-	tlb_idx = tlb_probe(vaddr & PAGE_FRAME, 0);
+	tlb_idx = tlb_probe((vaddr & PAGE_FRAME) | tlb_curpid(), 0);
 	if (tlb_idx < 0) {
         splx(spl);
         spinlock_release(&coremap_lock);
@@ -1289,10 +3505,15 @@ flag_page_as_dirty(vaddr_t vaddr)
     }
     tlb_read(&entryhi, &entrylo, tlb_idx);
     paddr = entrylo & TLBLO_PPAGE;
+    p = paddr_to_core_idx(paddr);
+    if (coremap[p].refs > 1) {
+        splx(spl);
+        spinlock_release(&coremap_lock);
+        return VM_PAGE_SHARED;
+    }
     entrylo |= TLBLO_DIRTY;
     tlb_write(entryhi, entrylo, tlb_idx);
-    p = paddr_to_core_idx(paddr);
-    coremap[p].status |= VM_CORE_DIRTY;
+    core_set_dirty(p, true);
     splx(spl);
     spinlock_release(&coremap_lock);
 
@@ -1301,9 +3522,13 @@ flag_page_as_dirty(vaddr_t vaddr)
 
 /*
  * Inserts a valid page table entry into translation lookaside buffer.
+ *
+ * Pages are normally inserted read-only so the first write can be
+ * detected by flag_page_as_dirty.  Set writeable if the page is
+ * already known to be dirty.
  */
 static void
-vm_tlb_insert(paddr_t paddr, vaddr_t vaddr)
+vm_tlb_insert(paddr_t paddr, vaddr_t vaddr, int writeable)
 {
 	uint32_t ehi, elo;
 	int spl;
@@ -1314,8 +3539,11 @@ vm_tlb_insert(paddr_t paddr, vaddr_t vaddr)
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-	ehi = vaddr & PAGE_FRAME;
+	ehi = (vaddr & PAGE_FRAME) | tlb_curpid();
 	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
 	KASSERT(elo & TLBLO_VALID);
 	DEBUG(DB_VM, "vm_tlb_insert: 0x%x -> 0x%x\n", vaddr, paddr);
 	// Check if vaddr already in TLB so we don't duplicate.
@@ -1328,6 +3556,111 @@ vm_tlb_insert(paddr_t paddr, vaddr_t vaddr)
 	splx(spl);
 }
 
+/*
+ * Maps resident pages at vaddrs into the TLB ahead of use, skipping
+ * any already there; rewriting an existing entry could drop its dirty
+ * bit.  Only free slots are used, so prefetching never displaces the
+ * entry just refilled for faultaddress or any other in use, except
+ * that with no free slot at all one random entry other than
+ * faultaddress's is replaced, so a full TLB still gets one page of
+ * read ahead.
+ *
+ * Returns:
+ *   Number of entries written.
+ */
+static unsigned
+vm_tlb_prefetch(const paddr_t *paddrs, const vaddr_t *vaddrs, unsigned n,
+		vaddr_t faultaddress)
+{
+	uint32_t ehi, elo;
+	uint32_t pid;
+	unsigned slots[TLB_PREFETCH];
+	unsigned nslots, written;
+	int fault_idx;
+	int spl;
+
+	KASSERT(n <= TLB_PREFETCH);
+
+	spl = splhigh();
+	pid = tlb_curpid();
+	nslots = 0;
+	for (unsigned i = 0; (i < NUM_TLB) && (nslots < n); i++) {
+		tlb_read(&ehi, &elo, i);
+		if (!(elo & TLBLO_VALID)) {
+			slots[nslots++] = i;
+		}
+	}
+	if ((nslots == 0) && (n > 0)) {
+		fault_idx = tlb_probe((faultaddress & PAGE_FRAME) | pid, 0);
+		do {
+			slots[0] = random() % NUM_TLB;
+		} while ((int)slots[0] == fault_idx);
+		nslots = 1;
+	}
+	written = 0;
+	for (unsigned i = 0; (i < n) && (written < nslots); i++) {
+		KASSERT(vaddrs[i] < MIPS_KSEG0);
+		ehi = (vaddrs[i] & PAGE_FRAME) | pid;
+		if (tlb_probe(ehi, 0) >= 0) {
+			continue;
+		}
+		elo = paddrs[i] | TLBLO_VALID;
+		tlb_write(ehi, elo, slots[written++]);
+	}
+	// tlb_read loads each entry's ASID into the cpu.
+	tlb_setpid(pid);
+	splx(spl);
+	return written;
+}
+
+/*
+ * Maps resident pages following faultaddress into the TLB, stopping
+ * at the first page that is not resident or is being paged in (see
+ * vm_tlb_prefetch).  Entries are read-only like any refill.
+ *
+ * Prefetched pages are not marked accessed, so a prefetch alone
+ * doesn't save a page from the clock.  Like any entry of the running
+ * address space, a prefetched entry still in the TLB when
+ * vm_tlb_sweep runs marks its page then, whether or not it was used.
+ *
+ * Caller is responsible for locking as->pages_lock, which keeps
+ * pages we see as not busy from being evicted or paged in.
+ */
+static void
+tlb_prefetch_neighbours(struct addrspace *as, vaddr_t faultaddress)
+{
+	paddr_t paddrs[TLB_PREFETCH];
+	vaddr_t vaddrs[TLB_PREFETCH];
+	pte_t *pte;
+	vaddr_t vaddr;
+	unsigned n, written;
+
+	KASSERT(lock_do_i_hold(as->pages_lock));
+	for (n = 0; n < TLB_PREFETCH; n++) {
+		vaddr = faultaddress + (n + 1) * PAGE_SIZE;
+		if (vaddr >= MIPS_KSEG0 || vaddr < faultaddress) {
+			break;
+		}
+		pte = as_lookup_pte(as, vaddr);
+		if ((pte == NULL) || !(*pte & VM_PTE_VALID)) {
+			break;
+		}
+		if (coremap[paddr_to_core_idx(PTE_PADDR(*pte))].status & VM_CORE_BUSY) {
+			break;
+		}
+		paddrs[n] = PTE_PADDR(*pte);
+		vaddrs[n] = vaddr;
+	}
+	written = vm_tlb_prefetch(paddrs, vaddrs, n, faultaddress);
+#if OPT_VM_PERF
+	for (unsigned i = 0; i < written; i++) {
+		count_tlb_prefetch();
+	}
+#else
+	(void)written;
+#endif
+}
+
 /*
  * Lock coremap and find victim page.
  *
@@ -1337,29 +3670,203 @@ paddr_t
 locking_find_victim_page()
 {
 	paddr_t paddr;
+	unsigned busy;
 	spinlock_acquire(&coremap_lock);
-	paddr = find_victim_page();
+	paddr = find_victim_page(&busy);
 	spinlock_release(&coremap_lock);
 	return paddr;
 }
 
+/*
+ * Lock coremap and find a page for the pageout daemon to clean.
+ *
+ * Do not use.  For testing only.
+ */
+unsigned
+locking_find_dirty_page(void)
+{
+	unsigned p;
+
+	spinlock_acquire(&coremap_lock);
+	p = find_dirty_page();
+	spinlock_release(&coremap_lock);
+	return p;
+}
+
+/*
+ * Moves the clock and pageout daemon hands to the page at paddr,
+ * which need not head a block.
+ *
+ * Do not use.  For testing only.
+ */
+void
+set_coremap_hands(paddr_t paddr)
+{
+	spinlock_acquire(&coremap_lock);
+	clock_hand = paddr_to_core_idx(paddr);
+	clean_hand = clock_hand;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Marks page at paddr referenced for the clock.  Needs no lock: a
+ * lost update only costs the page its second chance.
+ */
 static void
 touch_paddr(paddr_t paddr) {
 	unsigned p;
 
-	KASSERT(spinlock_do_i_hold(&coremap_lock));
 	p = paddr_to_core_idx(paddr);
-	coremap[p].status |= VM_CORE_ACCESSED;
+	coremap[p].accessed = 1;
+}
+
+/*
+ * Maps the cached copy of the text page at faultaddress, if another
+ * address space running the same executable has read it in already
+ * and fewer than EVICT_MAX_OWNERS map it.  Past that the page could
+ * no longer be evicted, so the caller reads in a private copy.
+ *
+ * Caller is responsible for locking as->pages_lock.  pte must not be
+ * valid.
+ *
+ * Returns:
+ *   1 with as->pages_lock released if the page was mapped, or is
+ *   being read in and the access must be retried, else 0 with
+ *   as->pages_lock still held.
+ */
+static int
+map_text_page(struct addrspace *as, vaddr_t faultaddress, pte_t *pte)
+{
+	struct vnode *vn;
+	off_t offset;
+	paddr_t paddr;
+	unsigned p;
+
+	KASSERT(lock_do_i_hold(as->pages_lock));
+	KASSERT(!(*pte & VM_PTE_VALID));
+	if ((*pte & VM_PTE_BACKED) ||
+	    !as_text_page(as, faultaddress, &vn, &offset)) {
+		return 0;
+	}
+	spinlock_acquire(&coremap_lock);
+	p = text_lookup(vn, offset, faultaddress);
+	if (p == 0) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	if (coremap[p].status & VM_CORE_BUSY) {
+		// Being read in or evicted.  Wait then retry the access.
+		lock_release(as->pages_lock);
+		wait_for_page(p);
+		spinlock_release(&coremap_lock);
+		return 1;
+	}
+	KASSERT(coremap[p].refs > 0);
+	if (coremap[p].refs >= EVICT_MAX_OWNERS) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	coremap[p].refs++;
+	// Once shared, coremap[p].as may no longer map the page.
+	coremap[p].status |= VM_CORE_SHARED;
+	paddr = core_idx_to_paddr(p);
+	*pte = paddr | VM_PTE_VALID;
+	touch_paddr(paddr);
+	vm_tlb_insert(paddr, faultaddress, 0);
+	spinlock_release(&coremap_lock);
+	lock_release(as->pages_lock);
+#if OPT_VM_PERF
+	count_text_hit();
+#endif
+	return 1;
+}
+
+/*
+ * Reads busy page p, newly mapped at faultaddress by pte, from the
+ * executable backing it.  On error the page is freed and pte left
+ * empty so the next access tries again.
+ *
+ * Called without as->pages_lock.
+ *
+ * Returns:
+ *   0 on success, else errno value.
+ */
+static int
+load_file_page(struct addrspace *as, vaddr_t faultaddress, pte_t *pte,
+		unsigned p)
+{
+	struct text_page *tp;
+	paddr_t paddr;
+	int result;
+
+	paddr = core_idx_to_paddr(p);
+	result = as_load_page(as, faultaddress, paddr);
+#if OPT_VM_PERF
+	count_file_in();
+#endif
+	if (result) {
+		tp = NULL;
+		lock_acquire(as->pages_lock);
+		spinlock_acquire(&coremap_lock);
+		if ((*pte & VM_PTE_VALID) && (PTE_PADDR(*pte) == paddr)) {
+			KASSERT(coremap[p].refs == 1);
+			*pte = 0;
+			coremap[p].refs = 0;
+			tp = text_remove(p);
+		}
+		spinlock_release(&coremap_lock);
+		lock_release(as->pages_lock);
+		text_page_free(tp);
+		release_busy_page(p);
+		return result;
+	}
+	spinlock_acquire(&coremap_lock);
+	if (coremap[p].refs > 0) {
+        vm_tlb_insert(paddr, faultaddress, 0);
+	}
+	spinlock_release(&coremap_lock);
+	release_busy_page(p);
+	return 0;
+}
+
+/*
+ * Returns page table entry for vaddr if it can be read ahead along
+ * with block_index, i.e. it is swapped out to the next block.
+ *
+ * Caller is responsible for locking as->pages_lock.
+ */
+static pte_t *
+readahead_pte(struct addrspace *as, vaddr_t vaddr, unsigned block_index)
+{
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(as->pages_lock));
+	pte = as_lookup_pte(as, vaddr);
+	if ((pte == NULL) || (*pte & VM_PTE_VALID) ||
+	    !(*pte & VM_PTE_BACKED) || (pte_block(*pte) != block_index)) {
+		return NULL;
+	}
+	return pte;
 }
 
 /*
  * Retrieve page containing faultaddress.
  *
  * Search page table for faultaddress.
- * If we find it, just update the TLB and return.
+ * If we find it, just update the TLB, prefetching the resident pages
+ * after it, and return.
  * If not found, allocate a new page in memory.
  * If page is paged out, then page in from swapdisk.
+ * If it was never written and belongs to an executable, read it from
+ * the executable (see load_file_page).
  * Update page table and TLB.
+ *
+ * While paging in, the new page is marked busy and the page table is
+ * unlocked so evictions can take other pages from this address space.
+ * Other faults on the same page wait for it in wait_for_page.
+ *
+ * Following pages stored in the following swap blocks (see
+ * save_cluster) are read in the same request if memory allows.
  * 
  * Args:
  *   as: Pointer to address space.
@@ -1372,7 +3879,20 @@ int
 get_page_via_table(struct addrspace *as, vaddr_t faultaddress)
 {
 	paddr_t paddr;
-	struct pte *pte;
+	pte_t *pte;
+	unsigned block_index;
+	unsigned p;
+	paddr_t paddrs[SWAP_READAHEAD];
+	paddr_t extra[SWAP_READAHEAD - 1];
+	struct text_page *tp;
+	pte_t *ptes[SWAP_READAHEAD];
+	unsigned core_idx[SWAP_READAHEAD];
+	unsigned nextra, n, i;
+	vaddr_t vaddr;
+	struct vnode *vn;
+	off_t offset;
+	int file;
+	int text;
 	int result;
 
 #if OPT_VM_PERF
@@ -1386,18 +3906,37 @@ get_page_via_table(struct addrspace *as, vaddr_t faultaddress)
 		return ENOMEM;
 	}
 	// Easy case: page is in memory, just update TLB.
-	if (pte->status & VM_PTE_VALID) {
-        KASSERT((pte->paddr & PAGE_FRAME) == pte->paddr);
-        vm_tlb_insert(pte->paddr, faultaddress);
-		spinlock_acquire(&coremap_lock);
-		touch_paddr(pte->paddr);
-		spinlock_release(&coremap_lock);
+	if (*pte & VM_PTE_VALID) {
+		p = paddr_to_core_idx(PTE_PADDR(*pte));
+		// Evicting or cleaning a page needs our pages_lock, and a
+		// page-in marks the page busy while holding it, so a page
+		// we see as not busy stays usable until we unlock.  Only
+		// busy pages need the coremap lock.
+		if (coremap[p].status & VM_CORE_BUSY) {
+			spinlock_acquire(&coremap_lock);
+			if (coremap[p].status & VM_CORE_BUSY) {
+				// Still being paged in.  Wait then retry the access.
+				lock_release(as->pages_lock);
+				wait_for_page(p);
+				spinlock_release(&coremap_lock);
+				return 0;
+			}
+			spinlock_release(&coremap_lock);
+		}
+        vm_tlb_insert(PTE_PADDR(*pte), faultaddress, 0);
+		touch_paddr(PTE_PADDR(*pte));
+		tlb_prefetch_neighbours(as, faultaddress);
         lock_release(as->pages_lock);
 #if OPT_VM_PERF
         count_tlb_fault();
 #endif		
         return 0;
 	}
+	// Another address space may have read this page of the same
+	// executable already.
+	if (map_text_page(as, faultaddress, pte)) {
+		return 0;
+	}
 	// Following VM locking order to avoid a deadlock.
 	lock_release(as->pages_lock);
 
@@ -1407,33 +3946,208 @@ get_page_via_table(struct addrspace *as, vaddr_t faultaddress)
 	if (paddr == 0) {
         return ENOMEM;
     }
+	// A text page needs a cache entry, which also cannot be
+	// allocated under our locks.  Without one the page stays private.
+	tp = NULL;
+	if (as_text_page(as, faultaddress, &vn, &offset)) {
+		tp = objcache_alloc(text_cache);
+	}
 	lock_acquire(as->pages_lock);
-    if (pte->status & VM_PTE_BACKED) {
-        KASSERT(swap_enabled);
-        result = block_read(pte->block_index, paddr);
-#if OPT_VM_PERF
-        count_swap_in();
-#endif
-        if (result) {
-            free_pages(paddr);
-            lock_release(as->pages_lock);
-            return EIO;
-        }
-    }
+	if (*pte & VM_PTE_VALID) {
+		// Another thread paged it in while we were allocating.
+		lock_release(as->pages_lock);
+		text_page_free(tp);
+		free_pages(paddr);
+		return 0;
+	}
+	file = !(*pte & VM_PTE_BACKED) && as_file_backed(as, faultaddress);
+	text = file && (tp != NULL);
 	// Modify coremap and page table together atomically.
 	spinlock_acquire(&coremap_lock);
-	coremap_assign_vaddr(paddr, as, faultaddress);
-    pte->paddr = paddr;
+	p = coremap_assign_vaddr(paddr, as, faultaddress);
 	touch_paddr(paddr);
-    pte->status |= VM_PTE_VALID;
-    vm_tlb_insert(pte->paddr, faultaddress);
+	if (file) {
+		// Read from the executable with the page busy, as for swap.
+		// Other address spaces wait for it in map_text_page.
+		if (text) {
+			tp = text_insert(p, tp, vn, offset);
+		}
+		*pte = paddr | VM_PTE_VALID;
+		coremap[p].status |= VM_CORE_BUSY;
+		spinlock_release(&coremap_lock);
+		lock_release(as->pages_lock);
+		text_page_free(tp);
+		return load_file_page(as, faultaddress, pte, p);
+	}
+    if (!(*pte & VM_PTE_BACKED)) {
+        *pte = paddr | VM_PTE_VALID;
+        vm_tlb_insert(paddr, faultaddress, 0);
+        spinlock_release(&coremap_lock);
+        lock_release(as->pages_lock);
+        text_page_free(tp);
+        return 0;
+    }
+	// Swap block moves to the coremap while the page is resident.
+	block_index = pte_block(*pte);
+	coremap[p].block = block_index;
+    *pte = paddr | VM_PTE_VALID | VM_PTE_BACKED;
+	coremap[p].status |= VM_CORE_BUSY;
     spinlock_release(&coremap_lock);
+	paddrs[0] = paddr;
+	core_idx[0] = p;
+	ptes[0] = pte;
+	for (nextra = 0; nextra < SWAP_READAHEAD - 1; nextra++) {
+		vaddr = faultaddress + (nextra + 1) * PAGE_SIZE;
+		if (readahead_pte(as, vaddr, block_index + nextra + 1) == NULL) {
+			break;
+		}
+	}
     lock_release(as->pages_lock);
-		
+    text_page_free(tp);
+    KASSERT(swap_enabled);
+
+	// Read ahead only from free memory, never by evicting.
+	n = 1;
+	if (nextra > 0) {
+		spinlock_acquire(&coremap_lock);
+		if (free_page_count() < pageout_low + nextra) {
+			nextra = 0;
+		}
+		spinlock_release(&coremap_lock);
+		for (i = 0; i < nextra; i++) {
+			extra[i] = alloc_pages(1);
+			if (extra[i] == 0) {
+				break;
+			}
+		}
+		nextra = i;
+		lock_acquire(as->pages_lock);
+		for (i = 0; i < nextra; i++) {
+			vaddr = faultaddress + n * PAGE_SIZE;
+			ptes[n] = readahead_pte(as, vaddr, block_index + n);
+			if (ptes[n] == NULL) {
+				break;
+			}
+			spinlock_acquire(&coremap_lock);
+			core_idx[n] = coremap_assign_vaddr(extra[i], as, vaddr);
+			coremap[core_idx[n]].status |= VM_CORE_BUSY;
+			coremap[core_idx[n]].block = block_index + n;
+			*ptes[n] = extra[i] | VM_PTE_VALID | VM_PTE_BACKED;
+			spinlock_release(&coremap_lock);
+			paddrs[n] = extra[i];
+			n++;
+		}
+		lock_release(as->pages_lock);
+		for (; i < nextra; i++) {
+			free_pages(extra[i]);
+		}
+	}
+
+    result = block_io(block_index, paddrs, n, UIO_READ);
+#if OPT_VM_PERF
+	for (i = 0; i < n; i++) {
+        count_swap_in();
+	}
+#endif
+	if (result) {
+		lock_acquire(as->pages_lock);
+		spinlock_acquire(&coremap_lock);
+		for (i = 0; i < n; i++) {
+			if ((*ptes[i] & VM_PTE_VALID) && (PTE_PADDR(*ptes[i]) == paddrs[i])) {
+				// Leave page backed only by swap.
+				KASSERT(coremap[core_idx[i]].refs == 1);
+				*ptes[i] = PTE_SWAPPED(block_index + i);
+				coremap[core_idx[i]].refs = 0;
+			}
+		}
+		spinlock_release(&coremap_lock);
+		lock_release(as->pages_lock);
+		for (i = 0; i < n; i++) {
+            release_busy_page(core_idx[i]);
+		}
+		return EIO;
+	}
+	spinlock_acquire(&coremap_lock);
+	if (coremap[p].refs > 0) {
+        vm_tlb_insert(paddr, faultaddress, 0);
+	}
+	spinlock_release(&coremap_lock);
+	for (i = 0; i < n; i++) {
+        release_busy_page(core_idx[i]);
+	}
     return 0;
 }
 
+/*
+ * Makes a private copy of a page shared copy on write.
+ *
+ * Called on the first write to a page whose coremap refs > 1.
+ * The new page is mapped writeable and flagged dirty since it
+ * no longer matches any copy in swap.
+ *
+ * Args:
+ *   as: Pointer to address space.
+ *   faultaddress: Page-aligned address that caused a write fault.
+ *
+ * Returns:
+ *   0 on success, else errno value.
+ */
+static int
+copy_on_write(struct addrspace *as, vaddr_t faultaddress)
+{
+	paddr_t paddr;
+	paddr_t new_paddr;
+	pte_t *pte;
+	unsigned p;
+	unsigned new_p;
 
+	// Following VM locking order, allocate before locking page table.
+	new_paddr = alloc_pages(1);
+	if (new_paddr == 0) {
+		return ENOMEM;
+	}
+	lock_acquire(as->pages_lock);
+	pte = as_lookup_pte(as, faultaddress);
+	if ((pte == NULL) || !(*pte & VM_PTE_VALID)) {
+		// Evicted while we were allocating, retry access.
+		lock_release(as->pages_lock);
+		free_pages(new_paddr);
+		return 0;
+	}
+	paddr = PTE_PADDR(*pte);
+	p = paddr_to_core_idx(paddr);
+	spinlock_acquire(&coremap_lock);
+	if (coremap[p].refs == 1) {
+		// Every other sharer has already made a copy or exited.
+		core_set_dirty(p, true);
+		touch_paddr(paddr);
+		vm_tlb_insert(paddr, faultaddress, 1);
+		spinlock_release(&coremap_lock);
+		lock_release(as->pages_lock);
+		free_pages(new_paddr);
+		return 0;
+	}
+#if OPT_VM_PERF
+    count_cow_fault();
+#endif
+	// Page cannot be evicted while we hold pages_lock and a reference.
+	memcpy((void *)PADDR_TO_KVADDR(new_paddr), 
+	  (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	coremap[p].refs--;
+	new_p = coremap_assign_vaddr(new_paddr, as, faultaddress);
+	core_set_dirty(new_p, true);
+	// pte keeps its swap block, if any, which save_page will
+	// replace rather than overwrite while it is still shared.
+	coremap[new_p].block = coremap[p].block;
+	*pte = new_paddr | (*pte & (VM_PTE_VALID | VM_PTE_BACKED));
+	touch_paddr(new_paddr);
+	vm_tlb_insert(new_paddr, faultaddress, 1);
+	spinlock_release(&coremap_lock);
+	lock_release(as->pages_lock);
+	// Other cpus may still map the shared page read-only.
+	vm_tlb_retire(as, 1);
+	return 0;
+}
 
 /*
  * Handles translation lookaside buffer faults.
@@ -1511,10 +4225,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	// for page cleaning.  Set write enable (TLB "dirty=1")
 	// and retry.
 	if (faulttype == VM_FAULT_READONLY) {
-		if (flag_page_as_dirty(faultaddress) == 0) {
+		result = flag_page_as_dirty(faultaddress);
+		if (result == 0) {
 			// Successfully flagged in TLB, retry access.
             return 0;
 		}
+		if (result == VM_PAGE_SHARED) {
+			return copy_on_write(as, faultaddress);
+		}
 		// Page is no longer in TLB, so treat as vanilla write page fault.
 	}
 	result = get_page_via_table(as, faultaddress);
@@ -37,6 +37,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -179,14 +180,139 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Microseconds elapsed from start to end.
+ */
+static
+uint64_t
+lhd_usec(const struct timespec *start, const struct timespec *end)
+{
+	struct timespec diff;
+
+	timespec_sub(end, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * Choose the next request to get the disk (C-LOOK): the lowest
+ * sector at or after the head, else the lowest sector overall. A
+ * request beginning exactly where the last transfer ended in the same
+ * direction is taken first and counted as merged, since it continues
+ * the previous transfer with no seek.
+ *
+ * Removes the request from the queue. Caller holds lh_qlock.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request **pp, **ahead, **lowest;
+	struct lhd_request *req;
+
+	KASSERT(lock_do_i_hold(lh->lh_qlock));
+
+	ahead = lowest = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		req = *pp;
+		if (req->lr_sector == lh->lh_head &&
+		    req->lr_rw == lh->lh_lastrw) {
+			ahead = pp;
+			lh->lh_merged++;
+			break;
+		}
+		if (req->lr_sector >= lh->lh_head &&
+		    (ahead == NULL || req->lr_sector < (*ahead)->lr_sector)) {
+			ahead = pp;
+		}
+		if (lowest == NULL || req->lr_sector < (*lowest)->lr_sector) {
+			lowest = pp;
+		}
+	}
+	pp = (ahead != NULL) ? ahead : lowest;
+	if (pp == NULL) {
+		return NULL;
+	}
+	req = *pp;
+	*pp = req->lr_next;
+	req->lr_next = NULL;
+	return req;
+}
+
+/*
+ * Wait in the request queue until req is given the disk.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, struct lhd_request *req)
+{
+	lock_acquire(lh->lh_qlock);
+	lh->lh_depthsum += lh->lh_depth;
+	lh->lh_depth++;
+	if (lh->lh_depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = lh->lh_depth;
+	}
+	if (!lh->lh_busy) {
+		KASSERT(lh->lh_queue == NULL);
+		lh->lh_busy = true;
+		req->lr_go = true;
+	}
+	else {
+		req->lr_next = lh->lh_queue;
+		lh->lh_queue = req;
+		while (!req->lr_go) {
+			cv_wait(lh->lh_qcv, lh->lh_qlock);
+		}
+	}
+	lock_release(lh->lh_qlock);
+}
+
+/*
+ * Give up the disk after req and pass it to the next request.
+ */
+static
+void
+lhd_finish(struct lhd_softc *lh, struct lhd_request *req,
+	   uint64_t waitusec, uint64_t serviceusec)
+{
+	struct lhd_request *next;
+
+	lock_acquire(lh->lh_qlock);
+	KASSERT(lh->lh_busy);
+	lh->lh_head = req->lr_sector + req->lr_nsect;
+	lh->lh_lastrw = req->lr_rw;
+	lh->lh_depth--;
+	lh->lh_requests++;
+	lh->lh_sectors += req->lr_nsect;
+	lh->lh_waitusec += waitusec;
+	lh->lh_serviceusec += serviceusec;
+
+	next = lhd_pick(lh);
+	if (next == NULL) {
+		lh->lh_busy = false;
+	}
+	else {
+		next->lr_go = true;
+		cv_broadcast(lh->lh_qcv, lh->lh_qlock);
+	}
+	lock_release(lh->lh_qlock);
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Requests from different threads are queued and given the disk one
+ * at a time in C-LOOK order. The hardware transfers one sector per
+ * operation through the on-card buffer, so the thread owning a
+ * request moves its own data; it keeps the disk for all its sectors
+ * so requests are not interleaved sector by sector.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
+	struct timespec queued, started, done;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
@@ -194,7 +320,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -207,17 +333,28 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
+	if (len == 0) {
+		return 0;
+	}
+
 	/* Set up the value to write into the status register. */
 	if (uio->uio_rw==UIO_WRITE) {
 		statval |= LHD_ISWRITE;
 	}
 
+	/* Wait until the scheduler gives us the device. */
+	req.lr_sector = sector;
+	req.lr_nsect = len;
+	req.lr_rw = uio->uio_rw;
+	req.lr_go = false;
+	req.lr_next = NULL;
+	gettime(&queued);
+	lhd_start(lh, &req);
+	gettime(&started);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -226,8 +363,7 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 			membar_store_store();
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
@@ -252,22 +388,61 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	/* Let the next request have the device. */
+	gettime(&done);
+	lhd_finish(lh, &req, lhd_usec(&queued, &started),
+		   lhd_usec(&started, &done));
+
+	return result;
+}
+
+/*
+ * Print, or clear if RESET is set, request queue statistics.
+ */
+static
+void
+lhd_stats(struct device *d, bool reset)
+{
+	struct lhd_softc *lh = d->d_data;
+	unsigned reqs;
+
+	lock_acquire(lh->lh_qlock);
+	if (reset) {
+		lh->lh_maxdepth = lh->lh_depth;
+		lh->lh_depthsum = 0;
+		lh->lh_requests = 0;
+		lh->lh_sectors = 0;
+		lh->lh_merged = 0;
+		lh->lh_waitusec = 0;
+		lh->lh_serviceusec = 0;
+		lock_release(lh->lh_qlock);
+		return;
+	}
+	reqs = lh->lh_requests;
+	kprintf("lhd%d: %u requests, %u sectors, %u merged\n",
+		lh->lh_unit, reqs, lh->lh_sectors, lh->lh_merged);
+	kprintf("lhd%d: queue depth %u now, %u max, %llu.%02llu avg\n",
+		lh->lh_unit, lh->lh_depth, lh->lh_maxdepth,
+		reqs ? lh->lh_depthsum / reqs : 0,
+		reqs ? lh->lh_depthsum * 100 / reqs % 100 : 0);
+	kprintf("lhd%d: avg wait %llu us, avg service %llu us\n",
+		lh->lh_unit,
+		reqs ? lh->lh_waitusec / reqs : 0,
+		reqs ? lh->lh_serviceusec / reqs : 0);
+	lock_release(lh->lh_qlock);
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_stats = lhd_stats,
 };
 
 /*
@@ -284,17 +459,39 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
+	/* Create the synchronization primitives. */
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
+	lh->lh_qlock = lock_create("lhd-queue");
+	if (lh->lh_qlock == NULL) {
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+	lh->lh_qcv = cv_create("lhd-queue");
+	if (lh->lh_qcv == NULL) {
+		lock_destroy(lh->lh_qlock);
+		lh->lh_qlock = NULL;
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+
+	/* Set up the request queue. */
+	lh->lh_queue = NULL;
+	lh->lh_busy = false;
+	lh->lh_head = 0;
+	lh->lh_lastrw = UIO_READ;
+	lh->lh_depth = 0;
+	lh->lh_maxdepth = 0;
+	lh->lh_depthsum = 0;
+	lh->lh_requests = 0;
+	lh->lh_sectors = 0;
+	lh->lh_merged = 0;
+	lh->lh_waitusec = 0;
+	lh->lh_serviceusec = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -31,12 +31,25 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <uio.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A transfer waiting for or holding the disk.  Lives on the stack of
+ * the thread doing the I/O.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	enum uio_rw lr_rw;		/* Read or write */
+	bool lr_go;			/* Set when given the disk */
+	struct lhd_request *lr_next;	/* Next in lh_queue */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -52,8 +65,25 @@ struct lhd_softc {
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Synchronization */
+
+	/* Request queue, protected by lh_qlock */
+	struct lock *lh_qlock;
+	struct cv *lh_qcv;		/* Signaled when a request gets the disk */
+	struct lhd_request *lh_queue;	/* Waiting requests, unsorted */
+	bool lh_busy;			/* A request holds the disk */
+	uint32_t lh_head;		/* Sector after last transfer */
+	enum uio_rw lh_lastrw;		/* Direction of last transfer */
+
+	/* Statistics, protected by lh_qlock */
+	unsigned lh_depth;		/* Requests queued or in service */
+	unsigned lh_maxdepth;
+	uint64_t lh_depthsum;		/* Sum of depth seen by each arrival */
+	unsigned lh_requests;
+	unsigned lh_sectors;
+	unsigned lh_merged;		/* Requests continuing the previous one */
+	uint64_t lh_waitusec;		/* Total time queued */
+	uint64_t lh_serviceusec;	/* Total time holding the disk */
 
 	struct device lh_dev;		/* VFS device structure */
 };
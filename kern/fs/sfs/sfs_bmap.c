@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -50,13 +51,11 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * I/O buffer for handling indirect blocks. This is on the
+	 * stack since several files may be mapped at once; the block
+	 * itself is cached by sfs_readblock.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	uint32_t idbuf[SFS_DBPERIDB];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
@@ -66,8 +65,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The inode and indirect block belong to the vnode's lock. */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -198,19 +197,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* I/O buffer for handling the indirect block. */
+	uint32_t idbuf[SFS_DBPERIDB];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
@@ -224,8 +217,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int hasnonzero, iddirty;
 
 	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -255,7 +247,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* Read the indirect block */
 		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 
@@ -285,7 +276,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 			result = sfs_writeblock(sfs, idblock, idbuf,
 						sizeof(idbuf));
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
 		}
@@ -297,7 +287,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
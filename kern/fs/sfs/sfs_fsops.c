@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -107,19 +108,49 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 /*
  * Sync routine for the vnode table.
+ *
+ * Syncing the directory locks it, which must not be done holding
+ * sfs_vnlock, so first take a reference to each loaded vnode and
+ * then sync them with the table unlocked.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct vnode *v;
 	unsigned i, num;
+	int result;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
 	num = vnodearray_num(sfs->sfs_vnodes);
+	result = vnodearray_setsize(vnodes, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+		v = vnodearray_get(sfs->sfs_vnodes, i);
+		VOP_INCREF(v);
+		vnodearray_set(vnodes, i, v);
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	/* Go over the array of loaded vnodes, syncing as we go. */
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(vnodes, i);
 		VOP_FSYNC(v);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
 	return 0;
 }
 
@@ -132,13 +163,16 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +186,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -229,6 +266,13 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
+	/* Write back everything the above left in the buffer cache. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -262,6 +306,8 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -277,19 +323,31 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 
 	/* Do we have any files open? If so, can't unmount. */
+	lock_acquire(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Nothing should be left dirty in the buffer cache either. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	sfs_buf_invalidate(sfs);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -355,13 +413,25 @@ sfs_fs_create(void)
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	return sfs;
 
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -408,6 +478,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	result = sfs_buf_bootstrap();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_vnode_bootstrap();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
 		vfs_biglock_release();
@@ -421,6 +502,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -434,6 +516,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -451,6 +534,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -458,6 +542,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -36,7 +36,9 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <device.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -62,8 +64,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -101,19 +101,455 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Buffer cache
+//
+// All block I/O goes through a cache of SFS_BUF_MAX blocks shared by
+// all mounted volumes, indexed by (volume, block) in a hash table.
+// Writes only mark the buffer dirty; dirty buffers are written back
+// when they are evicted, on sync, and on unmount.
+//
+// The least recently used buffer is recycled when the cache is full.
+// The cache does not grow while free memory is low, and gives clean
+// buffers back when the VM system asks (see sfs_buf_reclaim).
+//
+// sfs_buf_lock protects the hash table, LRU list and buffer headers.
+// A thread using a buffer's data marks it busy and drops the lock, so
+// disk I/O and copies to user memory do not hold up other buffers.
+// Threads wanting a busy buffer wait on sfs_buf_cv.
+
+#define SFS_BUF_MAX	512	/* Most buffers ever allocated */
+#define SFS_BUF_HASH	128	/* Hash table buckets */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* Volume, NULL if buffer unused */
+	daddr_t b_block;		/* Block number on volume */
+	bool b_dirty;			/* Modified since read or written */
+	bool b_busy;			/* Data in use by some thread */
+	struct sfs_buf *b_hashnext;	/* Next in hash bucket */
+	struct sfs_buf *b_lruprev;	/* More recently used */
+	struct sfs_buf *b_lrunext;	/* Less recently used */
+	char *b_data;			/* SFS_BLOCKSIZE bytes */
+};
+
+static struct lock *sfs_buf_lock;
+static struct cv *sfs_buf_cv;
+static struct sfs_buf *sfs_buf_hash[SFS_BUF_HASH];
+static struct sfs_buf *sfs_buf_mru;	/* Head of LRU list */
+static struct sfs_buf *sfs_buf_lru;	/* Tail of LRU list */
+static unsigned sfs_buf_count;		/* Buffers allocated */
+
+static
+unsigned
+sfs_buf_hashfunc(struct sfs_fs *sfs, daddr_t block)
+{
+	return ((uintptr_t)sfs / sizeof(struct sfs_fs) + block) % SFS_BUF_HASH;
+}
+
 /*
- * Read a block.
+ * Remove a buffer from the LRU list.
  */
+static
+void
+sfs_buf_lru_remove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		sfs_buf_mru = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		sfs_buf_lru = buf->b_lruprev;
+	}
+	buf->b_lruprev = buf->b_lrunext = NULL;
+}
+
+/*
+ * Put a buffer at the most recently used end of the LRU list, or at
+ * the least recently used end if it holds no block.
+ */
+static
+void
+sfs_buf_lru_insert(struct sfs_buf *buf)
+{
+	if (buf->b_fs == NULL) {
+		buf->b_lruprev = sfs_buf_lru;
+		buf->b_lrunext = NULL;
+		if (sfs_buf_lru != NULL) {
+			sfs_buf_lru->b_lrunext = buf;
+		}
+		else {
+			sfs_buf_mru = buf;
+		}
+		sfs_buf_lru = buf;
+	}
+	else {
+		buf->b_lruprev = NULL;
+		buf->b_lrunext = sfs_buf_mru;
+		if (sfs_buf_mru != NULL) {
+			sfs_buf_mru->b_lruprev = buf;
+		}
+		else {
+			sfs_buf_lru = buf;
+		}
+		sfs_buf_mru = buf;
+	}
+}
+
+/*
+ * Remove a buffer from its hash chain, mark it unused, and move it
+ * to the least recently used end of the LRU list.
+ */
+static
+void
+sfs_buf_unhash(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	KASSERT(buf->b_fs != NULL);
+	KASSERT(!buf->b_dirty);
+	pp = &sfs_buf_hash[sfs_buf_hashfunc(buf->b_fs, buf->b_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = buf->b_hashnext;
+	buf->b_hashnext = NULL;
+	buf->b_fs = NULL;
+	sfs_buf_lru_remove(buf);
+	sfs_buf_lru_insert(buf);
+}
+
+/*
+ * Write a dirty buffer back to disk.
+ *
+ * Called with sfs_buf_lock held; drops it during the write. The
+ * buffer is busy meanwhile, and is left not busy.
+ */
+static
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_buf_writeback(struct sfs_buf *buf)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buf_lock));
+	KASSERT(buf->b_dirty);
+	KASSERT(!buf->b_busy);
+
+	buf->b_busy = true;
+	buf->b_dirty = false;
+	lock_release(sfs_buf_lock);
+
+	SFSUIO(&iov, &ku, buf->b_data, buf->b_block, UIO_WRITE);
+	result = sfs_rwblock(buf->b_fs, &ku);
+
+	lock_acquire(sfs_buf_lock);
+	if (result) {
+		buf->b_dirty = true;
+	}
+	buf->b_busy = false;
+	cv_broadcast(sfs_buf_cv, sfs_buf_lock);
+	return result;
+}
+
+/*
+ * Create a new buffer if the cache may grow.
+ */
+static
+struct sfs_buf *
+sfs_buf_create(void)
 {
+	struct sfs_buf *buf;
+
+	if (sfs_buf_count >= SFS_BUF_MAX || vm_memory_low()) {
+		return NULL;
+	}
+	buf = kmalloc(sizeof(struct sfs_buf));
+	if (buf == NULL) {
+		return NULL;
+	}
+	buf->b_data = kmalloc(SFS_BLOCKSIZE);
+	if (buf->b_data == NULL) {
+		kfree(buf);
+		return NULL;
+	}
+	buf->b_fs = NULL;
+	buf->b_dirty = false;
+	buf->b_busy = false;
+	buf->b_hashnext = NULL;
+	buf->b_lruprev = buf->b_lrunext = NULL;
+	sfs_buf_lru_insert(buf);
+	sfs_buf_count++;
+	return buf;
+}
+
+/*
+ * Find the buffer for a block, or set one up for it, and mark it
+ * busy. If the block was not cached and DOREAD is set, it is read in
+ * from disk. The buffer is made most recently used.
+ *
+ * The caller uses the data and then calls sfs_buf_put.
+ */
+static
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool doread,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
 	struct iovec iov;
 	struct uio ku;
+	unsigned h;
+	int result;
+
+	h = sfs_buf_hashfunc(sfs, block);
+	lock_acquire(sfs_buf_lock);
+ again:
+	for (buf = sfs_buf_hash[h]; buf != NULL; buf = buf->b_hashnext) {
+		if (buf->b_fs == sfs && buf->b_block == block) {
+			break;
+		}
+	}
+	if (buf != NULL) {
+		if (buf->b_busy) {
+			cv_wait(sfs_buf_cv, sfs_buf_lock);
+			goto again;
+		}
+		buf->b_busy = true;
+		sfs_buf_lru_remove(buf);
+		sfs_buf_lru_insert(buf);
+		lock_release(sfs_buf_lock);
+		*ret = buf;
+		return 0;
+	}
+
+	/* Not cached; get a new buffer or the least recently used idle one. */
+	buf = sfs_buf_create();
+	if (buf == NULL) {
+		for (buf = sfs_buf_lru; buf != NULL; buf = buf->b_lruprev) {
+			if (!buf->b_busy) {
+				break;
+			}
+		}
+		if (buf == NULL) {
+			/* Everything is in use; wait for something. */
+			cv_wait(sfs_buf_cv, sfs_buf_lock);
+			goto again;
+		}
+		if (buf->b_dirty) {
+			result = sfs_buf_writeback(buf);
+			if (result) {
+				lock_release(sfs_buf_lock);
+				return result;
+			}
+			/* The lock was dropped; start over. */
+			goto again;
+		}
+		if (buf->b_fs != NULL) {
+			sfs_buf_unhash(buf);
+		}
+	}
+
+	/* Enter it in the table busy so others looking for it wait. */
+	buf->b_fs = sfs;
+	buf->b_block = block;
+	buf->b_busy = true;
+	buf->b_hashnext = sfs_buf_hash[h];
+	sfs_buf_hash[h] = buf;
+	sfs_buf_lru_remove(buf);
+	sfs_buf_lru_insert(buf);
+	lock_release(sfs_buf_lock);
+
+	if (doread) {
+		SFSUIO(&iov, &ku, buf->b_data, block, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
+		if (result) {
+			lock_acquire(sfs_buf_lock);
+			sfs_buf_unhash(buf);
+			buf->b_busy = false;
+			cv_broadcast(sfs_buf_cv, sfs_buf_lock);
+			lock_release(sfs_buf_lock);
+			return result;
+		}
+	}
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Finish using a buffer from sfs_buf_get. If DIRTY is set the data
+ * was modified. If DISCARD is set the data is not valid and the
+ * buffer is dropped from the cache (unless it holds earlier
+ * modifications, which are kept).
+ */
+static
+void
+sfs_buf_put(struct sfs_buf *buf, bool dirty, bool discard)
+{
+	lock_acquire(sfs_buf_lock);
+	KASSERT(buf->b_busy);
+	if (dirty) {
+		buf->b_dirty = true;
+	}
+	else if (discard && !buf->b_dirty) {
+		sfs_buf_unhash(buf);
+	}
+	buf->b_busy = false;
+	cv_broadcast(sfs_buf_cv, sfs_buf_lock);
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * Give back clean buffers to the VM system when memory runs low.
+ * Called from the page allocator, so it must not sleep waiting for
+ * the cache.
+ *
+ * Buffers come from kmalloc, so freeing one only frees a page once
+ * the rest of the page is free too. The pages actually given back
+ * are measured from coremap_used_bytes, which also drains kmalloc's
+ * caches so emptied pages reach the VM system. Allocations by other
+ * threads meanwhile can only make the count low.
+ */
+static
+unsigned
+sfs_buf_reclaim(unsigned npages)
+{
+	struct sfs_buf *buf, *prev;
+	unsigned want, freed = 0;
+	unsigned before, after;
+
+	before = coremap_used_bytes();
+	if (!lock_tryacquire(sfs_buf_lock)) {
+		return 0;
+	}
+	want = npages * (PAGE_SIZE / SFS_BLOCKSIZE);
+	for (buf = sfs_buf_lru; buf != NULL && freed < want; buf = prev) {
+		prev = buf->b_lruprev;
+		if (buf->b_dirty || buf->b_busy) {
+			continue;
+		}
+		if (buf->b_fs != NULL) {
+			sfs_buf_unhash(buf);
+		}
+		sfs_buf_lru_remove(buf);
+		kfree(buf->b_data);
+		kfree(buf);
+		sfs_buf_count--;
+		freed++;
+	}
+	lock_release(sfs_buf_lock);
+	if (freed == 0) {
+		return 0;
+	}
+	after = coremap_used_bytes();
+	return before > after ? (before - after) / PAGE_SIZE : 0;
+}
+
+/*
+ * Set up the buffer cache. Called on each mount; only the first call
+ * does anything. Mounts are serialized by vfs_biglock.
+ */
+int
+sfs_buf_bootstrap(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_buf_lock != NULL) {
+		return 0;
+	}
+	sfs_buf_cv = cv_create("sfs_buf");
+	if (sfs_buf_cv == NULL) {
+		return ENOMEM;
+	}
+	sfs_buf_lock = lock_create("sfs_buf");
+	if (sfs_buf_lock == NULL) {
+		cv_destroy(sfs_buf_cv);
+		sfs_buf_cv = NULL;
+		return ENOMEM;
+	}
+	vm_register_reclaim(sfs_buf_reclaim);
+	return 0;
+}
+
+/*
+ * Write back all dirty buffers of a volume.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(sfs_buf_lock);
+ again:
+	for (buf = sfs_buf_mru; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_fs != sfs || !buf->b_dirty) {
+			continue;
+		}
+		if (buf->b_busy) {
+			cv_wait(sfs_buf_cv, sfs_buf_lock);
+			goto again;
+		}
+		result = sfs_buf_writeback(buf);
+		if (result) {
+			lock_release(sfs_buf_lock);
+			return result;
+		}
+		/* The lock was dropped; start over. */
+		goto again;
+	}
+	lock_release(sfs_buf_lock);
+	return 0;
+}
+
+/*
+ * Drop all buffers of a volume, which must have been synced.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf, *next;
+
+	lock_acquire(sfs_buf_lock);
+ again:
+	for (buf = sfs_buf_mru; buf != NULL; buf = next) {
+		next = buf->b_lrunext;
+		if (buf->b_fs != sfs) {
+			continue;
+		}
+		if (buf->b_busy) {
+			cv_wait(sfs_buf_cv, sfs_buf_lock);
+			goto again;
+		}
+		sfs_buf_unhash(buf);
+	}
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * Read a block.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buf->b_data, SFS_BLOCKSIZE);
+	sfs_buf_put(buf, false, false);
+	return 0;
 }
 
 /*
@@ -122,13 +558,77 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buf->b_data, data, SFS_BLOCKSIZE);
+	sfs_buf_put(buf, true, false);
+	return 0;
+}
+
+/*
+ * Move LEN bytes starting SKIPSTART bytes into a block between the
+ * cache and a uio. A write of a whole block need not read it first.
+ */
+static
+int
+sfs_buf_uio(struct sfs_fs *sfs, daddr_t block, uint32_t skipstart,
+	    uint32_t len, struct uio *uio)
+{
+	struct sfs_buf *buf;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	bool doread = !iswrite || len < SFS_BLOCKSIZE;
+	int result;
+
+	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+
+	result = sfs_buf_get(sfs, block, doread, &buf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buf->b_data + skipstart, len, uio);
+	if (iswrite) {
+		/* If the copy failed the data may be half written. */
+		sfs_buf_put(buf, result == 0, result != 0);
+	}
+	else {
+		sfs_buf_put(buf, false, false);
+	}
+	return result;
+}
+
+/*
+ * Copy LEN bytes at OFFSET within a block between the cache and a
+ * kernel buffer.
+ */
+static
+int
+sfs_buf_meta(struct sfs_fs *sfs, daddr_t block, uint32_t offset,
+	     void *data, size_t len, enum uio_rw rw)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(offset + len <= SFS_BLOCKSIZE);
+
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	if (rw == UIO_READ) {
+		memcpy(data, buf->b_data + offset, len);
+	}
+	else {
+		memcpy(buf->b_data + offset, data, len);
+	}
+	sfs_buf_put(buf, rw == UIO_WRITE, false);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,15 +650,6 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
 	uint32_t fileblock;
@@ -168,9 +659,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -184,40 +673,17 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Perform the requested operation on the block in the buffer
+	 * cache, which reads it in first if needed.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
-
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return sfs_buf_uio(sfs, diskblock, skipstart, len, uio);
 }
 
 /*
@@ -232,10 +698,8 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,32 +721,9 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
+	/* Move the data through the buffer cache. */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
-	return result;
+	return sfs_buf_uio(sfs, diskblock, 0, SFS_BLOCKSIZE, uio);
 }
 
 /*
@@ -414,17 +855,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,27 +877,13 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Copy the selected region in or out of the cached block */
+	result = sfs_buf_meta(sfs, diskblock, blockoffset, data, len, rw);
 	if (result) {
 		return result;
 	}
 
-	if (rw == UIO_READ) {
-		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
-	}
-	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
-
+	if (rw == UIO_WRITE) {
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
@@ -35,6 +35,7 @@
  */
 
 #include <types.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -64,34 +65,43 @@ struct vnode;
 // enable writes.
 #define VM_SEGMENT_WRITEABLE_ACTUAL 0x8 
 
-// Virtual address bits per page table level.
-//  32b vaddr = 20b VPN + 12b page offset
-//  VPN = 5b + 5b + 5b + 5b
-#define PT_LEVELS 4
+// Two level page table.
+//  32b vaddr = 10b directory index + 10b leaf index + 12b page offset
+// The directory and each leaf table are one page each.
 #define VPN_BITS 20
 #define PAGE_OFFSET_BITS 12
-#define VPN_BITS_PER_LEVEL (VPN_BITS / PT_LEVELS)
-
+#define PT_INDEX_BITS (VPN_BITS / 2)
+#define PT_ENTRIES (1 << PT_INDEX_BITS)  // Entries per directory or leaf.
+#define PT_DIR_INDEX(vaddr) ((vaddr) >> (PAGE_OFFSET_BITS + PT_INDEX_BITS))
+#define PT_LEAF_INDEX(vaddr) (((vaddr) >> PAGE_OFFSET_BITS) & (PT_ENTRIES - 1))
+
+// A segment loaded from an executable is paged in from its vnode on
+// first access (see as_load_page).  Memory past file_size is zero.
+// Pages of read-only segments are shared by every address space
+// running the executable (see as_text_page).
 struct segment {
     vaddr_t vbase;  // Starting virtual address.
     size_t size;  // Size in bytes.
     int access;  // Segment permissions.  See flags above.
+    struct vnode *vn;  // Executable backing the segment, or NULL.
+    vaddr_t file_vaddr;  // Virtual address of first byte from file.
+    off_t file_offset;  // File offset of file_vaddr.
+    size_t file_size;  // Bytes of segment held in file.
 };
 
-// Note: VALID and BACKED will both be zero for first page access.
+// Page table entry, one word.  Zero until the page is first accessed.
+// If VALID, the frame bits hold the physical address of the page, and
+// the swap block (if BACKED) is kept in the page's coremap entry (see
+// pte_block).  Else if BACKED, the frame bits hold the swap block.
+// Dirty and copy-on-write state live in the coremap too.
+typedef uint32_t pte_t;
 #define VM_PTE_VALID 0x1  // Page in memory.
 #define VM_PTE_BACKED 0x2  // Page on disk.
-
-typedef uint32_t pte_status_t;
-
-// Page table entry.
-// We don't store the virtual address which is inherently coded in the indices
-// of the multi-level page tables.
-struct pte {
-    pte_status_t status;  // {BACKED, VALID, BLOCK_INDEX} bits.
-    paddr_t paddr;
-    unsigned block_index;  // Page number offset on swap disk.
-};
+#define VM_PTE_FRAME 0xfffff000
+#define PTE_PADDR(pte) ((paddr_t)((pte) & VM_PTE_FRAME))
+#define PTE_SWAPPED(block) \
+        (((pte_t)(block) << PAGE_OFFSET_BITS) | VM_PTE_BACKED)
+#define PTE_MAX_BLOCKS (1U << (32 - PAGE_OFFSET_BITS))
 
 struct addrspace {
 #if OPT_DUMBVM
@@ -105,11 +115,14 @@ struct addrspace {
 #else
         struct segment segments[SEGMENT_MAX];
         int next_segment;  // Next segment index to populate.
-        void *pages0[1<<VPN_BITS_PER_LEVEL];  // Level0 page table.
+        pte_t **pt_dir;  // Page directory of PT_ENTRIES leaf tables.
         struct lock *pages_lock;  // Page table lock.
         vaddr_t vheapbase;  // Starting address of heap.
         vaddr_t vheaptop;  // Current top of heap.
         struct lock *heap_lock;
+        struct addrspace *next;  // Next address space in as_list.
+        unsigned swap_hint;  // Swap block to allocate from next.
+        uint32_t asids[MAXCPUS];  // TLB ASID on each cpu (see vm.c).
 #endif
 };
 
@@ -146,6 +159,9 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_define_file - back a region with part of an executable, which
+ *                is read in a page at a time as the pages are touched.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -167,6 +183,9 @@ int               as_define_region(struct addrspace *as,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
+int               as_define_file(struct addrspace *as, struct vnode *vn,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 int               as_define_heap(struct addrspace *as);
 
@@ -180,12 +199,21 @@ int               as_define_heap(struct addrspace *as);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
+void as_bootstrap(void);
+void as_list_acquire(void);
+void as_list_release(void);
+struct addrspace *as_list_first(void);
+
 int as_operation_is_valid(struct addrspace *as, vaddr_t vaddr, int read_request);
-struct pte *as_touch_pte(struct addrspace *as, vaddr_t vaddr);
-struct pte *as_lookup_pte(struct addrspace *as, vaddr_t vaddr);
+pte_t *as_touch_pte(struct addrspace *as, vaddr_t vaddr);
+pte_t *as_lookup_pte(struct addrspace *as, vaddr_t vaddr);
 void dump_page_table(struct addrspace *as);
 void dump_segments(struct addrspace *as);
 void as_destroy_page(struct addrspace *as, vaddr_t vaddr);
+int as_file_backed(struct addrspace *as, vaddr_t vaddr);
+int as_load_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+int as_text_page(struct addrspace *as, vaddr_t vaddr, struct vnode **vn,
+                 off_t *offset);
 int as_validate_page_table(struct addrspace *as);
 
 #endif /* _ADDRSPACE_H_ */
@@ -62,6 +62,7 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_steal_seed;		/* PRNG state for picking victims */
 
 	/*
 	 * Accessed by other cpus.
@@ -156,6 +157,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus sends one to each CPU in a mask of CPU
+ * numbers except the current one, without waiting for them.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -171,6 +174,8 @@ void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 void ipi_broadcast_tlbshootdown(const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_cpus(uint32_t cpumask,
+			       const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
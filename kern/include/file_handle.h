@@ -18,6 +18,7 @@ struct file_handle {
     int flags;  // O_RDONLY, O_WRONLY, O_RDWR
 };
 
+void file_handle_bootstrap(void);
 struct file_handle *create_file_handle(const char *);
 void close_file_handle(struct file_handle *);
 void destroy_file_handle(struct file_handle *);
@@ -134,6 +134,7 @@ unsigned long kheap_getused(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+unsigned kheap_drain(void);
 
 /*
  * C string functions.
@@ -0,0 +1,41 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out fixed-size objects carved from pages
+ * dedicated to that cache (slabs), instead of from kmalloc's shared
+ * subpage pools. Objects are kept in their constructed state: the
+ * constructor runs when a slab is created and the destructor when it
+ * is given back to the VM system, not on every allocation and free.
+ * So objcache_free must be handed an object in the same state the
+ * constructor left it in.
+ *
+ * Either function may be NULL. The constructor returns 0 or an error
+ * code; it and the destructor are called with no spinlocks held and
+ * may sleep. Objects must be no bigger than PAGE_SIZE/4.
+ *
+ * Fully free slabs beyond a small reserve are released right away;
+ * the rest go when the VM system runs short (objcache_reclaim).
+ */
+
+struct objcache;
+
+typedef int (*objcache_ctor)(void *obj);
+typedef void (*objcache_dtor)(void *obj);
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 objcache_ctor ctor, objcache_dtor dtor);
+void objcache_destroy(struct objcache *oc);
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+/* Release every fully free slab. Returns the number of pages freed. */
+unsigned objcache_reclaim(unsigned npages);
+
+/* Print per-cache usage. */
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
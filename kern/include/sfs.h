@@ -50,16 +50,28 @@
 
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, and the file's data and indirect
+ * blocks.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* inode and data lock */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock ordering: directory sv_lock, then sfs_vnlock, then file
+ * sv_lock, then sfs_freemaplock. The buffer cache lock (sfs_io.c)
+ * comes after all of these.
+ *
+ * Page faults may read executables through these locks, so none of
+ * them may be held while touching user memory: all uios passed to
+ * SFS must be kernel ones.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
@@ -67,8 +79,10 @@ struct sfs_fs {
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 };
 
 /*
@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the object caches locks and condition variables come from.
+ * Called once during boot, after wchan_bootstrap.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -71,6 +77,12 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the holder is running on another cpu, and sleeps only if the holder
+ * is not running or the spin budget runs out. Every lock keeps
+ * contention counters, protected by lk_spinlock, and is on a global
+ * list so they can be reported by lock_dumpstats().
  */
 struct lock {
         char *lk_name;
@@ -79,6 +91,13 @@ struct lock {
         struct spinlock lk_spinlock;
         struct thread *lk_holder;
         volatile bool locked;
+
+        unsigned lk_acquires;           /* Successful acquisitions */
+        unsigned lk_contended;          /* ...that found the lock held */
+        uint64_t lk_spins;              /* Spin iterations waiting */
+        uint64_t lk_sleepusec;          /* Time spent asleep waiting */
+        struct lock *lk_prev;           /* Link on list of all locks */
+        struct lock *lk_next;
 };
 
 struct lock *lock_create(const char *name);
@@ -88,6 +107,8 @@ void lock_destroy(struct lock *);
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if it is free without blocking.
+ *                   Returns true if the lock was acquired.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -96,9 +117,17 @@ void lock_destroy(struct lock *);
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Print contention totals and the most contended locks; clear all
+ * lock contention counters.
+ */
+void lock_dumpstats(void);
+void lock_resetstats(void);
+
 
 /*
  * Condition variable.
@@ -148,15 +177,36 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock state is a reader count and a writer pointer protected by
+ * one spinlock, with separate wait channels for readers and writers,
+ * so an uncontended acquire or release is a single spinlock section.
+ *
+ * Fairness is set per lock. With RW_PREFER_WRITERS (the default), new
+ * readers wait behind a waiting writer, so readers cannot starve
+ * writers. With RW_PREFER_READERS, readers are admitted whenever no
+ * writer holds the lock. Either way, a releasing writer hands the lock
+ * to every reader waiting at that moment before the next writer, so
+ * writers cannot starve readers.
  */
 
+typedef enum {
+        RW_PREFER_WRITERS,
+        RW_PREFER_READERS,
+} rwpref_t;
+
 struct rwlock {
         char *rwlock_name;
-        volatile unsigned readers;
-        volatile unsigned writers;
-        struct lock *state_lock;
-        struct semaphore *read_entry_sem;
-        struct semaphore *write_sem;
+        struct spinlock rw_spinlock;
+        struct wchan *rw_readwchan;     /* Readers waiting */
+        struct wchan *rw_writewchan;    /* Writers waiting */
+        unsigned rw_readers;            /* Readers holding the lock */
+        struct thread *rw_writer;       /* Writer holding the lock */
+        unsigned rw_readwaiting;        /* # threads on rw_readwchan */
+        unsigned rw_writewaiting;       /* # threads on rw_writewchan */
+        unsigned rw_readpass;           /* Readers handed the lock */
+        unsigned rw_readgen;            /* Bumped when passes are handed out */
+        rwpref_t rw_pref;               /* Fairness policy */
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -170,10 +220,13 @@ void rwlock_destroy(struct rwlock *);
  *    rwlock_acquire_write - Get the lock for writing. Only one thread can
  *                           hold the write lock at one time.
  *    rwlock_release_write - Free the write lock.
+ *    rwlock_setpref       - Choose the fairness policy. Only call this
+ *                           while nobody is using the lock.
  *
  * These operations must be atomic. You get to write them.
  */
 
+void rwlock_setpref(struct rwlock *, rwpref_t);
 void rwlock_acquire_read(struct rwlock *);
 void rwlock_release_read(struct rwlock *);
 void rwlock_acquire_write(struct rwlock *);
@@ -78,6 +78,7 @@ int rwtest4(int, char **);
 int rwtest5(int, char **);
 int rwtest6(int, char **);
 int rwtest7(int, char **);
+int rwtest8(int, char **);
 
 /* process tests */
 int proctest1(int, char **);
@@ -131,6 +132,7 @@ int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
 int addrspacetest1(int, char **);
 int addrspacetest2(int, char **);
 int addrspacetest3(int, char **);
@@ -142,6 +144,7 @@ int addrspacetest8(int, char **);
 int addrspacetest9(int, char **);
 int addrspacetest10(int, char **);
 int addrspacetest11(int, char **);
+int addrspacetest12(int, char **);
 int nettest(int, char **);
 int vmtest1(int, char **);
 int vmtest2(int, char **);
@@ -153,6 +156,8 @@ int vmtest7(int, char **);
 int vmtest8(int, char **);
 int vmtest9(int, char **);
 int vmtest10(int, char **);
+int vmtest11(int, char **);
+int vmtest12(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
@@ -237,6 +242,6 @@ static inline void silent(const char * fmt, ...) { (void)fmt; };
 /*
  * Address space helpers.
  */
-struct pte *create_test_page(struct addrspace *as, vaddr_t vaddr);
+pte_t *create_test_page(struct addrspace *as, vaddr_t vaddr);
 
 #endif /* _TEST_H_ */
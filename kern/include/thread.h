@@ -114,6 +114,19 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler state (see schedule() in thread.c).
+	 *
+	 * t_priority is the feedback queue level, 0 being the most
+	 * favored. t_quantum_used counts schedule() periods charged
+	 * at the current level; t_waited counts periods spent ready
+	 * but not running, and drives aging.
+	 */
+	unsigned t_priority;		/* MLFQ level, 0..SCHED_LEVELS-1 */
+	unsigned t_quantum_used;	/* Periods charged at this level */
+	unsigned t_waited;		/* Periods spent waiting to run */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+
 	/*
 	 * Public fields
 	 */
@@ -178,13 +191,36 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Multilevel feedback queue parameters. Levels run from 0 (highest
+ * priority) to SCHED_LEVELS-1. The quantum at level L is
+ * SCHED_QUANTUM(L) schedule() periods; a thread that uses it all is
+ * demoted one level. A ready thread that has waited SCHED_AGE_PERIODS
+ * periods without running is promoted one level.
+ */
+#define SCHED_LEVELS		4
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_AGE_PERIODS	8
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
+ * Work stealing. An idle CPU takes a ready thread from the busiest
+ * run queue before going idle. A thread that has run on its CPU
+ * within STEAL_HOT_HARDCLOCKS is considered cache-hot and is left
+ * alone unless that run queue holds at least STEAL_HOT_OVERRIDE
+ * threads. Busy CPUs also rebalance periodically, stealing when the
+ * busiest queue exceeds their own by STEAL_IMBALANCE.
+ */
+#define STEAL_HOT_HARDCLOCKS	2
+#define STEAL_HOT_OVERRIDE	4
+#define STEAL_IMBALANCE		2
+
+/*
+ * Potentially pull ready threads from busier CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
@@ -48,16 +48,28 @@
 
 // Bit masks for core_page status.
 #define VM_CORE_USED 0x10000  // Page is allocated and in use.
-#define VM_CORE_ACCESSED 0x20000  // Page has been accessed since last eviction sweep.
+#define VM_CORE_TEXT 0x20000  // Page is in the text page cache (see vm.c).
 #define VM_CORE_DIRTY 0x40000  // Page in memory differs from page on disk.
+#define VM_CORE_SHARED 0x80000  // Page has been shared copy-on-write, so as may
+                                // not be the (only) address space mapping it.
+#define VM_CORE_BUSY 0x100000  // Page is being paged in, cleaned or evicted.
 #define VM_CORE_NPAGES 0xffff  // Mask for number of contiguous pages in this allocation
-                            // starting at current index.
+                            // starting at current index.  Zero for pages
+                            // inside a block.
+#define VM_CORE_KHEAP 0x200000  // Kernel page carved into kmalloc subpage blocks.
+#define VM_CORE_KTAG_SHIFT 22   // Subpage block size index, if VM_CORE_KHEAP.
+#define VM_CORE_KTAG 0x1c00000
 
 struct core_page {
     uint32_t status;  // See bit masks above.
     vaddr_t vaddr;    // Virtual address where this page starts.
     struct addrspace *as;    // Pointer to address space this page belongs to.
-    unsigned prev;  // Index of previous block in coremap.
+    unsigned next;  // Free list links, if a free block head; 0 ends the list.
+    unsigned prev;
+    unsigned refs;  // Number of page table entries mapping this user page.
+    unsigned block;  // Swap block of a user page, if its ptes are BACKED.
+    volatile unsigned accessed;  // Page has been accessed since last eviction
+                                 // sweep.  Set without the coremap lock.
 };
 
 // Initializes physical memory map to enable kmalloc.
@@ -79,12 +91,23 @@ int block_write(unsigned block_index, paddr_t paddr);
 int block_read(unsigned block_index, paddr_t paddr);
 int get_page_via_table(struct addrspace *as, vaddr_t faultaddress);
 void free_swapmap_block(int block_index);
+void share_swapmap_block(int block_index);
 size_t swap_used_pages(void);
-int save_page(struct pte *pte, int dirty);
+
+// Kernel caches give back memory through these (see vm.c).
+typedef unsigned (*vm_reclaim_func)(unsigned npages);
+void vm_register_reclaim(vm_reclaim_func func);
+bool vm_memory_low(void);
+unsigned swap_extent_hint(void);
+void dump_swap_frag(void);
+int save_page(pte_t *pte, int dirty, unsigned refs);
+unsigned pte_block(pte_t pte);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 paddr_t locking_find_victim_page(void);
+unsigned locking_find_dirty_page(void);
+void set_coremap_hands(paddr_t paddr);
 int evict_page(unsigned *coremap_index);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
@@ -93,19 +116,29 @@ void free_kpages(vaddr_t vaddr);
 
 /* Allocate/free coremap pages */
 paddr_t alloc_pages(unsigned npages);
+// Zero a free page ahead of time; called from the idle loop.
+bool vm_idle_zero_page(void);
 void free_pages(vaddr_t vaddr);
+void share_user_page(paddr_t paddr);
+void free_user_page(paddr_t paddr);
 void vm_tlb_erase(void);
+void vm_tlb_sweep(void);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_retire(struct addrspace *as, int keep_current_cpu);
 unsigned paddr_to_core_idx(paddr_t paddr);
 paddr_t core_idx_to_paddr(unsigned p);
 paddr_t coremap_assign_to_kernel(unsigned p, unsigned npages);
 unsigned coremap_assign_vaddr(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
 
+// Tag kernel heap pages with their kmalloc block size (see kmalloc.c).
+void coremap_set_ktag(vaddr_t kvaddr, unsigned tag);
+int coremap_get_ktag(vaddr_t kvaddr);
+
 struct addrspace *vm_get_as(paddr_t paddr);
+int vm_is_shared(paddr_t paddr);
 vaddr_t vm_get_vaddr(paddr_t paddr);
 void spinlock_acquire_coremap(void);
 void spinlock_release_coremap(void);
-void lock_acquire_evict(void);
-void lock_release_evict(void);
 
 /*
  * Return amount of memory (in bytes) used by allocated coremap pages.  If
@@ -120,10 +153,23 @@ void vm_tlbshootdown(const struct tlbshootdown *);
 #if OPT_VM_PERF
 void reset_vm_perf(void);
 void count_tlb_fault(void);
+void count_tlb_prefetch(void);
+void count_asid_rollover(void);
+void count_shootdown_ipis(unsigned n);
 void count_swap_in(void);
 void count_swap_out(void);
+void count_file_in(void);
+void count_file_drop(void);
+void count_text_hit(void);
 void count_fault(void);
 void count_eviction(void);
+void count_cow_fault(void);
+void count_clock_steps(unsigned steps);
+void count_tlb_sweep(void);
+void count_page_cleaned(void);
+void count_swap_request(void);
+void count_zero_hit(void);
+void count_zero_miss(void);
 void dump_vm_perf(void);
 #endif
 
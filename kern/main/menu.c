@@ -45,6 +45,7 @@
 #include <test.h>
 #include <prompt.h>
 #include <vm.h>
+#include <objcache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-synchprobs.h"
@@ -478,6 +479,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	objcache_printstats();
 
 	return 0;
 }
@@ -523,6 +525,54 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_devstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_devstats(false);
+
+	return 0;
+}
+
+static
+int
+cmd_reset_devstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_devstats(true);
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_dumpstats();
+
+	return 0;
+}
+
+static
+int
+cmd_reset_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_resetstats();
+
+	return 0;
+}
+
 #if OPT_VM_PERF
 static
 int
@@ -532,6 +582,7 @@ cmd_vmstats(int nargs, char **args)
 	(void)args;
 
 	dump_vm_perf();
+	dump_swap_frag();
 
 	return 0;
 }
@@ -616,6 +667,7 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[km6] Object cache test             ",
 	"[as1] addrspace create test         ",
 	"[as2] addrspace define region test  ",
 	"[as3] addrspace load test           ",
@@ -627,6 +679,7 @@ static const char *testmenu[] = {
 	"[as9] addrspace stress test         ",
 	"[as10] addrspace allocate all       ",
 	"[as11] addrspace copy               ",
+	"[as12] addrspace copy on write      ",
 	"[vm1] allocate/free descending      ",
 	"[vm2] allocate/free ascending       ",
 	"[vm3] allocate/free random sizes    ",
@@ -637,6 +690,8 @@ static const char *testmenu[] = {
 	"[vm8] select page for eviction      ",
 	"[vm9] evict a page                  ",
 	"[vm10] allocate more than phys mem  ",
+	"[vm11] concurrent fault stress      ",
+	"[vm12] coremap hands across merges  ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -666,6 +721,7 @@ static const char *testmenu[] = {
 	"[rwt5] RW lock test 5        (1?)   ",
 	"[rwt6] RW lock test 6        (1?)   ",
 	"[rwt7] RW lock test 7        (1?)   ",
+	"[rwt8] RW lock benchmark     (1?)   ",
 	"[fh1] file_handle test 1            ",
 	"[fh2] file_handle test 2            ",
 	"[fh3] file_handle test 3     (*)    ",
@@ -731,6 +787,10 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[dev] Device stats                  ",
+	"[devr] Reset device stats           ",
+	"[lk] Lock contention stats          ",
+	"[lkr] Reset lock contention stats   ",
 #if OPT_VM_PERF
     "[vm] Virtual memory stats           ",
 	"[vr] Reset virtual memory stats     ",
@@ -790,6 +850,10 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "dev",        cmd_devstats },
+	{ "devr",       cmd_reset_devstats },
+	{ "lk",         cmd_lockstats },
+	{ "lkr",        cmd_reset_lockstats },
 #if OPT_VM_PERF
     { "vm",         cmd_vmstats },
 	{ "vr",         cmd_reset_vmstats },
@@ -805,6 +869,7 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 
 	/* addrspace tests */
 	{"as1",     addrspacetest1 },
@@ -818,6 +883,7 @@ static struct {
 	{"as9",     addrspacetest9 },
 	{"as10",    addrspacetest10 },
 	{"as11",    addrspacetest11 },
+	{"as12",    addrspacetest12 },
 	{"vm1",     vmtest1 },
 	{"vm2",     vmtest2 },
 	{"vm3",     vmtest3 },
@@ -828,6 +894,8 @@ static struct {
 	{"vm8",     vmtest8 },
 	{"vm9",     vmtest9 },
 	{"vm10",    vmtest10 },
+	{"vm11",    vmtest11 },
+	{"vm12",    vmtest12 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -861,6 +929,7 @@ static struct {
 	{ "rwt5",	rwtest5 },
 	{ "rwt6",	rwtest6 },
 	{ "rwt7",	rwtest7 },
+	{ "rwt8",	rwtest8 },
 	{ "fh1",    fhtest1 },
 	{ "fh2",    fhtest2 },
 	{ "fh3",    fhtest3 },
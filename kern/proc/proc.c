@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <synch.h>
 #include <vnode.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -60,6 +61,41 @@ struct proc *kproc;
 static struct proc *proclist = NULL;
 static struct lock *proclist_lock;
 
+/*
+ * Proc structures come from proc_cache. A cached proc keeps the
+ * objects that live as long as the proc does (the waitpid lock and
+ * cv, and p_lock); the rest are made by proc_create.
+ */
+static struct objcache *proc_cache;
+
+static int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->waitpid_cv = cv_create("waitpid");
+	if (proc->waitpid_cv == NULL) {
+		return ENOMEM;
+	}
+	proc->waitpid_lock = lock_create("waitpid");
+	if (proc->waitpid_lock == NULL) {
+		cv_destroy(proc->waitpid_cv);
+		return ENOMEM;
+	}
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	lock_destroy(proc->waitpid_lock);
+	cv_destroy(proc->waitpid_cv);
+}
+
 static void
 proc_abort(struct proc *proc)
 {
@@ -69,19 +105,13 @@ proc_abort(struct proc *proc)
 	if (proc->p_cwd_lock) {
 		lock_destroy(proc->p_cwd_lock);
 	}
-	if (proc->waitpid_lock) {
-		lock_destroy(proc->waitpid_lock);
-	}
-	if (proc->waitpid_cv) {
-		cv_destroy(proc->waitpid_cv);
-	}
 	if (proc->files_lock) {
 		lock_destroy(proc->files_lock);
 	}
 	if (proc->p_name) {
 		kfree(proc->p_name);
 	}
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 }
 
 /*
@@ -95,7 +125,7 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(struct proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
@@ -107,8 +137,6 @@ proc_create(const char *name)
 	proc->p_name = NULL;
 	proc->p_cwd = NULL;
 	proc->p_cwd_lock = NULL;
-	proc->waitpid_lock = NULL;
-	proc->waitpid_cv = NULL;
 	proc->p_addrspace = NULL;
 	proc->files_lock = NULL;
 	proc->next = NULL;
@@ -121,16 +149,6 @@ proc_create(const char *name)
 		proc_abort(proc);
 		return NULL;
 	}
-	proc->waitpid_cv = cv_create("waitpid");
-	if (proc->waitpid_cv == NULL) {
-		proc_abort(proc);
-		return NULL;
-	}
-	proc->waitpid_lock = lock_create("waitpid");
-	if (proc->waitpid_lock == NULL) {
-		proc_abort(proc);
-		return NULL;
-	}
 	proc->p_cwd_lock = lock_create("p_cwd");
 	if (proc->p_cwd_lock == NULL) {
 		proc_abort(proc);
@@ -141,7 +159,6 @@ proc_create(const char *name)
 		proc_abort(proc);
 		return NULL;
 	}
-	spinlock_init(&proc->p_lock);
 
 	return proc;
 }
@@ -252,17 +269,10 @@ proc_destroy(struct proc *proc)
 	// In case proc did not exit on its own, we may need to
 	// de-allocate proc member data structures.
     proc_pre_zombie(proc);
-	if (proc->waitpid_lock) {
-        lock_destroy(proc->waitpid_lock);
-	}
-	if (proc->waitpid_cv) {
-        cv_destroy(proc->waitpid_cv);
-	}
 	if (proc->p_name) {
 		kfree(proc->p_name);
 	}
-	spinlock_cleanup(&proc->p_lock);
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 }
 
 /*
@@ -271,6 +281,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = objcache_create("proc", sizeof(struct proc),
+				     proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
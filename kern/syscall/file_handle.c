@@ -9,7 +9,43 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <objcache.h>
 
+// File handles come from fh_cache. A cached handle keeps its lock.
+static struct objcache *fh_cache;
+
+static int
+file_handle_ctor(void *obj)
+{
+    struct file_handle *fh = obj;
+
+    fh->file_lock = lock_create("file_handle");
+    if (fh->file_lock == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static void
+file_handle_dtor(void *obj)
+{
+    struct file_handle *fh = obj;
+
+    lock_destroy(fh->file_lock);
+}
+
+/*
+ * Set up the file_handle cache. Called once during boot.
+ */
+void
+file_handle_bootstrap(void)
+{
+    fh_cache = objcache_create("file_handle", sizeof(struct file_handle),
+                               file_handle_ctor, file_handle_dtor);
+    if (fh_cache == NULL) {
+        panic("file_handle_bootstrap: Out of memory\n");
+    }
+}
 
 /*
  * Create (allocate) a new file_handle in kernel address space.
@@ -27,23 +63,17 @@ struct file_handle
 
     KASSERT(name != NULL);
 
-    fh = kmalloc(sizeof(struct file_handle));
+    fh = objcache_alloc(fh_cache);
     if (fh == NULL) {
         return NULL;
     }
     fh->name = kstrdup(name);
     if (fh->name == NULL) {
-        kfree(fh);
+        objcache_free(fh_cache, fh);
         return NULL;
     }
     fh->offset = 0;
     fh->vn = NULL;
-    fh->file_lock = lock_create(name);
-    if (fh->file_lock == NULL) {
-        kfree(fh->name);
-        kfree(fh);
-        return NULL;
-    }
     fh->ref_count = 0;
     fh->flags = 0x0;
     return fh;
@@ -59,9 +89,9 @@ void
 destroy_file_handle(struct file_handle *fh)
 {
     KASSERT(fh != NULL);
+    KASSERT(!lock_do_i_hold(fh->file_lock));
     kfree(fh->name);
-    lock_destroy(fh->file_lock);
-    kfree(fh);
+    objcache_free(fh_cache, fh);
 }
 
 /*
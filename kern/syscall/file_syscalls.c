@@ -18,6 +18,12 @@
 #include <kern/seek.h>
 #include <stat.h>
 #include <vfs.h>
+#include <vm.h>
+
+// read() and write() move data through a kernel buffer of at most this
+// many bytes at a time, so large transfers need only a bounded amount
+// of kernel memory.
+#define FILE_IO_CHUNK PAGE_SIZE
 
 /*
  * Checks if file descriptor is in valid range.
@@ -34,6 +40,88 @@ fd_is_legal(int fd)
     return (fd >= 0) && (fd < FILES_PER_PROCESS_MAX);
 }
 
+/*
+ * Moves data between a user buffer and the file at fh->offset through
+ * a kernel bounce buffer, FILE_IO_CHUNK bytes at a time, and advances
+ * the offset past the bytes moved.
+ *
+ * User memory is only touched by copyin/copyout between VOP calls.  A
+ * fault on the user buffer may read from swap or from an executable
+ * (see as_load_page) and so take vnode locks, which must never happen
+ * while the filesystem holds a vnode's sv_lock or a busy buffer.
+ * Holding the file handle lock across faults is fine since the fault
+ * path never takes one.
+ *
+ * Caller is responsible for locking fh.
+ *
+ * Args:
+ *   fh: File handle to read or write.
+ *   buf: Pointer to start of userspace byte buffer.
+ *   buflen: Number of bytes to move.
+ *   rw: UIO_READ or UIO_WRITE.
+ *   moved: Pointer to return number of bytes moved.
+ *
+ * Returns:
+ *   0 if any bytes were moved or buflen is 0, else errno value.
+ */
+static int
+file_io(struct file_handle *fh, userptr_t buf, size_t buflen,
+        enum uio_rw rw, size_t *moved)
+{
+    struct iovec iov;
+    struct uio ku;
+    char *kbuf;
+    size_t chunk;
+    size_t n;
+    int result = 0;
+
+    *moved = 0;
+    if (buflen == 0) {
+        return 0;
+    }
+    kbuf = kmalloc(buflen < FILE_IO_CHUNK ? buflen : FILE_IO_CHUNK);
+    if (kbuf == NULL) {
+        return ENOMEM;
+    }
+    while (*moved < buflen) {
+        chunk = buflen - *moved;
+        if (chunk > FILE_IO_CHUNK) {
+            chunk = FILE_IO_CHUNK;
+        }
+        if (rw == UIO_WRITE) {
+            result = copyin((const_userptr_t)((vaddr_t)buf + *moved),
+                            kbuf, chunk);
+            if (result) {
+                break;
+            }
+        }
+        uio_kinit(&iov, &ku, kbuf, chunk, fh->offset, rw);
+        if (rw == UIO_READ) {
+            result = VOP_READ(fh->vn, &ku);
+        } else {
+            result = VOP_WRITE(fh->vn, &ku);
+        }
+        if (result) {
+            break;
+        }
+        n = chunk - ku.uio_resid;
+        if (rw == UIO_READ) {
+            result = copyout(kbuf, (userptr_t)((vaddr_t)buf + *moved), n);
+            if (result) {
+                break;
+            }
+        }
+        fh->offset += n;
+        *moved += n;
+        if (n < chunk) {
+            // End of file, or a device gave us what it had.
+            break;
+        }
+    }
+    kfree(kbuf);
+    return (*moved > 0) ? 0 : result;
+}
+
 /*
  * Write to a file descriptor.
  *
@@ -51,9 +139,6 @@ fd_is_legal(int fd)
 int 
 sys_write(int fd, const userptr_t buf, size_t buflen, size_t *bytes_out)
 {
-    struct iovec iov;
-    struct uio my_uio;
-    char *kbuf;
     struct file_handle *fh;
     int result;
     int access;
@@ -70,33 +155,15 @@ sys_write(int fd, const userptr_t buf, size_t buflen, size_t *bytes_out)
     if (fh == NULL) {
         return EBADF;
     }
-    kbuf = (char *)kmalloc(buflen);
-    if (kbuf == NULL) {
-        return ENOMEM;
-    }
-    result = copyin(buf, kbuf, buflen);
-    if (result) {
-        kfree(kbuf);
-        return result;
-    }
     lock_file_handle(fh);
     access = fh->flags & O_ACCMODE;
     if (access == O_RDONLY) {
-        kfree(kbuf);
         release_file_handle(fh);
         return EBADF;
     }
-    uio_kinit(&iov, &my_uio, kbuf, buflen, fh->offset, UIO_WRITE);
-    result = VOP_WRITE(fh->vn, &my_uio);
-    kfree(kbuf);
-    if (result) {
-        release_file_handle(fh);
-        return result;
-    }
-    *bytes_out = buflen - my_uio.uio_resid;
-    fh->offset += *bytes_out;
+    result = file_io(fh, buf, buflen, UIO_WRITE, bytes_out);
     release_file_handle(fh);
-    return 0;
+    return result;
 }
 
 /*
@@ -116,9 +183,6 @@ sys_write(int fd, const userptr_t buf, size_t buflen, size_t *bytes_out)
 int 
 sys_read(int fd, userptr_t buf, size_t buflen, size_t *bytes_in)
 {
-    struct iovec iov;
-    struct uio my_uio;
-    char *kbuf;
     struct file_handle *fh;
     int result;
     int access;
@@ -137,36 +201,15 @@ sys_read(int fd, userptr_t buf, size_t buflen, size_t *bytes_in)
     if (fh == NULL) {
         return EBADF;
     }
-    kbuf = (char *)kmalloc(buflen);
-    if (kbuf == NULL) {
-        return ENOMEM;
-    }
-    
     lock_file_handle(fh);
     access = fh->flags & O_ACCMODE;
     if (access == O_WRONLY) {
-        kfree(kbuf);
         release_file_handle(fh);
         return EBADF;
     }
-    uio_kinit(&iov, &my_uio, kbuf, buflen, fh->offset, UIO_READ);
-    result = VOP_READ(fh->vn, &my_uio);
-    if (result) {
-        kfree(kbuf);
-        release_file_handle(fh);
-        return result;
-    }
-    result = copyout(kbuf, buf, buflen);
-    kfree(kbuf);
-    if (result) {
-        release_file_handle(fh);
-        return result;
-    }
-    *bytes_in = buflen - my_uio.uio_resid;
-    fh->offset += *bytes_in;
+    result = file_io(fh, buf, buflen, UIO_READ, bytes_in);
     release_file_handle(fh);
-
-    return 0;
+    return result;
 }
 
 /*
@@ -424,6 +467,11 @@ sys___getcwd(userptr_t buf, size_t buflen, size_t *bytes_in)
     int result;
 
     KASSERT(bytes_in != NULL);
+    // vfs_getcwd holds vnode locks, so read into a kernel buffer and
+    // copy out after (see file_io).  No path is longer than PATH_MAX.
+    if (buflen > PATH_MAX) {
+        buflen = PATH_MAX;
+    }
     kbuf = (char *)kmalloc(buflen);
     if (kbuf == NULL) {
         return ENOMEM;
@@ -434,7 +482,7 @@ sys___getcwd(userptr_t buf, size_t buflen, size_t *bytes_in)
         kfree(kbuf);
         return result;
     }
-    result = copyout(kbuf, buf, buflen);
+    result = copyout(kbuf, buf, my_uio.uio_offset);
     kfree(kbuf);
     if (result) {
         return result;
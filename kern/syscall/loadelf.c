@@ -42,8 +42,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Except under dumbvm, "loading" a chunk only maps it to the
+ * executable, and its pages are read in as the program touches them.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -59,7 +59,11 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <stat.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +148,56 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#else
+/*
+ * Map a segment at virtual address VADDR to the executable V. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE, and its first FILESIZE bytes come from file offset
+ * OFFSET. The rest is zero-filled.
+ *
+ * Nothing is read here: each page is read from the file when the
+ * program first touches it (see as_load_page), so exec costs what
+ * the program uses rather than the size of the executable. Since we
+ * no longer go through uiomove, check for a load address in kernel
+ * space, and for a truncated file, explicitly.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	struct stat st;
+	int result;
+
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		kprintf("ELF: segment not in user space\n");
+		return ENOEXEC;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, v, offset, vaddr, filesize);
+}
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -58,6 +58,10 @@ int sys_sbrk(intptr_t amount, void **mem)
 	for (vaddr = (vaddr_t)newheaptop; vaddr < as->vheaptop; vaddr += PAGE_SIZE) {
 		as_destroy_page(as, vaddr);
 	}
+	// Stale entries for the freed pages may be in any cpu's TLB,
+	// including shared pages we only dropped a reference to.
+	vm_tlb_retire(as, 0);
+	as_activate();
 	as->vheaptop = (vaddr_t)newheaptop;
 	lock_release(as->heap_lock);
 	return 0;
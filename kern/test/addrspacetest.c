@@ -26,11 +26,11 @@
  * Returns:
  *   Pointer to page table entry, else NULL if unsuccessful.
  */
-struct pte 
+pte_t
 *create_test_page(struct addrspace *as, vaddr_t vaddr)
 {
     paddr_t paddr;
-	struct pte *pte;
+	pte_t *pte;
 	
 	vaddr &= PAGE_FRAME;
 	// Must be a user space virtual address.
@@ -43,7 +43,7 @@ struct pte
         return NULL;
     }
 	// Page must not already exist.
-	KASSERT((pte->status == 0) && (pte->paddr == (paddr_t)NULL));	
+	KASSERT(*pte == 0);
     lock_release(as->pages_lock);
 
     paddr = alloc_pages(1);
@@ -53,8 +53,7 @@ struct pte
     lock_acquire(as->pages_lock);
     spinlock_acquire_coremap();
     coremap_assign_vaddr(paddr, as, vaddr);
-    pte->paddr = paddr;
-	pte->status = VM_PTE_VALID;
+	*pte = paddr | VM_PTE_VALID;
 	lock_release(as->pages_lock);
     spinlock_release_coremap();
 
@@ -230,7 +229,7 @@ addrspacetest7(int nargs, char **args)
     (void)nargs;
     (void)args;
     struct addrspace *as;
-    struct pte *pte0, *pte1;
+    pte_t *pte0, *pte1;
 
     kprintf("Starting as7 test...\n");
     as = as_create();
@@ -266,17 +265,15 @@ addrspacetest7(int nargs, char **args)
     pte0 = create_test_page(as, 0x7f000000);
     KASSERT(pte0 != NULL);
 
-    // Tests level0 table has correct empty/non-empty entries.
+    // Tests directory has correct empty/non-empty entries.
     dump_page_table(as);
-    KASSERT(as->pages0[0] != NULL);
-    KASSERT(as->pages0[1] == NULL);
-    KASSERT(as->pages0[2] == NULL);
-    KASSERT(as->pages0[3] == NULL);
-    KASSERT(as->pages0[4] == NULL);
-    KASSERT(as->pages0[5] == NULL);
-    KASSERT(as->pages0[8] == NULL);
-    KASSERT(as->pages0[15] != NULL);
-    KASSERT(as->pages0[31] == NULL);
+    KASSERT(as->pt_dir[0] != NULL);
+    KASSERT(as->pt_dir[1] == NULL);
+    KASSERT(as->pt_dir[2] == NULL);
+    KASSERT(as->pt_dir[PT_DIR_INDEX(0x07c00000)] != NULL);
+    KASSERT(as->pt_dir[PT_DIR_INDEX(0x07c00000) + 1] == NULL);
+    KASSERT(as->pt_dir[PT_DIR_INDEX(0x7f000000)] != NULL);
+    KASSERT(as->pt_dir[PT_ENTRIES - 1] == NULL);
     as_destroy(as);
 	success(TEST161_SUCCESS, SECRET, "as7");
 
@@ -290,7 +287,7 @@ addrspacetest8(int nargs, char **args)
     (void)nargs;
     (void)args;
     struct addrspace *as;
-    struct pte *pte0;
+    pte_t *pte0;
 
     kprintf("Starting as8 test...\n");
     as = as_create();
@@ -314,7 +311,7 @@ create_and_free(struct addrspace *as)
     unsigned n1_create_pages;
     unsigned n2_create_pages;
     unsigned i, k;
-    struct pte *pte;
+    pte_t *pte;
     unsigned offset;
     unsigned stride;
 
@@ -381,7 +378,7 @@ addrspacetest10(int nargs, char **args)
     (void)nargs;
     (void)args;
     struct addrspace *as;
-    struct pte *pte;
+    pte_t *pte;
     int i;
     int old_swap_enabled;
 
@@ -423,7 +420,7 @@ addrspacetest11(int nargs, char **args)
     (void)nargs;
     (void)args;
     struct addrspace *src, *dst;
-    struct pte *src_pte, *dst_pte;
+    pte_t *src_pte, *dst_pte;
     vaddr_t vaddr;
     int i;
     int result;
@@ -492,3 +489,93 @@ addrspacetest11(int nargs, char **args)
 	success(TEST161_SUCCESS, SECRET, "as11");
 	return 0;
 }
+
+// Copy addrspace and check pages are shared copy on write.
+int
+addrspacetest12(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+    struct addrspace *src, *dst;
+    pte_t *src_pte, *dst_pte;
+    vaddr_t vaddr;
+    vaddr_t kvaddr;
+    int i;
+    unsigned j;
+    int result;
+	size_t swap0, swap1;
+	size_t mem0, mem1;
+	const int test_pages = 64;
+
+    kprintf("Starting as12 test...\n");
+
+	mem0 = coremap_used_bytes();
+	swap0 = swap_used_pages();
+
+    src = as_create();
+    KASSERT(src != NULL);
+
+    kprintf("Create pages\n");
+    for (i = 0; i < test_pages; i++) {
+        vaddr = i * PAGE_SIZE;
+        src_pte = create_test_page(src, vaddr);
+        KASSERT(src_pte != NULL);
+        kvaddr = PADDR_TO_KVADDR(PTE_PADDR(*src_pte));
+        for (j = 0; j < PAGE_SIZE; j++) {
+            *(unsigned char *)(kvaddr + j) = (i + j) % 256;
+        }
+    }
+
+    result = as_copy(src, &dst);
+    KASSERT(result == 0);
+
+    // Copy must reference the same physical pages and swap blocks.
+    kprintf("Check page tables\n");
+    lock_acquire(src->pages_lock);
+    lock_acquire(dst->pages_lock);
+    for (i = 0; i < test_pages; i++) {
+        vaddr = i * PAGE_SIZE;
+        src_pte = as_lookup_pte(src, vaddr);
+        KASSERT(src_pte != NULL);
+        dst_pte = as_lookup_pte(dst, vaddr);
+        KASSERT(dst_pte != NULL);
+        KASSERT(*src_pte == *dst_pte);
+        if (*src_pte & VM_PTE_VALID) {
+            spinlock_acquire_coremap();
+            KASSERT(vm_is_shared(PTE_PADDR(*src_pte)));
+            spinlock_release_coremap();
+        }
+        if (*src_pte & VM_PTE_BACKED) {
+            KASSERT(pte_block(*src_pte) == pte_block(*dst_pte));
+        }
+    }
+    lock_release(dst->pages_lock);
+    lock_release(src->pages_lock);
+
+    // Pages must outlive the address space they were copied from.
+    as_destroy(src);
+    kprintf("Check contents\n");
+    for (i = 0; i < test_pages; i++) {
+        vaddr = i * PAGE_SIZE;
+        lock_acquire(dst->pages_lock);
+        dst_pte = as_lookup_pte(dst, vaddr);
+        KASSERT(dst_pte != NULL);
+        if (*dst_pte & VM_PTE_VALID) {
+            kvaddr = PADDR_TO_KVADDR(PTE_PADDR(*dst_pte));
+            for (j = 0; j < PAGE_SIZE; j++) {
+                KASSERT(*(unsigned char *)(kvaddr + j) == (i + j) % 256);
+            }
+        }
+        lock_release(dst->pages_lock);
+    }
+    as_destroy(dst);
+
+	// Verify memory and swap have been cleaned up.
+	mem1 = coremap_used_bytes();
+	swap1 = swap_used_pages();
+	KASSERT(swap0 == swap1);
+	KASSERT(mem0 == mem1);
+
+	success(TEST161_SUCCESS, SECRET, "as12");
+	return 0;
+}
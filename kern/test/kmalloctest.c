@@ -37,6 +37,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <objcache.h>
 #include <test.h>
 #include <kern/test161.h>
 #include <mainbus.h>
@@ -608,3 +609,126 @@ kmalloctest5(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km6
+
+#define KM6_MAGIC 0xca5edbad
+#define KM6_OBJS 200
+
+struct km6obj {
+	uint32_t magic;
+	char pad[44];
+};
+
+static unsigned km6_ctors, km6_dtors;
+
+static
+int
+km6_ctor(void *obj)
+{
+	struct km6obj *o = obj;
+
+	o->magic = KM6_MAGIC;
+	km6_ctors++;
+	return 0;
+}
+
+static
+void
+km6_dtor(void *obj)
+{
+	struct km6obj *o = obj;
+
+	KASSERT(o->magic == KM6_MAGIC);
+	o->magic = 0;
+	km6_dtors++;
+}
+
+/*
+ * Object cache test. Objects must come back constructed, objects
+ * freed into partly used slabs must be reused without running the
+ * constructor again, and destroying the cache must destruct
+ * everything it built and return its pages.
+ */
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct objcache *oc;
+	struct km6obj *objs[KM6_OBJS];
+	unsigned orig_used, used, ctors;
+	unsigned i, j, round;
+	struct km6obj *obj;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	km6_ctors = km6_dtors = 0;
+	orig_used = coremap_used_bytes();
+
+	oc = objcache_create("km6", sizeof(struct km6obj), km6_ctor, km6_dtor);
+	if (oc == NULL) {
+		panic("km6: objcache_create failed\n");
+	}
+
+	for (i = 0; i < KM6_OBJS; i++) {
+		objs[i] = objcache_alloc(oc);
+		if (objs[i] == NULL) {
+			panic("km6: objcache_alloc failed\n");
+		}
+		for (j = 0; j < i; j++) {
+			if (objs[j] == objs[i]) {
+				panic("km6: duplicate object %p\n", objs[i]);
+			}
+		}
+	}
+	ctors = km6_ctors;
+
+	// Every other slot goes back and comes out again; no slab
+	// empties, so nothing new may be constructed.
+	for (round = 0; round < 4; round++) {
+		for (i = round % 2; i < KM6_OBJS; i += 2) {
+			obj = objs[i];
+			if (obj->magic != KM6_MAGIC) {
+				panic("km6: object %p damaged\n", obj);
+			}
+			objcache_free(oc, obj);
+		}
+		for (i = round % 2; i < KM6_OBJS; i += 2) {
+			objs[i] = objcache_alloc(oc);
+			if (objs[i] == NULL) {
+				panic("km6: objcache_alloc failed\n");
+			}
+			if (objs[i]->magic != KM6_MAGIC) {
+				panic("km6: object %p not constructed\n",
+				      objs[i]);
+			}
+		}
+		if (km6_ctors != ctors) {
+			panic("km6: constructor ran on reuse (%u, then %u)\n",
+			      ctors, km6_ctors);
+		}
+		kprintf(".");
+	}
+
+	for (i = 0; i < KM6_OBJS; i++) {
+		objcache_free(oc, objs[i]);
+	}
+
+	objcache_destroy(oc);
+	if (km6_dtors != km6_ctors) {
+		panic("km6: %u objects constructed but %u destructed\n",
+		      km6_ctors, km6_dtors);
+	}
+
+	used = coremap_used_bytes();
+	if (used != orig_used) {
+		panic("km6: orig (%u) != used (%u)\n", orig_used, used);
+	}
+
+	kprintf("\n");
+	success(TEST161_SUCCESS, SECRET, "km6");
+	return 0;
+}
@@ -452,3 +452,190 @@ int rwtest7(int nargs, char **args) {
 }
 
 
+
+/*
+ * Throughput benchmark.
+ *
+ * For comparison, semrw is the previous rwlock design: a state lock
+ * plus an entry semaphore and a write semaphore, so each read acquire
+ * is two P/V pairs and a lock acquire/release.
+ */
+struct semrw {
+    struct lock *state_lock;
+    struct semaphore *read_entry_sem;
+    struct semaphore *write_sem;
+    unsigned readers;
+};
+
+static struct semrw *benchsemrw;
+static struct semaphore *bench_done;
+
+#define BENCH_THREADS   8
+#define BENCH_OPS       2000
+#define BENCH_WRITE_1IN 16
+
+static
+struct semrw *
+semrw_create(void)
+{
+    struct semrw *rw;
+
+    rw = kmalloc(sizeof(*rw));
+    KASSERT(rw != NULL);
+    rw->state_lock = lock_create("semrw_state");
+    rw->read_entry_sem = sem_create("semrw_entry", 1);
+    rw->write_sem = sem_create("semrw_write", 1);
+    KASSERT(rw->state_lock != NULL);
+    KASSERT(rw->read_entry_sem != NULL);
+    KASSERT(rw->write_sem != NULL);
+    rw->readers = 0;
+    return rw;
+}
+
+static
+void
+semrw_destroy(struct semrw *rw)
+{
+    sem_destroy(rw->write_sem);
+    sem_destroy(rw->read_entry_sem);
+    lock_destroy(rw->state_lock);
+    kfree(rw);
+}
+
+static
+void
+semrw_acquire_read(struct semrw *rw)
+{
+    P(rw->read_entry_sem);
+    lock_acquire(rw->state_lock);
+    if (++rw->readers == 1) {
+        P(rw->write_sem);
+    }
+    lock_release(rw->state_lock);
+    V(rw->read_entry_sem);
+}
+
+static
+void
+semrw_release_read(struct semrw *rw)
+{
+    lock_acquire(rw->state_lock);
+    if (--rw->readers == 0) {
+        V(rw->write_sem);
+    }
+    lock_release(rw->state_lock);
+}
+
+static
+void
+semrw_acquire_write(struct semrw *rw)
+{
+    P(rw->read_entry_sem);
+    P(rw->write_sem);
+}
+
+static
+void
+semrw_release_write(struct semrw *rw)
+{
+    V(rw->read_entry_sem);
+    V(rw->write_sem);
+}
+
+// Mostly reads with a write every BENCH_WRITE_1IN operations;
+// use_semrw selects the old design.
+static
+void
+bench_thread(void *unused, unsigned long use_semrw)
+{
+    (void)unused;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        bool write = (i % BENCH_WRITE_1IN) == 0;
+        if (use_semrw) {
+            if (write) {
+                semrw_acquire_write(benchsemrw);
+                shared_value++;
+                semrw_release_write(benchsemrw);
+            } else {
+                semrw_acquire_read(benchsemrw);
+                failif(shared_value == (unsigned long)-1);
+                semrw_release_read(benchsemrw);
+            }
+        } else {
+            if (write) {
+                rwlock_acquire_write(testrwlock);
+                shared_value++;
+                rwlock_release_write(testrwlock);
+            } else {
+                rwlock_acquire_read(testrwlock);
+                failif(shared_value == (unsigned long)-1);
+                rwlock_release_read(testrwlock);
+            }
+        }
+    }
+    V(bench_done);
+}
+
+static
+void
+bench_run(const char *name, unsigned long use_semrw)
+{
+    struct timespec start, end, duration;
+    unsigned msecs;
+    int result;
+
+    shared_value = 0;
+    gettime(&start);
+    for (int i = 0; i < BENCH_THREADS; i++) {
+        result = thread_fork("rwbench", NULL, bench_thread, NULL, use_semrw);
+        if (result) {
+            panic("rwt8: thread_fork failed: %s\n", strerror(result));
+        }
+    }
+    for (int i = 0; i < BENCH_THREADS; i++) {
+        P(bench_done);
+    }
+    gettime(&end);
+    timespec_sub(&end, &start, &duration);
+    msecs = duration.tv_sec * 1000 + duration.tv_nsec / 1000000;
+
+    failif(shared_value !=
+        BENCH_THREADS * DIVROUNDUP(BENCH_OPS, BENCH_WRITE_1IN));
+    kprintf_n("%s: %u ops in %u ms, %u ops/s\n", name,
+        BENCH_THREADS * BENCH_OPS, msecs,
+        msecs ? BENCH_THREADS * BENCH_OPS * 1000 / msecs : 0);
+}
+
+// Compares throughput of the old semaphore-based rwlock design with
+// the spinlock/wchan rwlock, under both fairness policies.
+int rwtest8(int nargs, char **args) {
+    (void)nargs;
+    (void)args;
+
+    kprintf_n("Starting rwt8...\n");
+
+    test_status = TEST161_SUCCESS;
+    spinlock_init(&status_lock);  // supports failif().
+    bench_done = sem_create("bench_done", 0);
+    KASSERT(bench_done != NULL);
+
+    benchsemrw = semrw_create();
+    bench_run("semaphore rwlock", 1);
+    semrw_destroy(benchsemrw);
+    benchsemrw = NULL;
+
+    testrwlock = rwlock_create("testrwlock");
+    KASSERT(testrwlock != NULL);
+    bench_run("rwlock, writers first", 0);
+    rwlock_setpref(testrwlock, RW_PREFER_READERS);
+    bench_run("rwlock, readers first", 0);
+    rwlock_destroy(testrwlock);
+    testrwlock = NULL;
+
+    // Threads can veto via test_status global.
+    success(test_status, SECRET, "rwt8");
+    sem_destroy(bench_done);
+    bench_done = NULL;
+    spinlock_cleanup(&status_lock);
+    return 0;
+}
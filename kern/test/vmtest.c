@@ -9,6 +9,10 @@
 #include <kern/test161.h>
 #include <synch.h>
 #include <vm.h>
+#include <cpu.h>
+#include <clock.h>
+#include <thread.h>
+#include <addrspace.h>
 
 // CAUTION: if local array exceeds PAGE_SIZE bytes the kernel stack
 // will overflow into the kernel code segment.
@@ -223,27 +227,25 @@ vmtest5(int nargs, char **args)
 	paddr_t paddr;
 	int result;
 	unsigned i;
-	struct pte pte;
+	pte_t pte;
 	(void)nargs;
 	(void)args;
 
 	kvaddr = alloc_kpages(1);
 	KASSERT(kvaddr != 0);
 	paddr = KVADDR_TO_PADDR(kvaddr);
-	pte.status = VM_PTE_VALID;
-	pte.block_index = 0;
-	pte.paddr = paddr;
+	pte = paddr | VM_PTE_VALID;
 
 	// Fill page with known sequence of bytes.
 	for (i = 0; i < PAGE_SIZE; i++) {
 		*(unsigned char *)(kvaddr + i) = i % 256;
 	}
-	result = save_page(&pte, 0);
+	result = save_page(&pte, 0, /*refs=*/1);
 	KASSERT(result == 0);
-	result = block_write(pte.block_index, paddr);
+	result = block_write(pte_block(pte), paddr);
 	KASSERT(result == 0);
 	bzero((void *)kvaddr, PAGE_SIZE);
-	result = block_read(pte.block_index, paddr);
+	result = block_read(pte_block(pte), paddr);
 	KASSERT(result == 0);
 	
 	// Confirm known sequence read back.
@@ -265,7 +267,7 @@ vmtest6(int nargs, char **args)
 	paddr_t paddr;
 	int result;
 	unsigned i;
-	struct pte *pte;
+	pte_t *pte;
 	const vaddr_t faultaddress = 0x10000;
 	struct addrspace *as;
 	(void)nargs;
@@ -277,7 +279,7 @@ vmtest6(int nargs, char **args)
     pte = create_test_page(as, faultaddress);
     KASSERT(pte != NULL);
 
-	paddr = pte->paddr;
+	paddr = PTE_PADDR(*pte);
 	kvaddr = PADDR_TO_KVADDR(paddr);
 	// Fill page with known sequence of bytes.
 	for (i = 0; i < PAGE_SIZE; i++) {
@@ -286,11 +288,10 @@ vmtest6(int nargs, char **args)
 
 	// Swap page out.
 	lock_acquire(as->pages_lock);
-	result = save_page(pte, /*dirty=*/1);
-	pte->status = VM_PTE_BACKED;
-	pte->paddr = 0;
-	lock_release(as->pages_lock);
+	result = save_page(pte, /*dirty=*/1, /*refs=*/1);
 	KASSERT(result == 0);
+	*pte = PTE_SWAPPED(pte_block(*pte));
+	lock_release(as->pages_lock);
 	free_pages(paddr);
 	
 	// Zero out the old memory for good meeasure.
@@ -299,7 +300,7 @@ vmtest6(int nargs, char **args)
 	// Access the backed page via page table.
 	result = get_page_via_table(as, faultaddress);
 	KASSERT(result == 0);
-	kvaddr = PADDR_TO_KVADDR(pte->paddr);
+	kvaddr = PADDR_TO_KVADDR(PTE_PADDR(*pte));
 
 	// Confirm known sequence read back.
 	for (i = 0; i < PAGE_SIZE; i++) {
@@ -357,7 +358,7 @@ vmtest8(int nargs, char **args)
 	paddr_t paddr;
 	unsigned p;
 	const unsigned pages = 1000;
-	struct pte *pte;
+	pte_t *pte;
 	(void)nargs;
 	(void)args;
 	int swap_enabled;
@@ -397,7 +398,7 @@ vmtest9(int nargs, char **args)
 	vaddr_t vaddr;
 	paddr_t paddr;
 	unsigned p;
-	struct pte *pte;
+	pte_t *pte;
 	(void)nargs;
 	(void)args;
 	int result;
@@ -429,9 +430,9 @@ vmtest9(int nargs, char **args)
 			break;
 		}
 		// Write a unique test pattern to each page.
-		*(unsigned *)PADDR_TO_KVADDR(pte->paddr) = p;
+		*(unsigned *)PADDR_TO_KVADDR(PTE_PADDR(*pte)) = p;
 		// Maintain our own coremap so we can find vaddr from paddr.
-		core_idx = paddr_to_core_idx(pte->paddr);
+		core_idx = paddr_to_core_idx(PTE_PADDR(*pte));
 		core_idx_to_vaddr[core_idx] = vaddr;
 	}
 	KASSERT(pte == NULL);
@@ -456,8 +457,8 @@ vmtest9(int nargs, char **args)
 	KASSERT(pte != NULL);
 
 	// Page-in from swapdisk.
-	KASSERT(pte->status & VM_PTE_BACKED);
-	result = block_read(pte->block_index, paddr);
+	KASSERT(!(*pte & VM_PTE_VALID) && (*pte & VM_PTE_BACKED));
+	result = block_read(pte_block(*pte), paddr);
 	KASSERT(result == 0);
 	lock_release(as->pages_lock);
 
@@ -484,7 +485,7 @@ vmtest10(int nargs, char **args)
 	struct addrspace *as;
 	vaddr_t vaddr;
 	unsigned p;
-	struct pte *pte;
+	pte_t *pte;
 	(void)nargs;
 	(void)args;
 	size_t swap0, swap1;
@@ -523,3 +524,164 @@ vmtest10(int nargs, char **args)
 	success(TEST161_SUCCESS, SECRET, "vm10");
 	return 0;
 }
+
+#define STRESS_PAGES 1024  // Total pages touched, more than physical memory.
+#define STRESS_ROUNDS 2
+#define STRESS_VBASE 0x10000
+
+static struct semaphore *stress_done;
+
+static void
+stress_thread(void *data1, unsigned long data2)
+{
+	struct addrspace *as = data1;
+	unsigned npages = data2;
+	unsigned r, p;
+	int result;
+
+	for (r = 0; r < STRESS_ROUNDS; r++) {
+		for (p = 0; p < npages; p++) {
+			result = get_page_via_table(as, STRESS_VBASE + p * PAGE_SIZE);
+			KASSERT(result == 0);
+		}
+	}
+	V(stress_done);
+}
+
+// Tests page faults and evictions scale with concurrent threads.
+//
+// Each thread faults its own share of STRESS_PAGES pages in its own
+// address space, so the total work is the same for each thread count.
+// Run with ramsize=1M and several CPUs to see the effect.
+int
+vmtest11(int nargs, char **args)
+{
+	struct addrspace **as;
+	struct timespec start, end, duration;
+	unsigned nthreads, npages, i;
+	unsigned msecs;
+	int result;
+	size_t swap0, swap1;
+	size_t mem0, mem1;
+	(void)nargs;
+	(void)args;
+
+	mem0 = coremap_used_bytes();
+	swap0 = swap_used_pages();
+
+	stress_done = sem_create("stress_done", 0);
+	KASSERT(stress_done != NULL);
+	as = kmalloc(sizeof(struct addrspace *) * num_cpus);
+	KASSERT(as != NULL);
+
+	for (nthreads = 1; nthreads <= num_cpus; nthreads++) {
+		npages = STRESS_PAGES / nthreads;
+		for (i = 0; i < nthreads; i++) {
+			as[i] = as_create();
+			KASSERT(as[i] != NULL);
+			result = as_define_region(as[i], STRESS_VBASE, npages * PAGE_SIZE, 1, 1, 0);
+			KASSERT(result == 0);
+		}
+		gettime(&start);
+		for (i = 0; i < nthreads; i++) {
+			result = thread_fork("vm11", NULL, stress_thread, as[i], npages);
+			KASSERT(result == 0);
+		}
+		for (i = 0; i < nthreads; i++) {
+			P(stress_done);
+		}
+		gettime(&end);
+		timespec_sub(&end, &start, &duration);
+		msecs = duration.tv_sec * 1000 + duration.tv_nsec / 1000000;
+		kprintf("%u threads: %u faults in %u ms\n", nthreads, 
+		  npages * nthreads * STRESS_ROUNDS, msecs);
+		for (i = 0; i < nthreads; i++) {
+			as_destroy(as[i]);
+		}
+	}
+	kfree(as);
+	sem_destroy(stress_done);
+
+	// Verify memory and swap have been cleaned up.
+	mem1 = coremap_used_bytes();
+	swap1 = swap_used_pages();
+	KASSERT(swap0 == swap1);
+	KASSERT(mem0 == mem1);
+
+	kprintf_t("\n");
+	success(TEST161_SUCCESS, SECRET, "vm11");
+	return 0;
+}
+
+#define HANDS_BLOCK 8  // Pages in the block the hands are left inside.
+
+// Runs both coremap hands from the page at paddr.  Memory is not
+// exhausted, so the clock must find a free block.
+static void
+hands_check(paddr_t paddr)
+{
+	set_coremap_hands(paddr);
+	KASSERT(locking_find_victim_page() != 0);
+	(void)locking_find_dirty_page();
+	spinlock_acquire_coremap();
+	KASSERT(validate_coremap() == 0);
+	spinlock_release_coremap();
+}
+
+// Runs both coremap hands from every page of the block at paddr.
+static void
+hands_scan(paddr_t paddr)
+{
+	for (unsigned i = 0; i < HANDS_BLOCK; i++) {
+		hands_check(paddr + i * PAGE_SIZE);
+	}
+}
+
+// Tests the clock and pageout daemon hands survive being left inside
+// blocks that are split and merged under them.
+int
+vmtest12(int nargs, char **args)
+{
+	unsigned used_bytes0;
+	paddr_t block;
+	paddr_t pages[HANDS_BLOCK];
+	int swap_enabled;
+	(void)nargs;
+	(void)args;
+
+	swap_enabled = set_swap_enabled(0);
+	used_bytes0 = coremap_used_bytes();
+
+	// Inside a used multi-page block.
+	block = alloc_pages(HANDS_BLOCK);
+	KASSERT(block != 0);
+	hands_scan(block);
+
+	// Inside the free block it merges into.
+	free_pages(block);
+	hands_scan(block);
+
+	// Split memory into single pages, leave the hands on each, then
+	// free them so merges swallow pages a hand was on.  Single pages
+	// may pass through the per-cpu page caches, which
+	// coremap_used_bytes drains back into the buddy lists.
+	for (unsigned i = 0; i < HANDS_BLOCK; i++) {
+		pages[i] = alloc_pages(1);
+		KASSERT(pages[i] != 0);
+	}
+	for (unsigned i = 0; i < HANDS_BLOCK; i++) {
+		set_coremap_hands(pages[i]);
+		free_pages(pages[i]);
+		(void)locking_find_victim_page();
+		(void)locking_find_dirty_page();
+	}
+	KASSERT(coremap_used_bytes() == used_bytes0);
+	for (unsigned i = 0; i < HANDS_BLOCK; i++) {
+		hands_check(pages[i]);
+	}
+	set_swap_enabled(swap_enabled);
+
+	kprintf_t("\n");
+	success(TEST161_SUCCESS, SECRET, "vm12");
+	return 0;
+}
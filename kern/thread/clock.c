@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <vm.h>
 
 /*
  * Time handling.
@@ -51,7 +52,8 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	16	/* Rebalance every 16 hardclocks. */
+#define TLB_SWEEP_HARDCLOCKS	8	/* Harvest page references every 8. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -97,6 +99,9 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if ((curcpu->c_hardclocks % TLB_SWEEP_HARDCLOCKS) == 0) {
+		vm_tlb_sweep();
+	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -33,12 +33,37 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <clock.h>
+#include <cpu.h>
 #include <synch.h>
+#include <objcache.h>
+
+/* Object caches for locks and CVs; see synch_bootstrap. */
+static struct objcache *lock_cache;
+static struct objcache *cv_cache;
+
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = objcache_create("lock", sizeof(struct lock),
+				     lock_ctor, lock_dtor);
+	cv_cache = objcache_create("cv", sizeof(struct cv),
+				   cv_ctor, cv_dtor);
+	if (lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -138,32 +163,127 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Spinning parameters for adaptive locks. A waiter spins in chunks
+ * of LOCK_SPIN_CHUNK iterations, rechecking between chunks that the
+ * holder is still running on another cpu, for at most LOCK_SPIN_MAX
+ * iterations per acquisition before it gives up and sleeps.
+ */
+#define LOCK_SPIN_CHUNK		64
+#define LOCK_SPIN_MAX		8192
+
+/* Number of most contended locks shown by lock_dumpstats. */
+#define LOCK_STATS_TOP		10
+
+/*
+ * List of all locks, for statistics. Counts from destroyed locks are
+ * folded into the retired totals.
+ */
+static struct spinlock lock_list_lock = SPINLOCK_INITIALIZER;
+static struct lock *lock_list;
+static unsigned lock_retired_acquires;
+static unsigned lock_retired_contended;
+static uint64_t lock_retired_spins;
+static uint64_t lock_retired_sleepusec;
+
+/*
+ * Microseconds elapsed from start to end.
+ */
+static
+uint64_t
+lock_usec(const struct timespec *start, const struct timespec *end)
+{
+	struct timespec diff;
+
+	timespec_sub(end, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * True if it is worth spinning for LOCK: the holder is running right
+ * now on some other cpu, so it should let go soon. Must hold
+ * lk_spinlock, which keeps the holder from releasing the lock (and
+ * thus from exiting) while we look at it.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+	struct thread *holder;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_spinlock));
+
+	holder = lock->lk_holder;
+	return holder != NULL && holder->t_state == S_RUN &&
+		holder->t_cpu != curcpu->c_self;
+}
+
+/*
+ * Lock constructor and destructor for lock_cache. A cached lock keeps
+ * its wait channel and spinlock; lock_create fills in the rest.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_spinlock);
+	lock->locked = false;
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_spinlock);
+	wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = objcache_alloc(lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		objcache_free(lock_cache, lock);
 		return NULL;
 	}
 
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_spinlock);
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 	lock->locked = false;
+	lock->lk_holder = NULL;
+
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_spins = 0;
+	lock->lk_sleepusec = 0;
+
+	spinlock_acquire(&lock_list_lock);
+	lock->lk_prev = NULL;
+	lock->lk_next = lock_list;
+	if (lock_list != NULL) {
+		lock_list->lk_prev = lock;
+	}
+	lock_list = lock;
+	spinlock_release(&lock_list_lock);
+
 	return lock;
 }
 
@@ -172,15 +292,34 @@ lock_destroy(struct lock *lock)
 {
 	KASSERT(lock != NULL);
 	KASSERT(lock->locked == false);
-	spinlock_cleanup(&lock->lk_spinlock);
-	wchan_destroy(lock->lk_wchan);
+
+	spinlock_acquire(&lock_list_lock);
+	if (lock->lk_prev != NULL) {
+		lock->lk_prev->lk_next = lock->lk_next;
+	}
+	else {
+		lock_list = lock->lk_next;
+	}
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prev = lock->lk_prev;
+	}
+	lock_retired_acquires += lock->lk_acquires;
+	lock_retired_contended += lock->lk_contended;
+	lock_retired_spins += lock->lk_spins;
+	lock_retired_sleepusec += lock->lk_sleepusec;
+	spinlock_release(&lock_list_lock);
+
+	wchan_setname(lock->lk_wchan, "lock");
 	kfree(lock->lk_name);
-	kfree(lock);
+	objcache_free(lock_cache, lock);
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct timespec before, after;
+	unsigned spins, i;
+
 	KASSERT(lock != NULL);
 	// No sleeping allowed if we are called from an interrupt handler.
 	KASSERT(curthread->t_in_interrupt == false);
@@ -191,11 +330,40 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 	KASSERT(lock_do_i_hold(lock) == false);
 
+	if (lock->locked) {
+		lock->lk_contended++;
+	}
+	spins = 0;
 	while (lock->locked) {
+		if (spins < LOCK_SPIN_MAX && lock_holder_running(lock)) {
+			/*
+			 * Spin with the spinlock dropped so the holder
+			 * can release. Only the lock word is looked at
+			 * here; the holder itself is rechecked under
+			 * the spinlock between chunks.
+			 */
+			spinlock_release(&lock->lk_spinlock);
+			for (i=0; i<LOCK_SPIN_CHUNK && lock->locked; i++) {
+				/* spin */
+			}
+			spins += i;
+			spinlock_acquire(&lock->lk_spinlock);
+			continue;
+		}
+		/*
+		 * Contended sleeps can't happen before there are
+		 * other threads, which is after the clock attaches,
+		 * so gettime is safe here.
+		 */
+		gettime(&before);
 		wchan_sleep(lock->lk_wchan, &lock->lk_spinlock);
+		gettime(&after);
+		lock->lk_sleepusec += lock_usec(&before, &after);
 	}
 	lock->locked = true;
 	lock->lk_holder = curthread;
+	lock->lk_acquires++;
+	lock->lk_spins += spins;
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -203,6 +371,26 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lk_spinlock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool acquired = false;
+
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_spinlock);
+	if (!lock->locked) {
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		lock->locked = true;
+		lock->lk_holder = curthread;
+		lock->lk_acquires++;
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+		acquired = true;
+	}
+	spinlock_release(&lock->lk_spinlock);
+	return acquired;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -229,34 +417,142 @@ lock_do_i_hold(struct lock *lock)
 	return (lock->lk_holder == curthread);
 }
 
+void
+lock_dumpstats(void)
+{
+	struct lock *lock, *top[LOCK_STATS_TOP];
+	char names[LOCK_STATS_TOP][32];
+	unsigned acquires[LOCK_STATS_TOP], contended[LOCK_STATS_TOP];
+	uint64_t spins[LOCK_STATS_TOP], sleepusec[LOCK_STATS_TOP];
+	unsigned nlocks, ntop, i, j;
+	unsigned tot_acquires, tot_contended;
+	uint64_t tot_spins, tot_sleepusec;
+
+	/*
+	 * Gather everything under the list lock, then print. The
+	 * per-lock counters are read without their spinlocks; these
+	 * are only statistics.
+	 */
+	spinlock_acquire(&lock_list_lock);
+	tot_acquires = lock_retired_acquires;
+	tot_contended = lock_retired_contended;
+	tot_spins = lock_retired_spins;
+	tot_sleepusec = lock_retired_sleepusec;
+	nlocks = ntop = 0;
+	for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+		nlocks++;
+		tot_acquires += lock->lk_acquires;
+		tot_contended += lock->lk_contended;
+		tot_spins += lock->lk_spins;
+		tot_sleepusec += lock->lk_sleepusec;
+
+		/* Insertion into the top list, most contended first. */
+		if (lock->lk_contended == 0) {
+			continue;
+		}
+		for (i=ntop; i>0; i--) {
+			if (top[i-1]->lk_contended >= lock->lk_contended) {
+				break;
+			}
+			if (i < LOCK_STATS_TOP) {
+				top[i] = top[i-1];
+			}
+		}
+		if (i < LOCK_STATS_TOP) {
+			top[i] = lock;
+			if (ntop < LOCK_STATS_TOP) {
+				ntop++;
+			}
+		}
+	}
+	for (j=0; j<ntop; j++) {
+		snprintf(names[j], sizeof(names[j]), "%s", top[j]->lk_name);
+		acquires[j] = top[j]->lk_acquires;
+		contended[j] = top[j]->lk_contended;
+		spins[j] = top[j]->lk_spins;
+		sleepusec[j] = top[j]->lk_sleepusec;
+	}
+	spinlock_release(&lock_list_lock);
+
+	kprintf("locks: %u live, %u acquires, %u contended\n",
+		nlocks, tot_acquires, tot_contended);
+	kprintf("locks: %llu spin iterations, %llu us asleep\n",
+		tot_spins, tot_sleepusec);
+	for (j=0; j<ntop; j++) {
+		kprintf("  %-31s %8u acq %8u cont %10llu spin %10llu us\n",
+			names[j], acquires[j], contended[j],
+			spins[j], sleepusec[j]);
+	}
+}
+
+void
+lock_resetstats(void)
+{
+	struct lock *lock;
+
+	spinlock_acquire(&lock_list_lock);
+	lock_retired_acquires = 0;
+	lock_retired_contended = 0;
+	lock_retired_spins = 0;
+	lock_retired_sleepusec = 0;
+	for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+		lock->lk_acquires = 0;
+		lock->lk_contended = 0;
+		lock->lk_spins = 0;
+		lock->lk_sleepusec = 0;
+	}
+	spinlock_release(&lock_list_lock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
 
 
+/*
+ * CV constructor and destructor for cv_cache, as for locks.
+ */
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&cv->cv_spinlock);
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_cleanup(&cv->cv_spinlock);
+	wchan_destroy(cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = objcache_alloc(cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		objcache_free(cv_cache, cv);
 		return NULL;
 	}
 
-	cv->cv_wchan = wchan_create(name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
-	spinlock_init(&cv->cv_spinlock);
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 	return cv;
 }
 
@@ -265,10 +561,9 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 
-	spinlock_cleanup(&cv->cv_spinlock);
-	wchan_destroy(cv->cv_wchan);
+	wchan_setname(cv->cv_wchan, "cv");
 	kfree(cv->cv_name);
-	kfree(cv);
+	objcache_free(cv_cache, cv);
 }
 
 void
@@ -308,8 +603,12 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	spinlock_release(&cv->cv_spinlock);	
 }
 
-struct rwlock 
-*rwlock_create(const char *name)
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
 {
 	struct rwlock *rwlock;
 
@@ -322,96 +621,157 @@ struct rwlock
 		kfree(rwlock);
 		return NULL;
 	}
-	rwlock->state_lock = lock_create("state_lock");
-	if (rwlock->state_lock == NULL) {
-		kfree(rwlock->rwlock_name);
-		kfree(rwlock);
-		return NULL;
-	}
-	rwlock->read_entry_sem = sem_create("read_entry_sem", 1);
-	if (rwlock->read_entry_sem == NULL) {
-		lock_destroy(rwlock->state_lock);
+	rwlock->rw_readwchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rw_readwchan == NULL) {
 		kfree(rwlock->rwlock_name);
 		kfree(rwlock);
 		return NULL;
 	}
-	rwlock->write_sem = sem_create("write_sem", 1);
-	if (rwlock->write_sem == NULL) {
-		sem_destroy(rwlock->read_entry_sem);
-		lock_destroy(rwlock->state_lock);
+	rwlock->rw_writewchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rw_writewchan == NULL) {
+		wchan_destroy(rwlock->rw_readwchan);
 		kfree(rwlock->rwlock_name);
 		kfree(rwlock);
 		return NULL;
 	}
-	rwlock->readers = 0;
-	rwlock->writers = 0;
+	spinlock_init(&rwlock->rw_spinlock);
+	rwlock->rw_readers = 0;
+	rwlock->rw_writer = NULL;
+	rwlock->rw_readwaiting = 0;
+	rwlock->rw_writewaiting = 0;
+	rwlock->rw_readpass = 0;
+	rwlock->rw_readgen = 0;
+	rwlock->rw_pref = RW_PREFER_WRITERS;
 	return rwlock;
 }
 
-void 
+void
 rwlock_destroy(struct rwlock *rwlock)
 {
 	KASSERT(rwlock != NULL);
-	sem_destroy(rwlock->write_sem);
-	sem_destroy(rwlock->read_entry_sem);
-	lock_destroy(rwlock->state_lock);
+	KASSERT(rwlock->rw_readers == 0);
+	KASSERT(rwlock->rw_writer == NULL);
+	KASSERT(rwlock->rw_readwaiting == 0);
+	KASSERT(rwlock->rw_writewaiting == 0);
+
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&rwlock->rw_spinlock);
+	wchan_destroy(rwlock->rw_writewchan);
+	wchan_destroy(rwlock->rw_readwchan);
 	kfree(rwlock->rwlock_name);
 	kfree(rwlock);
 }
 
-void 
+void
+rwlock_setpref(struct rwlock *rwlock, rwpref_t pref)
+{
+	KASSERT(rwlock != NULL);
+	KASSERT(pref == RW_PREFER_WRITERS || pref == RW_PREFER_READERS);
+
+	spinlock_acquire(&rwlock->rw_spinlock);
+	rwlock->rw_pref = pref;
+	spinlock_release(&rwlock->rw_spinlock);
+}
+
+/*
+ * True if a reader must wait. A reader holding a pass from the last
+ * writer goes ahead even if writers are waiting.
+ */
+static
+bool
+rwlock_reader_blocked(struct rwlock *rwlock, bool passed)
+{
+	if (rwlock->rw_writer != NULL) {
+		return true;
+	}
+	if (passed) {
+		return false;
+	}
+	return rwlock->rw_pref == RW_PREFER_WRITERS &&
+		rwlock->rw_writewaiting > 0;
+}
+
+void
 rwlock_acquire_read(struct rwlock *rwlock)
 {
+	unsigned gen;
+	bool passed;
+
 	KASSERT(rwlock != NULL);
-	P(rwlock->read_entry_sem);
-	lock_acquire(rwlock->state_lock);
-	rwlock->readers++;
-	if (rwlock->readers == 1) {
-		// First reader in blocks writers.
-		P(rwlock->write_sem);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwlock->rw_spinlock);
+	KASSERT(rwlock->rw_writer != curthread);
+	passed = false;
+	while (rwlock_reader_blocked(rwlock, passed)) {
+		gen = rwlock->rw_readgen;
+		rwlock->rw_readwaiting++;
+		wchan_sleep(rwlock->rw_readwchan, &rwlock->rw_spinlock);
+		rwlock->rw_readwaiting--;
+		// Passes are only for readers asleep when they were
+		// handed out, not for ones that arrived since.
+		passed = rwlock->rw_readgen != gen;
+	}
+	if (passed) {
+		KASSERT(rwlock->rw_readpass > 0);
+		rwlock->rw_readpass--;
 	}
-	lock_release(rwlock->state_lock);
-	V(rwlock->read_entry_sem);
+	rwlock->rw_readers++;
+	spinlock_release(&rwlock->rw_spinlock);
 }
 
-void 
+void
 rwlock_release_read(struct rwlock *rwlock)
 {
 	KASSERT(rwlock != NULL);
-	lock_acquire(rwlock->state_lock);
-	KASSERT(rwlock->readers > 0);
-	rwlock->readers--;
-	if (rwlock->readers == 0) {
-		// Last reader out allows writers.
-		V(rwlock->write_sem);
+
+	spinlock_acquire(&rwlock->rw_spinlock);
+	KASSERT(rwlock->rw_readers > 0);
+	rwlock->rw_readers--;
+	if (rwlock->rw_readers == 0 && rwlock->rw_writewaiting > 0) {
+		// Last reader out lets a writer in.
+		wchan_wakeone(rwlock->rw_writewchan, &rwlock->rw_spinlock);
 	}
-	lock_release(rwlock->state_lock);
+	spinlock_release(&rwlock->rw_spinlock);
 }
 
-void 
+void
 rwlock_acquire_write(struct rwlock *rwlock)
 {
 	KASSERT(rwlock != NULL);
-	// Writers block entry of new readers.
-	P(rwlock->read_entry_sem);
-	// Writers must wait for active readers or writers.
-	P(rwlock->write_sem);
-	lock_acquire(rwlock->state_lock);
-	KASSERT(rwlock->writers == 0);
-	rwlock->writers = 1;
-	lock_release(rwlock->state_lock);
+	KASSERT(curthread->t_in_interrupt == false);
 
+	spinlock_acquire(&rwlock->rw_spinlock);
+	KASSERT(rwlock->rw_writer != curthread);
+	// Wait for active readers or writers, and for readers handed
+	// the lock by the last writer to get in and out.
+	while (rwlock->rw_writer != NULL || rwlock->rw_readers > 0 ||
+	       rwlock->rw_readpass > 0) {
+		rwlock->rw_writewaiting++;
+		wchan_sleep(rwlock->rw_writewchan, &rwlock->rw_spinlock);
+		rwlock->rw_writewaiting--;
+	}
+	rwlock->rw_writer = curthread;
+	spinlock_release(&rwlock->rw_spinlock);
 }
 
-void 
+void
 rwlock_release_write(struct rwlock *rwlock)
 {
 	KASSERT(rwlock != NULL);
-	lock_acquire(rwlock->state_lock);
-	KASSERT(rwlock->writers == 1);
-	rwlock->writers = 0;
-	// Allow entry of new readers before waking any waiting writers.
-	V(rwlock->read_entry_sem);
-	V(rwlock->write_sem);
-	lock_release(rwlock->state_lock);
+
+	spinlock_acquire(&rwlock->rw_spinlock);
+	KASSERT(rwlock->rw_writer == curthread);
+	rwlock->rw_writer = NULL;
+	if (rwlock->rw_readwaiting > 0) {
+		// Hand the lock to the readers that waited through this
+		// write before letting another writer in.
+		rwlock->rw_readpass = rwlock->rw_readwaiting;
+		rwlock->rw_readgen++;
+		wchan_wakeall(rwlock->rw_readwchan, &rwlock->rw_spinlock);
+	}
+	else if (rwlock->rw_writewaiting > 0) {
+		wchan_wakeone(rwlock->rw_writewchan, &rwlock->rw_spinlock);
+	}
+	spinlock_release(&rwlock->rw_spinlock);
 }
@@ -51,6 +51,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <vm.h>
+#include <objcache.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -62,6 +63,10 @@ struct wchan {
 	struct threadlist wc_threads;	/* list of waiting threads */
 };
 
+/* Object caches for threads and wait channels. */
+static struct objcache *thread_cache;
+static struct objcache *wchan_cache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -76,6 +81,9 @@ unsigned thread_count = 0;
 static struct spinlock thread_count_lock = SPINLOCK_INITIALIZER;
 static struct wchan *thread_count_wchan;
 
+/* Load balancing; used by thread_switch before going idle. */
+static bool thread_steal(unsigned imbalance);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -128,7 +136,7 @@ thread_create(const char *name)
 		return NULL;
 	}
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
@@ -151,6 +159,12 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_quantum_used = 0;
+	thread->t_waited = 0;
+	thread->t_lastran = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -196,6 +210,7 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	c->c_steal_seed = c->c_number + 1;
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -285,7 +300,7 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread);
+	objcache_free(thread_cache, thread);
 }
 
 /*
@@ -374,6 +389,12 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -454,6 +475,29 @@ thread_start_cpus(void)
 	thread_count = 1;
 }
 
+/*
+ * Put a ready thread on a cpu's run queue, after every thread of the
+ * same or better priority and ahead of every worse one. The run queue
+ * is thus kept sorted by t_priority and is round-robin within a level.
+ * The run queue lock must be held.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *onlist;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(onlist, c->c_runqueue) {
+		if (onlist->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, onlist, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -478,7 +522,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -638,6 +682,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastran = curcpu->c_hardclocks;
 
 	/*
 	 * Get the next thread. While there isn't one, call cpu_idle().
@@ -654,6 +699,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to steal work from another cpu. This is
+	 * done with our own runqueue unlocked, so we never hold two
+	 * runqueue locks at once. Failing that, zero a free page for
+	 * alloc_pages, one per pass so the runqueue is rechecked often.
 	 */
 
 	/* The current cpu is now idle. */
@@ -662,7 +712,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal(1) && !vm_idle_zero_page()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -847,137 +899,225 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * We implement a multilevel feedback queue. The run queue is kept
+ * sorted by level (see runqueue_insert), so thread_switch always
+ * picks the oldest ready thread at the best level present, and
+ * hardclock's thread_yield is round-robin within that level.
+ *
+ * Here we do the accounting. The thread running when the period ends
+ * is charged the whole period (as with the statclock sampling in
+ * 4.4BSD); when it has used SCHED_QUANTUM of its level it drops a
+ * level, so CPU-bound threads sink. Threads that block are boosted
+ * when woken (see wchan_wake*), so interactive threads float. Every
+ * thread left waiting on the run queue ages, and is promoted after
+ * SCHED_AGE_PERIODS periods so nothing starves behind a stream of
+ * higher-priority work.
  */
-
 void
 schedule(void)
 {
+	struct thread *cur, *t, *next;
+	struct threadlist promoted;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	/* Charge the running thread, unless we interrupted the idle loop. */
+	if (!curcpu->c_isidle) {
+		cur->t_waited = 0;
+		cur->t_quantum_used++;
+		if (cur->t_quantum_used >= SCHED_QUANTUM(cur->t_priority)) {
+			if (cur->t_priority < SCHED_LEVELS - 1) {
+				cur->t_priority++;
+			}
+			cur->t_quantum_used = 0;
+		}
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Age everyone waiting. Promoted threads are pulled off and
+	 * reinserted so the queue stays sorted.
 	 */
+	threadlist_init(&promoted);
+	t = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	while (t != NULL) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t != cur && ++t->t_waited >= SCHED_AGE_PERIODS) {
+			t->t_waited = 0;
+			if (t->t_priority > 0) {
+				t->t_priority--;
+				t->t_quantum_used = 0;
+				threadlist_remove(&curcpu->c_runqueue, t);
+				threadlist_addtail(&promoted, t);
+			}
+		}
+		t = next;
+	}
+	while ((t = threadlist_remhead(&promoted)) != NULL) {
+		runqueue_insert(curcpu->c_self, t);
+	}
+	threadlist_cleanup(&promoted);
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Boost a thread that is being woken from a wait channel: it gave up
+ * the cpu voluntarily, so move it up a level and give it a fresh
+ * quantum. The thread is on no list, so no lock is needed.
+ */
+static
+void
+schedule_wakeup(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+	}
+	t->t_quantum_used = 0;
+	t->t_waited = 0;
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced by stealing: a CPU with too little to do pulls a
+ * ready thread from the busiest CPU. This happens whenever a CPU runs
+ * out of work in thread_switch, so idle CPUs pick up new work right
+ * away, and also periodically from hardclock() via
+ * thread_consider_migration() to even out CPUs that are busy but
+ * unequally loaded.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. So we leave threads that ran on their CPU in
+ * the last STEAL_HOT_HARDCLOCKS alone unless their run queue is long,
+ * and a stolen thread counts as having just run on its new CPU so it
+ * doesn't bounce straight back.
  */
-void
-thread_consider_migration(void)
+
+/*
+ * Pick a cpu to steal from: the one with the longest run queue. The
+ * scan starts at a random cpu so that ties, and many thieves looking
+ * at once, don't all converge on the same victim. Queue lengths are
+ * read without locks; they are only a hint.
+ */
+static
+struct cpu *
+thread_steal_victim(unsigned *count)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned numcpus, start, i, n;
+	struct cpu *c, *busiest;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
+	curcpu->c_steal_seed = curcpu->c_steal_seed * 1103515245 + 12345;
+	start = (curcpu->c_steal_seed >> 16) % numcpus;
+
+	busiest = NULL;
+	*count = 0;
 	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
+		}
+		n = c->c_runqueue.tl_count;
+		if (n > *count) {
+			*count = n;
+			busiest = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	return busiest;
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+/*
+ * Try to move one ready thread from the busiest cpu to this one. The
+ * victim's queue must be at least IMBALANCE longer than ours. Returns
+ * true if a thread was moved onto our run queue.
+ *
+ * Must not be called holding our own runqueue lock.
+ */
+static
+bool
+thread_steal(unsigned imbalance)
+{
+	struct cpu *victim;
+	struct thread *t;
+	unsigned count, mine;
+	bool hot;
+
+	KASSERT(!spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (cpuarray_num(&allcpus) < 2) {
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	victim = thread_steal_victim(&count);
+	mine = curcpu->c_runqueue.tl_count;
+	if (victim == NULL || count < mine + imbalance) {
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	/*
+	 * Take the first thread from the tail (the least favored and
+	 * most recently queued) that isn't cache-hot. As discussed in
+	 * the comment below, the victim's curthread can show up on its
+	 * run queue while it is unidling; never take that one.
+	 */
+	spinlock_acquire(&victim->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, victim->c_runqueue) {
+		if (t == victim->c_curthread) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		hot = victim->c_hardclocks - t->t_lastran
+			< STEAL_HOT_HARDCLOCKS;
+		if (!hot || victim->c_runqueue.tl_count >= STEAL_HOT_OVERRIDE) {
+			break;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	if (t == NULL) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return false;
+	}
+	threadlist_remove(&victim->c_runqueue, t);
+	spinlock_release(&victim->c_runqueue_lock);
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * The thread is on no list now, so nobody else can get at it
+	 * until we put it on ours.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
-	}
+	t->t_cpu = curcpu->c_self;
+	t->t_lastran = curcpu->c_hardclocks;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_insert(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Periodic rebalancing, called from hardclock(). Pull a thread over
+ * if some other cpu is noticeably busier than we are.
+ *
+ * Ordinarily, curthread will not appear on a run queue. However, it
+ * can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ *
+ * *Migrating* that thread can cause bad things to happen (Exercise:
+ * Why? And what?) which is why thread_steal skips the victim's
+ * c_curthread.
+ */
+void
+thread_consider_migration(void)
+{
+	thread_steal(STEAL_IMBALANCE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -986,6 +1126,44 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channel constructor and destructor for wchan_cache. A cached
+ * wchan keeps its (empty) thread list.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = "FREE";
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. Must come before anything creates a
+ * wait channel, which includes the first lock.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = objcache_create("wchan", sizeof(struct wchan),
+				      wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -999,16 +1177,25 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
 }
 
+/*
+ * Change the name of a wait channel. Used by objects that keep their
+ * wait channel across reuse from an object cache.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -1016,8 +1203,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = "FREE";
+	objcache_free(wchan_cache, wc);
 }
 
 /*
@@ -1060,6 +1248,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	schedule_wakeup(target);
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1099,6 +1288,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		schedule_wakeup(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1192,10 +1382,15 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 }
 
 /*
- * Send a TLB shootdown to all CPUs.
+ * Send a TLB shootdown to each CPU in cpumask other than this one.
+ * Doesn't wait; each target Vs mapping->sem when done.  Call at
+ * splhigh if the caller has also handled this CPU, so we can't
+ * migrate to a CPU that was skipped.
+ *
+ * Returns the number of CPUs sent to.
  */
-void
-ipi_broadcast_tlbshootdown(const struct tlbshootdown *mapping)
+unsigned
+ipi_tlbshootdown_cpus(uint32_t cpumask, const struct tlbshootdown *mapping)
 {
 	unsigned i;
 	unsigned num_shootdowns = 0;
@@ -1203,12 +1398,24 @@ ipi_broadcast_tlbshootdown(const struct tlbshootdown *mapping)
 
 	for (i=0; i < cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c != curcpu->c_self) {
-			// TODO(aabo): Only shootdown the cpus we need to.
+		if (c != curcpu->c_self && (cpumask & (1U << c->c_number))) {
 			ipi_tlbshootdown(c, mapping);
 			num_shootdowns++;
 		}
 	}
+	return num_shootdowns;
+}
+
+/*
+ * Send a TLB shootdown to all CPUs.
+ */
+void
+ipi_broadcast_tlbshootdown(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	unsigned num_shootdowns;
+
+	num_shootdowns = ipi_tlbshootdown_cpus(0xffffffff, mapping);
 	// Block until all cpus have finished their shootdowns.
 	for (i = 0; i < num_shootdowns; i++) {
 		P(mapping->sem);
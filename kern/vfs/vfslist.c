@@ -190,6 +190,30 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Global statistics function - call DEVOP_STATS on all devices that
+ * keep statistics.
+ */
+void
+vfs_devstats(bool reset)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_device != NULL &&
+		    dev->kd_device->d_ops->devop_stats != NULL) {
+			DEVOP_STATS(dev->kd_device, reset);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -38,6 +38,8 @@
 #include <synch.h>
 #include <current.h>
 #include <cpu.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -45,6 +47,52 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+// List of all address spaces.  A copy-on-write page may be mapped by
+// several address spaces, so eviction searches this list to find every
+// page table entry referencing the page.
+static struct addrspace *as_list_head = NULL;
+static struct lock *as_list_lock = NULL;
+
+/*
+ * Initializes address space bookkeeping at boot.
+ */
+void
+as_bootstrap(void)
+{
+	as_list_lock = lock_create("as_list");
+	if (as_list_lock == NULL) {
+		panic("as_bootstrap: Cannot create as_list_lock.");
+	}
+}
+
+/*
+ * Locks list of all address spaces.
+ *
+ * VM locking order is as_list_lock, as->pages_lock.
+ */
+void
+as_list_acquire(void)
+{
+	lock_acquire(as_list_lock);
+}
+
+void
+as_list_release(void)
+{
+	lock_release(as_list_lock);
+}
+
+/*
+ * Returns head of list of all address spaces.  Follow as->next
+ * for the rest.  Caller is responsible for locking list.
+ */
+struct addrspace *
+as_list_first(void)
+{
+	KASSERT(lock_do_i_hold(as_list_lock));
+	return as_list_head;
+}
+
 /*
  * Allocates and intializes an empty addrspace struct.
  */
@@ -69,151 +117,134 @@ as_create(void)
 		return NULL;
 	}
 	as->next_segment = 0;
-	// Create empty page table.
-	for (int p = 0; p < 1<<VPN_BITS_PER_LEVEL; p++) {
-		as->pages0[p] = NULL;
+	// Create empty page directory; pages come zeroed.
+	as->pt_dir = (pte_t **)alloc_kpages(1);
+	if (as->pt_dir == NULL) {
+		lock_destroy(as->heap_lock);
+		lock_destroy(as->pages_lock);
+		kfree(as);
+		return NULL;
 	}
 	as->vheapbase = 0;
 	as->vheaptop = 0;
+	as->swap_hint = swap_extent_hint();
+	for (int c = 0; c < MAXCPUS; c++) {
+		as->asids[c] = 0;
+	}
+
+	lock_acquire(as_list_lock);
+	as->next = as_list_head;
+	as_list_head = as;
+	lock_release(as_list_lock);
 	return as;
 }
 
 /*
- * Copies swapped out page src_pte to swapped out page dst_pte.
+ * Creates a destination leaf table for every leaf table in the source
+ * page table.
+ *
+ * Leaf tables are allocated from the coremap which may trigger an
+ * eviction, so this must be done before as_copy locks both page tables.
+ *
+ * Caller is responsible for locking source page table.
  *
- * Caller is responsible for locking src and dst addrspaces.
- * 
  * Args:
- *   dst_pte: Desintation page table entry.
- *   src_pte: Source page table entry.
- *   page_buf: Pointer to scratch buffer at least PAGE_SIZE bytes.
- * 
+ *   dst: Pointer to destination address space.
+ *   src: Pointer to source address space.
+ *
  * Returns:
  *   0 on success, else errno.
  */
 static int
-copy_swap_page(struct pte *dst_pte, struct pte *src_pte, char *page_buf)
+touch_page_table(struct addrspace *dst, struct addrspace *src)
 {
-	int result;
+	pte_t *dst_pte;
+	vaddr_t vaddr;
 
-	// Don't want to be touching user memory here which may trigger an eviction.
-	KASSERT((vaddr_t) page_buf >= MIPS_KSEG0);
-    KASSERT(src_pte->status & VM_PTE_BACKED);
-	// Effect a copy to disk by loading dst with src contents,
-	// then swapping out dst.
-	dst_pte->paddr = KVADDR_TO_PADDR((vaddr_t)page_buf);
-	result = block_read(src_pte->block_index, dst_pte->paddr);
-	if (result) {
-		return result;
+	KASSERT(lock_do_i_hold(src->pages_lock));
+
+	for (unsigned d = 0; d < PT_ENTRIES; d++) {
+		if (src->pt_dir[d] == NULL) {
+			continue;
+		}
+		vaddr = (vaddr_t)d << (PAGE_OFFSET_BITS + PT_INDEX_BITS);
+		// Release src page table for possible eviction.
+		lock_release(src->pages_lock);
+		lock_acquire(dst->pages_lock);
+		dst_pte = as_touch_pte(dst, vaddr);
+		lock_release(dst->pages_lock);
+		lock_acquire(src->pages_lock);
+		if (dst_pte == NULL) {
+			return ENOMEM;
+		}
 	}
-    result = save_page(dst_pte, /*dirty=*/1);
-	dst_pte->paddr = (paddr_t)NULL;
-	dst_pte->status &= ~VM_PTE_VALID;
-	return result;
+	return 0;
 }
 
 /*
- * Copies src page table and all referenced physical pages to dst.
+ * Shares all pages referenced by src page table with dst.
+ *
+ * Physical pages and swap blocks are not copied.  Both page tables
+ * reference the same pages which are reference counted in the coremap
+ * and swapmap.  A write to a shared page faults as read-only and
+ * vm_fault makes a private copy (copy on write).
+ *
+ * Does not allocate memory.  All destination leaf tables must
+ * already exist (see touch_page_table).
+ *
+ * Caller is responsible for locking both page tables.
  *
- * New physical pages are allocated and independent copies of the
- * pages are made, so physical addresses are different, but
- * virtual addresses will be the same.  For example, to
- * copy everything:
- * 
- * copy_page_table(dst, src->pages0, 0, 0x0)
- * 
- * Caller is responsible for locking source page table.
- * 
  * Args:
  *   dst: Pointer to destination address space.
- *   src_pages: Pointer to source address space level0 page table.
- *   vpn: initial virtual page number (normally 0).
- *   page_buf: Pointer to a scratch buffer at least PAGE_SIZE bytes.
- * 
- * Returns:
- *   0 on success, else errno.
+ *   src: Pointer to source address space.
  */
-static int
-copy_page_table(struct addrspace *dst, 
-                struct addrspace *src,
-				void **src_pages, 
-				int level, 
-				vaddr_t vpn, 
-				char *page_buf) 
+static void
+share_page_table(struct addrspace *dst, struct addrspace *src)
 {
-	struct pte *dst_pte, *src_pte;
-	vaddr_t vaddr, next_vpn;
-	void **next_pages;
-	int result;
-	paddr_t paddr;
+	pte_t *src_leaf, *dst_leaf;
+	pte_t pte;
 
 	KASSERT(lock_do_i_hold(src->pages_lock));
 	KASSERT(lock_do_i_hold(dst->pages_lock));
-	
-	// Recursive depth-first traversal of source page table.
-	int next_level = level + 1;
-	for (int idx = 0; idx < 1 << VPN_BITS_PER_LEVEL; idx++) {
-		next_vpn = (vpn << VPN_BITS_PER_LEVEL) | idx;
-		if (level == PT_LEVELS - 1) {
-			// Make copy of physical page.
-			vaddr = next_vpn << PAGE_OFFSET_BITS;
-			// Release src page table for possible eviction.
-			lock_release(src->pages_lock);
-			dst_pte = as_touch_pte(dst, vaddr);
-			lock_acquire(src->pages_lock);
-			if (dst_pte == NULL) {
-				return ENOMEM;
-			}
-			src_pte = ((struct pte *)src_pages) + idx;
-			KASSERT(src_pte != NULL);
-			if (src_pte->status & VM_PTE_VALID) {
-				// Release locks before touching user memory.
-				lock_release(src->pages_lock);
-				lock_release(dst->pages_lock);
-				// Copy from user memory to kernel memory so we don't trigger evictions.
-				memmove(page_buf, 
-				  (const void *)PADDR_TO_KVADDR(src_pte->paddr), PAGE_SIZE);
-				paddr = alloc_pages(1);
-				lock_acquire(src->pages_lock);
-				lock_acquire(dst->pages_lock);
-				if (paddr == 0) {
-					return ENOMEM;
-				}
-				spinlock_acquire_coremap();
-				coremap_assign_vaddr(paddr, dst, vaddr);
-				dst_pte->paddr = paddr;
-				// Copy kernel memory to kernel memory so no danger of evictions.
-                memmove((void *)PADDR_TO_KVADDR(dst_pte->paddr), 
-                  (const void *)page_buf, PAGE_SIZE);
-				dst_pte->status = VM_PTE_VALID;
-				spinlock_release_coremap();
-			} else if (src_pte->status & VM_PTE_BACKED) {
-				// Copy swap to swap.
-				result = copy_swap_page(dst_pte, src_pte, page_buf);
-				if (result) {
-					return result;
-				}
-				dst_pte->status = VM_PTE_BACKED;
-			} // else page does not have any data.
-			continue;
-        }
-		next_pages = src_pages[idx];
-        if (next_pages == NULL) {
+
+	for (unsigned d = 0; d < PT_ENTRIES; d++) {
+		src_leaf = src->pt_dir[d];
+		if (src_leaf == NULL) {
 			continue;
-		}		
-		result = copy_page_table(dst, src, next_pages, next_level, next_vpn, page_buf);
-		if (result) {
-			return result;
+		}
+		dst_leaf = dst->pt_dir[d];
+		KASSERT(dst_leaf != NULL);
+		for (unsigned l = 0; l < PT_ENTRIES; l++) {
+			pte = src_leaf[l];
+			if (pte == 0) {
+				continue;
+			}
+			KASSERT(dst_leaf[l] == 0);
+			if (pte & VM_PTE_VALID) {
+				share_user_page(PTE_PADDR(pte));
+			}
+			if (pte & VM_PTE_BACKED) {
+				share_swapmap_block(pte_block(pte));
+			}
+			// A resident page's swap block is in its coremap
+			// entry, so it is shared along with the page.
+			dst_leaf[l] = pte;
 		}
 	}
-	return 0;
 }
 
+/*
+ * Creates a copy of address space src.
+ *
+ * Pages are shared copy on write rather than copied, so the cost of
+ * fork is proportional to the size of the page table rather than the
+ * memory in use.  This matters when the child immediately calls execv
+ * and throws the copy away.
+ */
 int
 as_copy(struct addrspace *src, struct addrspace **ret)
 {
 	struct addrspace *dst;
-	char *page_buf;
 	int result;
 
 	*ret = NULL;
@@ -222,12 +253,11 @@ as_copy(struct addrspace *src, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	// TODO(aabo): Implement deferred copy on write.
-
 	for (int s = 0; s < src->next_segment; s++) {
-		dst->segments[s].vbase = src->segments[s].vbase;
-		dst->segments[s].size = src->segments[s].size;
-		dst->segments[s].access = src->segments[s].access;
+		dst->segments[s] = src->segments[s];
+		if (dst->segments[s].vn != NULL) {
+			VOP_INCREF(dst->segments[s].vn);
+		}
 	}
 	dst->next_segment = src->next_segment;
 
@@ -236,107 +266,62 @@ as_copy(struct addrspace *src, struct addrspace **ret)
 	dst->vheaptop = src->vheaptop;
 	lock_release(src->heap_lock);
 
-	// Scratch memory for copying swap pages if needed.
-	// Allocate once here per process for efficiency.
-	page_buf = kmalloc(sizeof(char) * PAGE_SIZE);
-	if (page_buf == NULL) {
+	// Allocate destination page table first which may evict pages.
+	lock_acquire(src->pages_lock);
+	result = touch_page_table(dst, src);
+	lock_release(src->pages_lock);
+	if (result) {
 		as_destroy(dst);
-		return ENOMEM;
+		return result;
 	}
 
+	// Holding src->pages_lock keeps shared pages from being evicted
+	// while we are adding references to them.
 	lock_acquire(src->pages_lock);
 	lock_acquire(dst->pages_lock);
-	result = copy_page_table(dst, src, src->pages0, 0, (vaddr_t)0x0, page_buf);
+	share_page_table(dst, src);
 	lock_release(dst->pages_lock);
 	lock_release(src->pages_lock);
 
-	kfree(page_buf);
-	if (result) {
-		as_destroy(dst);
-		return result;
+	// Source pages may still be write enabled in the TLB of any cpu
+	// it ran on.  Drop its ASIDs so the next write faults and gets
+	// its own copy, and take a fresh one here if it is running.
+	vm_tlb_retire(src, 0);
+	if (src == proc_getas()) {
+		as_activate();
 	}
+
 	*ret = dst;
 	return 0;
 }
 
-// Helper for dump_page_table.
-// Visits each page table entry using recursive depth-first traversal
-// of page table
-static void
-visit_page_table(void **pages, int level, vaddr_t vpn) 
-{
-	struct pte *pte;
-	const char *tab[] = {"", "     ", "          ", "               "};
-	vaddr_t vaddr, next_vpn;
-	void **next_pages;
-
-	int next_level = level + 1;
-	for (int idx = 0; idx < 1 << VPN_BITS_PER_LEVEL; idx++) {
-		next_vpn = (vpn << VPN_BITS_PER_LEVEL) | idx;
-		if (level == PT_LEVELS - 1) {
-			vaddr = next_vpn << PAGE_OFFSET_BITS;
-			pte = ((struct pte *)pages) + idx;
-			// TODO(aabo): Unify some page table walking functions to reduce 
-			// code duplication.
-            kprintf("%s[%2d] v0x%08x -> p0x%08x: status=0x%x, block_index=%u\n", tab[level], 
-			  idx, vaddr, pte->paddr, pte->status, pte->block_index);
-			continue;
-        }
-		next_pages = pages[idx];
-        if (next_pages == NULL) {
-			continue;
-		}
-		kprintf("%s[%2d]-v\n", tab[level], idx);
-		visit_page_table(next_pages, next_level, next_vpn);
-	}
-}
-
 /*
- * Descend multi-level page table belonging to address space as 
- * and print contents.
+ * Print contents of the page table belonging to address space as.
  */
 void
 dump_page_table(struct addrspace *as)
 {
-	lock_acquire(as->pages_lock);
-    visit_page_table(as->pages0, 0, 0x0);
-	lock_release(as->pages_lock);
-}
+	pte_t *leaf;
+	pte_t pte;
+	vaddr_t vaddr;
 
-/*
- * Helper function for as_validate_page_table.
- *
- * Args:
- *   as: Pointer to address space to validate.
- *   pages: Pointer to page table.
- *   level: Current level of table to traverse starting at 0.
- *   vpn: Virtual page number (no page offset bits) .
- */
-static void
-validate_page_table(struct addrspace *as, void **pages, int level, vaddr_t vpn) 
-{
-	struct pte *pte;
-	vaddr_t vaddr, next_vpn;
-	void **next_pages;
-
-	int next_level = level + 1;
-	for (int idx = 0; idx < 1 << VPN_BITS_PER_LEVEL; idx++) {
-		next_vpn = (vpn << VPN_BITS_PER_LEVEL) | idx;
-		if (level == PT_LEVELS - 1) {
-			vaddr = next_vpn << PAGE_OFFSET_BITS;
-			pte = ((struct pte *)pages) + idx;
-			if (pte->status & VM_PTE_VALID) {
-                KASSERT(vm_get_as(pte->paddr) == as);
-                KASSERT(vm_get_vaddr(pte->paddr) == vaddr);
-			}
-			continue;
-        }
-		next_pages = pages[idx];
-        if (next_pages == NULL) {
+	lock_acquire(as->pages_lock);
+	for (unsigned d = 0; d < PT_ENTRIES; d++) {
+		leaf = as->pt_dir[d];
+		if (leaf == NULL) {
 			continue;
 		}
-		validate_page_table(as, next_pages, next_level, next_vpn);
+		kprintf("[%4u]-v\n", d);
+		for (unsigned l = 0; l < PT_ENTRIES; l++) {
+			pte = leaf[l];
+			if (pte == 0) {
+				continue;
+			}
+			vaddr = ((d << PT_INDEX_BITS) | l) << PAGE_OFFSET_BITS;
+			kprintf("     [%4u] v0x%08x -> 0x%08x\n", l, vaddr, pte);
+		}
 	}
+	lock_release(as->pages_lock);
 }
 
 /*
@@ -350,47 +335,78 @@ validate_page_table(struct addrspace *as, void **pages, int level, vaddr_t vpn)
 int
 as_validate_page_table(struct addrspace *as)
 {
+	pte_t *leaf;
+	pte_t pte;
+	vaddr_t vaddr;
+
 	KASSERT(lock_do_i_hold(as->pages_lock));
-	validate_page_table(as, as->pages0, 0, 0x0);
+	for (unsigned d = 0; d < PT_ENTRIES; d++) {
+		leaf = as->pt_dir[d];
+		if (leaf == NULL) {
+			continue;
+		}
+		for (unsigned l = 0; l < PT_ENTRIES; l++) {
+			pte = leaf[l];
+			if (!(pte & VM_PTE_VALID)) {
+				continue;
+			}
+			vaddr = ((d << PT_INDEX_BITS) | l) << PAGE_OFFSET_BITS;
+			spinlock_acquire_coremap();
+			// Copy-on-write pages may be recorded under another
+			// address space sharing the page.
+			KASSERT(vm_is_shared(PTE_PADDR(pte)) ||
+			  (vm_get_as(PTE_PADDR(pte)) == as));
+			KASSERT(vm_get_vaddr(PTE_PADDR(pte)) == vaddr);
+			spinlock_release_coremap();
+		}
+	}
     return 0;
 }
 
 /*
- * Descend multi-level page table and free dynamic memory
- * used by table iteself and coremap pages referenced
- * by page table.  To destroy table from the top:
- * 
- * destroy_page_table(as->pages0, 0)
- * 
- * Args:
- *   pages: Pointer to array of pages, e.g. as->pages0.
- *   level: Starting level to descend from, e.g. 0.
+ * Releases the page and swap block referenced by a page table entry
+ * and clears it.
  */
 static void
-destroy_page_table(void **pages, int level) 
+destroy_pte(pte_t *pte)
 {
-	struct pte *pte;
-
-	int next_level = level + 1;
-	for (int idx = 0; idx < 1 << VPN_BITS_PER_LEVEL; idx++) {
-		if (level == PT_LEVELS - 1) {
-			pte = ((struct pte *)pages) + idx;
-			if (pte->status & VM_PTE_VALID) {
-                free_pages(pte->paddr);
-            }
-			if (pte->status & VM_PTE_BACKED) {
-                free_swapmap_block(pte->block_index);
-			}
-			continue;
-        }
-        if (pages[idx] == NULL) {
+	// Read the swap block before the page, which holds it, is freed.
+	if (*pte & VM_PTE_BACKED) {
+		free_swapmap_block(pte_block(*pte));
+	}
+	if (*pte & VM_PTE_VALID) {
+		free_user_page(PTE_PADDR(*pte));
+	}
+	*pte = 0;
+}
+
+/*
+ * Frees every page and swap block referenced by the page table of as,
+ * and the leaf tables and directory themselves.
+ *
+ * Caller is responsible for locking page table.
+ */
+static void
+destroy_page_table(struct addrspace *as)
+{
+	pte_t *leaf;
+
+	KASSERT(lock_do_i_hold(as->pages_lock));
+	for (unsigned d = 0; d < PT_ENTRIES; d++) {
+		leaf = as->pt_dir[d];
+		if (leaf == NULL) {
 			continue;
 		}
-		destroy_page_table(pages[idx], next_level);
-	}
-	if (level > 0) {
-        kfree(pages);
+		for (unsigned l = 0; l < PT_ENTRIES; l++) {
+			if (leaf[l] != 0) {
+				destroy_pte(&leaf[l]);
+			}
+		}
+		as->pt_dir[d] = NULL;
+		free_kpages((vaddr_t)leaf);
 	}
+	free_kpages((vaddr_t)as->pt_dir);
+	as->pt_dir = NULL;
 }
 
 /*
@@ -400,20 +416,31 @@ destroy_page_table(void **pages, int level)
 void
 as_destroy(struct addrspace *as)
 {
-	KASSERT(as != NULL);
+	struct addrspace **prev;
 
-	// Follow VM locking order to avoid another process trying to evict pages
-	// from the addrspace we are destroying.
+	KASSERT(as != NULL);
 
-	lock_acquire_evict();
+	// Remove from as_list first so evictions can no longer find us.
+	// Any eviction already holding our page table finishes before we
+	// can lock it.
+	lock_acquire(as_list_lock);
+	for (prev = &as_list_head; *prev != as; prev = &(*prev)->next) {
+		KASSERT(*prev != NULL);
+	}
+	*prev = as->next;
+	lock_release(as_list_lock);
 	lock_acquire(as->pages_lock);
-	destroy_page_table(as->pages0, 0);
+	destroy_page_table(as);
 	lock_release(as->pages_lock);
+	for (int s = 0; s < as->next_segment; s++) {
+		if (as->segments[s].vn != NULL) {
+			VOP_DECREF(as->segments[s].vn);
+		}
+	}
 	lock_destroy(as->pages_lock);
 	KASSERT(!lock_do_i_hold(as->heap_lock));
 	lock_destroy(as->heap_lock);
 	kfree(as);
-	lock_release_evict();
 }
 
 void
@@ -425,24 +452,18 @@ as_activate(void)
 	if (as == NULL) {
 		return;
 	}
-	vm_tlb_erase();
+	vm_tlb_activate(as);
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do. TLB entries are tagged with their address
+	 * space's ASID, which is never handed out again before the TLB
+	 * is flushed, so a destroyed address space's entries can't be
+	 * matched.
 	 */
-	struct addrspace *as;
-
-	as = proc_getas();
-	if (as == NULL) {
-		return;
-	}
-	vm_tlb_erase();	
 }
 
 /*
@@ -473,9 +494,45 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	as->segments[s].access = (readable ? VM_SEGMENT_READABLE : 0) | 
 	                         (writeable ? VM_SEGMENT_WRITEABLE|VM_SEGMENT_WRITEABLE_ACTUAL : 0) |
 							 (executable ? VM_SEGMENT_EXECUTABLE : 0);
+	as->segments[s].vn = NULL;
+	as->segments[s].file_vaddr = 0;
+	as->segments[s].file_offset = 0;
+	as->segments[s].file_size = 0;
 	return 0;
 }
 
+/*
+ * Backs the region defined at vaddr with filesize bytes of vn from
+ * offset.  Nothing is read now: each page is read from vn when first
+ * touched, and clean pages are dropped rather than swapped out.
+ *
+ * Returns:
+ *   0 on success, else EINVAL if no unbacked region starts at vaddr.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *vn, off_t offset,
+		vaddr_t vaddr, size_t filesize)
+{
+	struct segment *seg;
+
+	for (int s = 0; s < as->next_segment; s++) {
+		seg = &as->segments[s];
+		if ((seg->vbase != (vaddr & PAGE_FRAME)) || (seg->vn != NULL)) {
+			continue;
+		}
+		if (vaddr + filesize > seg->vbase + seg->size) {
+			return EINVAL;
+		}
+		VOP_INCREF(vn);
+		seg->vn = vn;
+		seg->file_vaddr = vaddr;
+		seg->file_offset = offset;
+		seg->file_size = filesize;
+		return 0;
+	}
+	return EINVAL;
+}
+
 /*
  * Temporarily enables write to all segments so they can be loaded without fault.
  */
@@ -614,6 +671,108 @@ as_operation_is_valid(struct addrspace *as, vaddr_t vaddr, int read_request)
 	return valid;
 }
 
+/*
+ * Returns 1 if vaddr is in a segment backed by an executable, so an
+ * unmodified page can be read back from the file, else 0.
+ */
+int
+as_file_backed(struct addrspace *as, vaddr_t vaddr)
+{
+	struct segment *seg;
+
+	for (int s = 0; s < as->next_segment; s++) {
+		seg = &as->segments[s];
+		if ((seg->vn != NULL) && (vaddr >= seg->vbase) &&
+		    (vaddr < seg->vbase + seg->size)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the page at vaddr is text that every address space
+ * running the same executable can share, else 0.  That is the case
+ * when no segment overlapping the page is writeable and at least one
+ * is backed by the executable.  Returns the executable and the file
+ * offset the page starts at, which are its key in the text page
+ * cache (see map_text_page).
+ */
+int
+as_text_page(struct addrspace *as, vaddr_t vaddr, struct vnode **vn,
+		off_t *offset)
+{
+	struct segment *seg;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	*vn = NULL;
+	*offset = 0;
+	for (int s = 0; s < as->next_segment; s++) {
+		seg = &as->segments[s];
+		if ((vaddr >= seg->vbase + seg->size) ||
+		    (vaddr + PAGE_SIZE <= seg->vbase)) {
+			continue;
+		}
+		if (seg->access & VM_SEGMENT_WRITEABLE_ACTUAL) {
+			return 0;
+		}
+		if ((seg->vn != NULL) && (*vn == NULL)) {
+			*vn = seg->vn;
+			*offset = seg->file_offset + ((off_t)vaddr - seg->file_vaddr);
+		}
+	}
+	return *vn != NULL;
+}
+
+/*
+ * Reads the file contents of the page at vaddr into the zeroed page
+ * at paddr.  A page may hold the ends of two segments, so every file
+ * backed segment overlapping it is read.  Parts of the page not in
+ * any file are left zero.
+ *
+ * Called without as->pages_lock, with the page marked busy.
+ *
+ * Returns:
+ *   0 on success, else errno value.
+ */
+int
+as_load_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct segment *seg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	for (int s = 0; s < as->next_segment; s++) {
+		seg = &as->segments[s];
+		if (seg->vn == NULL) {
+			continue;
+		}
+		start = seg->file_vaddr > vaddr ? seg->file_vaddr : vaddr;
+		end = seg->file_vaddr + seg->file_size;
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (start >= end) {
+			continue;
+		}
+		uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + start - vaddr),
+		  end - start, seg->file_offset + (start - seg->file_vaddr),
+		  UIO_READ);
+		result = VOP_READ(seg->vn, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			// Executable was truncated under us.
+			return EIO;
+		}
+	}
+	return 0;
+}
+
 /*
  * Looks up vaddr in page table.
  * 
@@ -625,8 +784,8 @@ as_operation_is_valid(struct addrspace *as, vaddr_t vaddr, int read_request)
  * Args:
  *   as: Pointer to addrspace.
  *   vaddr: Virtual address to find.
- *   create: Creates missing levels and table entries if 1, else
- *     sets pte_ptr = NULL when encounters a missing level or entry.
+ *   create: Creates a missing leaf table if 1, else sets
+ *     pte_ptr = NULL when the leaf table is missing.
  *   pte_ptr: Pointer to return pointer to page table entry.
  * 
  * Returns:
@@ -634,71 +793,38 @@ as_operation_is_valid(struct addrspace *as, vaddr_t vaddr, int read_request)
  *  Else errno value if there is a system error.
  */
 static int 
-touch_pte(struct addrspace *as, vaddr_t vaddr, int create, struct pte **pte_ptr)
+touch_pte(struct addrspace *as, vaddr_t vaddr, int create, pte_t **pte_ptr)
 {
-	int idx;
-	unsigned vpn;
-	void **pages;
-	void **next_pages;
-	struct pte *leaf_pages;
-	const unsigned mask[] = {0x1f<<15, 0x1f<<10, 0x1f<<5, 0x1f};
-	const unsigned shift[] = {15, 10, 5, 0};
-	int level;
+	unsigned d;
+	pte_t *leaf;
 	
 	KASSERT(lock_do_i_hold(as->pages_lock));
 
-	// Walk down to leaf page table.
-	vpn = vaddr >> PAGE_OFFSET_BITS;
-	pages = as->pages0;
 	*pte_ptr = NULL;
-	for (level = 0; level < PT_LEVELS - 2; level++) {
-        idx = (vpn & mask[level]) >> shift[level];
-        next_pages = pages[idx];
-        if (next_pages == NULL) {
-			if (!create) {
-				// vaddr not found.
-				return 0;
-			}
-			// Allocate and install next level page table.
-			// See VM locking order at top of vm.c.
-			lock_release(as->pages_lock);
-            next_pages = kmalloc(sizeof(void *) * (1 << VPN_BITS_PER_LEVEL));
-			lock_acquire(as->pages_lock);
-            if (next_pages == NULL) {
-                return ENOMEM;
-			}
-			bzero(next_pages, sizeof(void *) * (1 << VPN_BITS_PER_LEVEL));
-			pages[idx] = next_pages;
-		}
-		pages = next_pages;
-	}
-
-	// Get base address of leaf table.
-	idx = (vpn & mask[level]) >> shift[level];
-	leaf_pages = (struct pte *)(pages[idx]);
-	if (leaf_pages == NULL) {
+	d = PT_DIR_INDEX(vaddr);
+	leaf = as->pt_dir[d];
+	if (leaf == NULL) {
         if (!create) {
             // vaddr not found.
             return 0;
         }
         // Release page table before potential eviction.
         lock_release(as->pages_lock);
-        leaf_pages = kmalloc(sizeof(struct pte) * (1 << VPN_BITS_PER_LEVEL));
+        leaf = (pte_t *)alloc_kpages(1);
         lock_acquire(as->pages_lock);
-		if (leaf_pages == NULL) {
+		if (leaf == NULL) {
 			return ENOMEM;
 		}
-		// Install and initialize leaf ptes.
-        pages[idx] = leaf_pages;
-        for (idx = 0; idx < (1 << VPN_BITS_PER_LEVEL); idx++) {
-            leaf_pages[idx].status = 0;
-            leaf_pages[idx].block_index = 0;
-            leaf_pages[idx].paddr = (paddr_t)NULL;
-        }
+		if (as->pt_dir[d] != NULL) {
+			// Installed while we were allocating.
+			free_kpages((vaddr_t)leaf);
+			leaf = as->pt_dir[d];
+		} else {
+			// Pages come zeroed, so every entry is empty.
+			as->pt_dir[d] = leaf;
+		}
     }
-	level++;
-	idx = (vpn & mask[level]) >> shift[level];
-    *pte_ptr = leaf_pages + idx;
+    *pte_ptr = &leaf[PT_LEAF_INDEX(vaddr)];
     return 0;
 }
 
@@ -715,11 +841,11 @@ touch_pte(struct addrspace *as, vaddr_t vaddr, int create, struct pte **pte_ptr)
  *   Pointer to pte else NULL if could not find and create.
  */
 
-struct pte
+pte_t
 *as_touch_pte(struct addrspace *as, vaddr_t vaddr)
 {
 	int result;
-	struct pte *pte;
+	pte_t *pte;
 
 	result = touch_pte(as, vaddr, /*create=*/1, &pte);
 	if (result) {
@@ -736,23 +862,21 @@ struct pte
  * Returns:
  *   Pointer to pte or NULL if not found.
  */
-struct pte
+pte_t
 *as_lookup_pte(struct addrspace *as, vaddr_t vaddr)
 {
 	int result;
-	struct pte *pte;
+	pte_t *pte;
 
 	result = touch_pte(as, vaddr, /*create=*/0, &pte);
 	KASSERT(result == 0);
-	if (pte == NULL) {
-		return NULL;
-	}
 	return pte;
 }
 
 /*
  * Frees physical page corresponding to vaddr.
- * If page does not exist do nothing.
+ * If page does not exist do nothing.  Once every entry in its leaf
+ * table is empty, the leaf table is freed too.
  * 
  * Args:
  *   as: Pointer to address space to modify.
@@ -761,7 +885,9 @@ struct pte
 void
 as_destroy_page(struct addrspace *as, vaddr_t vaddr)
 {
-	struct pte *pte;
+	pte_t *pte;
+	pte_t *leaf;
+	unsigned d, l, i;
 
 	lock_acquire(as->pages_lock);
 	pte = as_lookup_pte(as, vaddr);
@@ -770,14 +896,21 @@ as_destroy_page(struct addrspace *as, vaddr_t vaddr)
 		lock_release(as->pages_lock);
 		return;
 	}
-	if (pte->status & VM_PTE_VALID) {
-        free_pages(pte->paddr);
+	destroy_pte(pte);
+
+	// Look for another entry in use, starting after this one since
+	// sbrk frees pages in ascending order.
+	d = PT_DIR_INDEX(vaddr);
+	l = PT_LEAF_INDEX(vaddr);
+	leaf = as->pt_dir[d];
+	for (i = 1; i < PT_ENTRIES; i++) {
+		if (leaf[(l + i) % PT_ENTRIES] != 0) {
+			break;
+		}
+	}
+	if (i == PT_ENTRIES) {
+		as->pt_dir[d] = NULL;
+		free_kpages((vaddr_t)leaf);
 	}
-	if (pte->status & VM_PTE_BACKED) {
-        free_swapmap_block(pte->block_index);
-    }
-	pte->status = 0;
-	pte->block_index = 0;
-	pte->paddr = (paddr_t)NULL;
 	lock_release(as->pages_lock);
 }
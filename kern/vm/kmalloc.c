@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include <kern/test161.h>
 #include <test.h>
 
@@ -807,6 +810,9 @@ kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	/* Blocks cached in magazines would show as allocated. */
+	kheap_drain();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -830,6 +836,13 @@ kheap_getused(void) {
 	unsigned long total = 0;
 	unsigned int num_pages = 0, coremap_bytes = 0;
 
+	/*
+	 * This also empties the per-cpu magazines (see kheap_drain), so
+	 * blocks cached there aren't counted as used. It takes
+	 * kmalloc_spinlock, so do it first.
+	 */
+	coremap_bytes = coremap_used_bytes();
+
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
@@ -837,8 +850,6 @@ kheap_getused(void) {
 		num_pages++;
 	}
 
-	coremap_bytes = coremap_used_bytes();
-
 	// Don't double-count the pages we're using for subpage allocation;
 	// we've already accounted for the used portion.
 	if (coremap_bytes > 0) {
@@ -914,6 +925,43 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take the first block off the free list of page PR, which must have
+ * one. Must hold kmalloc_spinlock.
+ */
+static
+void *
+subpage_popblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -969,25 +1017,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_popblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1023,6 +1053,8 @@ subpage_kmalloc(size_t sz
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
+	/* Let kfree find the block size without searching (see below). */
+	coremap_set_ktag(prpage, blktype);
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
@@ -1066,15 +1098,17 @@ subpage_kmalloc(size_t sz
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Return the block at PTRADDR to the free list of its page. If the
+ * block is not on any heap page we recognize, return -1. If this
+ * frees the whole page, the page is taken off the lists and left in
+ * *FREEPAGE for the caller to pass to free_kpages once the spinlock is
+ * dropped; otherwise *FREEPAGE is set to 0. Must hold kmalloc_spinlock.
  */
 static
 int
-subpage_kfree(void *ptr)
+subpage_putblock(vaddr_t ptraddr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -1084,32 +1118,8 @@ subpage_kfree(void *ptr)
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	*freepage = 0;
 
 	checksubpages();
 
@@ -1133,7 +1143,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -1141,7 +1150,8 @@ subpage_kfree(void *ptr)
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
 	}
 
 #ifdef GUARDS
@@ -1190,12 +1200,59 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// heap page to give back, if any
+	int result;
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+	result = subpage_putblock(ptraddr, &freepage);
+	spinlock_release(&kmalloc_spinlock);
+	if (result) {
+		return -1;
+	}
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1207,6 +1264,286 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+// Each CPU keeps a small stack ("magazine") of free blocks of each
+// subpage size in front of the pools above. kmalloc and kfree of a
+// subpage block normally just pop or push the current CPU's magazine,
+// under that CPU's own spinlock, which nobody else takes except to
+// drain. Only when a magazine runs empty or full do we go to the
+// pools, moving KMAG_BATCH blocks under one acquisition of
+// kmalloc_spinlock.
+//
+// To push a block on free without searching the pools we need its
+// size. Subpage pages are tagged with their block size in the coremap
+// (see coremap_set_ktag); blocks on untagged pages (those allocated
+// before the VM system was up) take the old path.
+//
+// Blocks in magazines count as in use as far as the pools are
+// concerned, so everything that reports on the heap drains the
+// magazines first (kheap_drain). The VM system also calls kheap_drain
+// when memory is short.
+//
+// Magazines are not used with GUARDS or LABELS, which need every
+// allocation and free to go through the pools.
+//
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define KMAGAZINES
+#endif
+
+#ifdef KMAGAZINES
+
+#define KMAG_ROUNDS	16	/* Blocks per magazine */
+#define KMAG_BATCH	8	/* Blocks moved per refill or drain */
+
+struct kmagazine {
+	struct spinlock km_lock;
+	unsigned km_count[NSIZES];
+	void *km_rounds[NSIZES][KMAG_ROUNDS];
+};
+
+/* Indexed by cpu number; created on first use on each cpu. */
+static struct kmagazine *kmagazines[MAXCPUS];
+
+/*
+ * Get the current cpu's magazines, creating them if need be. Returns
+ * NULL if there's no curcpu yet or we're out of memory, in which case
+ * the caller should use the pools directly.
+ */
+static
+struct kmagazine *
+kmag_get(void)
+{
+	struct kmagazine *km;
+	unsigned num;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	/*
+	 * If we migrate after reading the cpu number we just use
+	 * another cpu's magazines, which is safe since they're locked.
+	 */
+	num = curcpu->c_number;
+	KASSERT(num < MAXCPUS);
+	km = kmagazines[num];
+	if (km != NULL) {
+		return km;
+	}
+
+	km = subpage_kmalloc(sizeof(*km));
+	if (km == NULL) {
+		return NULL;
+	}
+	spinlock_init(&km->km_lock);
+	bzero(km->km_count, sizeof(km->km_count));
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (kmagazines[num] == NULL) {
+		kmagazines[num] = km;
+		km = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	if (km != NULL) {
+		/* Lost a race with ourselves on another cpu. */
+		spinlock_cleanup(&km->km_lock);
+		subpage_kfree(km);
+	}
+	return kmagazines[num];
+}
+
+/*
+ * Take up to N blocks of type BLKTYPE from the pools, without
+ * allocating new pages. Returns the number taken.
+ */
+static
+unsigned
+kmag_fill(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	unsigned got = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_popblock(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Return N blocks to the pools. Returns the number of heap pages this
+ * gave back to the VM system.
+ */
+static
+unsigned
+kmag_spill(void **blocks, unsigned n)
+{
+	vaddr_t freepages[KMAG_ROUNDS];
+	unsigned nfreed, i, j;
+	int result;
+
+	nfreed = 0;
+	for (i=0; i<n; i += KMAG_ROUNDS) {
+		j = 0;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (; i + j < n && j < KMAG_ROUNDS; j++) {
+			result = subpage_putblock((vaddr_t)blocks[i + j],
+						  &freepages[j]);
+			KASSERT(result == 0);
+		}
+		spinlock_release(&kmalloc_spinlock);
+		while (j > 0) {
+			j--;
+			if (freepages[j] != 0) {
+				free_kpages(freepages[j]);
+				nfreed++;
+			}
+		}
+	}
+	return nfreed;
+}
+
+/*
+ * Allocate a block of type BLKTYPE through the current cpu's
+ * magazine. Returns NULL if the caller should use subpage_kmalloc.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmagazine *km;
+	void *blocks[KMAG_BATCH];
+	void *ret;
+	unsigned n;
+
+	km = kmag_get();
+	if (km == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] > 0) {
+		ret = km->km_rounds[blktype][--km->km_count[blktype]];
+		spinlock_release(&km->km_lock);
+		return ret;
+	}
+	spinlock_release(&km->km_lock);
+
+	/* Empty; reload a batch from the pools. */
+	n = kmag_fill(blktype, blocks, KMAG_BATCH);
+	if (n == 0) {
+		/* The pools need a new page; let subpage_kmalloc do it. */
+		return NULL;
+	}
+	ret = blocks[--n];
+
+	spinlock_acquire(&km->km_lock);
+	while (n > 0 && km->km_count[blktype] < KMAG_ROUNDS) {
+		km->km_rounds[blktype][km->km_count[blktype]++] = blocks[--n];
+	}
+	spinlock_release(&km->km_lock);
+
+	/* Someone else refilled it meanwhile; give back the excess. */
+	if (n > 0) {
+		kmag_spill(blocks, n);
+	}
+	return ret;
+}
+
+/*
+ * Free PTR through the current cpu's magazine. Returns -1 if it is
+ * not a block on a tagged subpage page, in which case the caller
+ * should use subpage_kfree.
+ */
+static
+int
+kmag_free(void *ptr)
+{
+	struct kmagazine *km;
+	void *blocks[KMAG_BATCH];
+	unsigned n, blktype;
+	int tag;
+
+	tag = coremap_get_ktag((vaddr_t)ptr);
+	if (tag < 0) {
+		return -1;
+	}
+	blktype = tag;
+	KASSERT(blktype < NSIZES);
+	if ((vaddr_t)ptr % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	km = kmag_get();
+	if (km == NULL) {
+		return -1;
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	n = 0;
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] == KMAG_ROUNDS) {
+		/* Full; take a batch out to return to the pools. */
+		while (n < KMAG_BATCH) {
+			blocks[n++] =
+				km->km_rounds[blktype][--km->km_count[blktype]];
+		}
+	}
+	km->km_rounds[blktype][km->km_count[blktype]++] = ptr;
+	spinlock_release(&km->km_lock);
+
+	if (n > 0) {
+		kmag_spill(blocks, n);
+	}
+	return 0;
+}
+
+#endif /* KMAGAZINES */
+
+/*
+ * Return every block held in per-cpu magazines to the pools. Returns
+ * the number of heap pages given back to the VM system as a result.
+ */
+unsigned
+kheap_drain(void)
+{
+	unsigned nfreed = 0;
+#ifdef KMAGAZINES
+	struct kmagazine *km;
+	void *blocks[KMAG_ROUNDS];
+	unsigned i, n;
+	unsigned blktype;
+
+	for (i=0; i<MAXCPUS; i++) {
+		km = kmagazines[i];
+		if (km == NULL) {
+			continue;
+		}
+		for (blktype = 0; blktype < NSIZES; blktype++) {
+			spinlock_acquire(&km->km_lock);
+			n = km->km_count[blktype];
+			memcpy(blocks, km->km_rounds[blktype],
+			       n * sizeof(blocks[0]));
+			km->km_count[blktype] = 0;
+			spinlock_release(&km->km_lock);
+			nfreed += kmag_spill(blocks, n);
+		}
+	}
+#endif
+	return nfreed;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1246,6 +1583,17 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef KMAGAZINES
+	{
+		void *ptr;
+
+		ptr = kmag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1264,7 +1612,13 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef KMAGAZINES
+	if (kmag_free(ptr) == 0) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
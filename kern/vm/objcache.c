@@ -0,0 +1,374 @@
+/*
+ * Object caches (slab allocator). See objcache.h.
+ *
+ * Each slab is one page. The slab header sits at the start of the
+ * page, followed by a stack of free object indices, followed by the
+ * objects themselves, so the slab for any object is found by masking
+ * its address. Free objects stay constructed, which is why the free
+ * list is kept in the header rather than threaded through the objects.
+ *
+ * A cache keeps three lists: slabs with some objects free (partial),
+ * slabs with none free (full) and slabs with all free (empty).
+ * Allocation prefers partial slabs so empty ones can be given back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+// Fully free slabs kept per cache before giving pages back.
+#define OBJCACHE_EMPTY_MAX 1
+
+// Objects are aligned to this.
+#define OBJCACHE_ALIGN 8
+
+struct objslab {
+	struct objcache *os_cache;
+	struct objslab *os_next;
+	struct objslab *os_prev;
+	unsigned os_nfree;  // Entries in os_free.
+	uint16_t os_free[];  // Indices of free objects.
+};
+
+struct objcache {
+	char *oc_name;
+	size_t oc_size;  // Object size, rounded up to OBJCACHE_ALIGN.
+	unsigned oc_perslab;  // Objects per slab.
+	size_t oc_offset;  // Offset of first object in slab.
+	objcache_ctor oc_ctor;
+	objcache_dtor oc_dtor;
+	struct spinlock oc_lock;  // Protects slab lists and counts.
+	struct objslab *oc_partial;
+	struct objslab *oc_full;
+	struct objslab *oc_empty;
+	unsigned oc_nempty;
+	unsigned oc_nslabs;
+	unsigned oc_inuse;  // Objects handed out.
+	struct objcache *oc_next;  // Link on objcaches.
+};
+
+// All caches, for reclaim and stats.
+static struct spinlock objcaches_lock = SPINLOCK_INITIALIZER;
+static struct objcache *objcaches = NULL;
+
+static void
+slab_insert(struct objslab **list, struct objslab *slab)
+{
+	slab->os_prev = NULL;
+	slab->os_next = *list;
+	if (*list != NULL) {
+		(*list)->os_prev = slab;
+	}
+	*list = slab;
+}
+
+static void
+slab_remove(struct objslab **list, struct objslab *slab)
+{
+	if (slab->os_prev != NULL) {
+		slab->os_prev->os_next = slab->os_next;
+	} else {
+		KASSERT(*list == slab);
+		*list = slab->os_next;
+	}
+	if (slab->os_next != NULL) {
+		slab->os_next->os_prev = slab->os_prev;
+	}
+	slab->os_next = slab->os_prev = NULL;
+}
+
+static void *
+slab_obj(struct objcache *oc, struct objslab *slab, unsigned idx)
+{
+	return (char *)slab + oc->oc_offset + idx * oc->oc_size;
+}
+
+/*
+ * Destruct the objects in a slab and give its page back. The slab
+ * must be on no list and have every object free.
+ */
+static void
+slab_destroy(struct objcache *oc, struct objslab *slab)
+{
+	KASSERT(slab->os_nfree == oc->oc_perslab);
+	if (oc->oc_dtor != NULL) {
+		for (unsigned i = 0; i < oc->oc_perslab; i++) {
+			oc->oc_dtor(slab_obj(oc, slab, i));
+		}
+	}
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Get a page and construct a slab's worth of objects in it. Called
+ * without the cache lock. Returns NULL if out of memory or a
+ * constructor fails.
+ */
+static struct objslab *
+slab_create(struct objcache *oc)
+{
+	struct objslab *slab;
+	unsigned i;
+	int result;
+
+	slab = (struct objslab *)alloc_kpages(1);
+	if (slab == NULL) {
+		return NULL;
+	}
+	slab->os_cache = oc;
+	slab->os_next = slab->os_prev = NULL;
+	for (i = 0; i < oc->oc_perslab; i++) {
+		if (oc->oc_ctor != NULL) {
+			result = oc->oc_ctor(slab_obj(oc, slab, i));
+			if (result) {
+				// Undo the ones already built.
+				while (i > 0) {
+					i--;
+					if (oc->oc_dtor != NULL) {
+						oc->oc_dtor(slab_obj(oc, slab, i));
+					}
+				}
+				free_kpages((vaddr_t)slab);
+				return NULL;
+			}
+		}
+		// Hand out low indices first.
+		slab->os_free[oc->oc_perslab - 1 - i] = i;
+	}
+	slab->os_nfree = oc->oc_perslab;
+	return slab;
+}
+
+/*
+ * Create a cache of objects of SIZE bytes. Returns NULL if out of
+ * memory.
+ */
+struct objcache *
+objcache_create(const char *name, size_t size,
+		objcache_ctor ctor, objcache_dtor dtor)
+{
+	struct objcache *oc;
+	unsigned n;
+	size_t offset;
+
+	KASSERT(size > 0 && size <= PAGE_SIZE / 4);
+
+	oc = kmalloc(sizeof(struct objcache));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = kstrdup(name);
+	if (oc->oc_name == NULL) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_size = ROUNDUP(size, OBJCACHE_ALIGN);
+
+	// Fit as many objects as we can after the header and index stack.
+	n = (PAGE_SIZE - sizeof(struct objslab)) /
+		(oc->oc_size + sizeof(uint16_t));
+	for (;;) {
+		offset = ROUNDUP(sizeof(struct objslab) + n * sizeof(uint16_t),
+			OBJCACHE_ALIGN);
+		if (offset + n * oc->oc_size <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	KASSERT(n > 0);
+	oc->oc_perslab = n;
+	oc->oc_offset = offset;
+
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = oc->oc_full = oc->oc_empty = NULL;
+	oc->oc_nempty = 0;
+	oc->oc_nslabs = 0;
+	oc->oc_inuse = 0;
+
+	spinlock_acquire(&objcaches_lock);
+	oc->oc_next = objcaches;
+	objcaches = oc;
+	spinlock_release(&objcaches_lock);
+
+	return oc;
+}
+
+/*
+ * Destroy a cache. Every object must have been freed, and nobody may
+ * be reclaiming at the same time.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **prev;
+	struct objslab *slab;
+
+	KASSERT(oc->oc_inuse == 0);
+	KASSERT(oc->oc_partial == NULL);
+	KASSERT(oc->oc_full == NULL);
+
+	spinlock_acquire(&objcaches_lock);
+	for (prev = &objcaches; *prev != oc; prev = &(*prev)->oc_next) {
+		KASSERT(*prev != NULL);
+	}
+	*prev = oc->oc_next;
+	spinlock_release(&objcaches_lock);
+
+	while ((slab = oc->oc_empty) != NULL) {
+		slab_remove(&oc->oc_empty, slab);
+		slab_destroy(oc, slab);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc->oc_name);
+	kfree(oc);
+}
+
+/*
+ * Get a constructed object. Returns NULL if out of memory.
+ */
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *slab;
+	unsigned idx;
+
+	spinlock_acquire(&oc->oc_lock);
+	slab = oc->oc_partial;
+	if (slab == NULL && oc->oc_empty != NULL) {
+		slab = oc->oc_empty;
+		slab_remove(&oc->oc_empty, slab);
+		oc->oc_nempty--;
+		slab_insert(&oc->oc_partial, slab);
+	}
+	if (slab == NULL) {
+		// Build a new slab without the lock; constructors may sleep.
+		spinlock_release(&oc->oc_lock);
+		slab = slab_create(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		oc->oc_nslabs++;
+		slab_insert(&oc->oc_partial, slab);
+	}
+
+	KASSERT(slab->os_nfree > 0);
+	idx = slab->os_free[--slab->os_nfree];
+	KASSERT(idx < oc->oc_perslab);
+	if (slab->os_nfree == 0) {
+		slab_remove(&oc->oc_partial, slab);
+		slab_insert(&oc->oc_full, slab);
+	}
+	oc->oc_inuse++;
+	spinlock_release(&oc->oc_lock);
+
+	return slab_obj(oc, slab, idx);
+}
+
+/*
+ * Return a constructed object to its cache.
+ */
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *slab, *victim;
+	vaddr_t offset;
+	unsigned idx;
+
+	slab = (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->os_cache == oc);
+	offset = (vaddr_t)obj - (vaddr_t)slab;
+	KASSERT(offset >= oc->oc_offset);
+	KASSERT((offset - oc->oc_offset) % oc->oc_size == 0);
+	idx = (offset - oc->oc_offset) / oc->oc_size;
+	KASSERT(idx < oc->oc_perslab);
+
+	victim = NULL;
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(slab->os_nfree < oc->oc_perslab);
+	if (slab->os_nfree == 0) {
+		slab_remove(&oc->oc_full, slab);
+		slab_insert(&oc->oc_partial, slab);
+	}
+	slab->os_free[slab->os_nfree++] = idx;
+	oc->oc_inuse--;
+	if (slab->os_nfree == oc->oc_perslab) {
+		slab_remove(&oc->oc_partial, slab);
+		if (oc->oc_nempty < OBJCACHE_EMPTY_MAX) {
+			slab_insert(&oc->oc_empty, slab);
+			oc->oc_nempty++;
+		} else {
+			victim = slab;
+			oc->oc_nslabs--;
+		}
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (victim != NULL) {
+		slab_destroy(oc, victim);
+	}
+}
+
+/*
+ * Give back every fully free slab in every cache. Registered with
+ * vm_register_reclaim, and also used to settle memory accounting.
+ *
+ * Destructors may free objects into other caches (a lock's wchan,
+ * say) and so empty more slabs; repeat until nothing is left.
+ */
+unsigned
+objcache_reclaim(unsigned npages)
+{
+	struct objcache *oc;
+	struct objslab *slab, *victims;
+	unsigned freed, total;
+
+	(void)npages;
+
+	total = 0;
+	do {
+		// Detach the slabs under the locks; destruct them without.
+		victims = NULL;
+		spinlock_acquire(&objcaches_lock);
+		for (oc = objcaches; oc != NULL; oc = oc->oc_next) {
+			spinlock_acquire(&oc->oc_lock);
+			while ((slab = oc->oc_empty) != NULL) {
+				slab_remove(&oc->oc_empty, slab);
+				oc->oc_nempty--;
+				oc->oc_nslabs--;
+				slab_insert(&victims, slab);
+			}
+			spinlock_release(&oc->oc_lock);
+		}
+		spinlock_release(&objcaches_lock);
+
+		freed = 0;
+		while ((slab = victims) != NULL) {
+			slab_remove(&victims, slab);
+			slab_destroy(slab->os_cache, slab);
+			freed++;
+		}
+		total += freed;
+	} while (freed > 0);
+	return total;
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	spinlock_acquire(&objcaches_lock);
+	kprintf("%-16s %6s %6s %6s %6s\n",
+		"cache", "size", "slabs", "inuse", "free");
+	for (oc = objcaches; oc != NULL; oc = oc->oc_next) {
+		kprintf("%-16s %6u %6u %6u %6u\n", oc->oc_name,
+			(unsigned)oc->oc_size, oc->oc_nslabs, oc->oc_inuse,
+			oc->oc_nslabs * oc->oc_perslab - oc->oc_inuse);
+	}
+	spinlock_release(&objcaches_lock);
+}
@@ -0,0 +1,11 @@
+---
+name: "Read Self"
+description: >
+  Reads a program's own executable into untouched static buffers, so
+  the buffers are paged in from the same file during the read.
+tags: [vm]
+depends: [not-dumbvm-vm, /syscalls/readwritetest.t]
+sys161:
+  ram: 4M
+---
+$ /testbin/readself
@@ -0,0 +1,133 @@
+/*
+ * readself.c
+ *
+ * 	Reads this program's own executable into buffers whose pages
+ * 	have not been touched yet, so the kernel must page them in in
+ * 	the middle of the read: a .bss buffer bigger than the whole
+ * 	file, and the start of the file into a .data buffer, which is
+ * 	paged in from the executable being read.  Checks the contents
+ * 	against a second read into a buffer that is already resident.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test161/test161.h>
+
+#define PROGNAME "/testbin/readself"
+#define BUFSIZE (128 * 1024)
+#define DATASIZE (4 * 4096)
+#define CHUNK 512
+
+// Untouched until read() fills them.  Only databuf's first byte is
+// initialized, which is enough to put it in .data, and it is kept
+// small so the executable stays well under BUFSIZE.
+static char bssbuf[BUFSIZE];
+static char databuf[DATASIZE] = { 1 };
+
+static
+size_t
+filesize(const char *path)
+{
+	off_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		err(1, "%s: lseek", path);
+	}
+	close(fd);
+	return size;
+}
+
+static
+size_t
+readall(const char *path, char *buf, size_t len)
+{
+	int fd;
+	int result;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+	result = read(fd, buf, len);
+	if (result < 0) {
+		err(1, "%s: read", path);
+	}
+	close(fd);
+	return result;
+}
+
+static
+void
+check(const char *path, const char *buf, size_t len)
+{
+	char chunk[CHUNK];
+	size_t pos;
+	int fd;
+	int result;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+	for (pos = 0; pos < len; pos += result) {
+		result = read(fd, chunk,
+			len - pos < sizeof(chunk) ? len - pos : sizeof(chunk));
+		if (result <= 0) {
+			errx(1, "%s: short read at %lu", path, (unsigned long)pos);
+		}
+		if (memcmp(chunk, buf + pos, result)) {
+			errx(1, "%s: mismatch at %lu", path, (unsigned long)pos);
+		}
+	}
+	close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path;
+	size_t size;
+	size_t len;
+
+	path = (argc > 0 && argv[0] != NULL) ? argv[0] : PROGNAME;
+	size = filesize(path);
+	if (size >= sizeof(bssbuf)) {
+		errx(1, "%s: %lu bytes, bigger than test buffer", path,
+		     (unsigned long)size);
+	}
+	if (size <= sizeof(databuf)) {
+		errx(1, "%s: %lu bytes, smaller than its own .data", path,
+		     (unsigned long)size);
+	}
+
+	// Ask for more than the file holds; read stops at its end.
+	len = readall(path, bssbuf, sizeof(bssbuf));
+	if (len != size) {
+		errx(1, "%s: read %lu of %lu bytes", path,
+		     (unsigned long)len, (unsigned long)size);
+	}
+	if (bssbuf[0] != 0x7f || memcmp(bssbuf + 1, "ELF", 3)) {
+		errx(1, "%s: not an ELF file", path);
+	}
+	check(path, bssbuf, len);
+	tprintf("read %lu bytes into .bss\n", (unsigned long)len);
+
+	len = readall(path, databuf, sizeof(databuf));
+	if (len != sizeof(databuf)) {
+		errx(1, "%s: read %lu of %lu bytes", path,
+		     (unsigned long)len, (unsigned long)sizeof(databuf));
+	}
+	check(path, databuf, len);
+	tprintf("read %lu bytes into .data\n", (unsigned long)len);
+
+	success(TEST161_SUCCESS, SECRET, "/testbin/readself");
+	return 0;
+}